@@ -0,0 +1,43 @@
+#ifndef RUJA_ARENA_H
+#define RUJA_ARENA_H
+
+#include "common.h"
+#include "memory.h"
+
+typedef struct Arena_Chunk {
+    struct Arena_Chunk* next;
+    size_t capacity;
+    size_t used;
+    max_align_t data[]; // max_align_t so every allocation is suitably aligned
+} Arena_Chunk;
+
+// Bump pointer allocator. Individual allocations are never freed, the whole arena is
+// released at once by arena_free.
+typedef struct {
+    Ruja_Allocator allocator;
+    Arena_Chunk* chunks; // The chunk being filled is the head of the list
+    size_t chunk_size;
+} Ruja_Arena;
+
+#define ARENA_MIN_CHUNK_SIZE 512
+#define ARENA_DEFAULT_CHUNK_SIZE (16 * 1024)
+#define ARENA_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
+/**
+ * @brief Creates an empty arena. The first chunk is the smallest power of two that holds
+ *      size_hint bytes, ARENA_DEFAULT_CHUNK_SIZE if there is no hint. Later chunks double.
+ *      The chunks come from allocator, NULL for the default one.
+ */
+Ruja_Arena* arena_new(size_t size_hint, const Ruja_Allocator* allocator);
+void arena_free(Ruja_Arena* arena);
+
+void* arena_alloc(Ruja_Arena* arena, size_t size);
+void* arena_copy(Ruja_Arena* arena, const void* data, size_t size);
+
+/**
+ * @brief Moves every chunk of other into arena and frees other. Allocations made from other
+ *      stay valid and are released together with arena. Both must have the same allocator.
+ */
+void arena_adopt(Ruja_Arena* arena, Ruja_Arena* other);
+
+#endif // RUJA_ARENA_H
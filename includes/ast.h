@@ -6,6 +6,7 @@
 #include "common.h"
 #include "lexer.h"
 #include "word.h"
+#include "arena.h"
 
 typedef enum {
     AST_UNARY_OP_NEG,
@@ -158,33 +159,33 @@ typedef struct Ruja_Ast_Node {
     } as;
 } *Ruja_Ast;
 
-Ruja_Ast ast_new();
-void ast_free(Ruja_Ast ast);
+Ruja_Ast ast_new(Ruja_Arena* arena);
+Ruja_Token* ast_copy_token(Ruja_Arena* arena, Ruja_Token* token);
 
-Ruja_Ast ast_new_literal(Ruja_Token* literal_token);
-Ruja_Ast ast_new_identifier(Ruja_Token* identifier_token);
-Ruja_Ast ast_new_unary_op(Ruja_Token* unary_token, Ruja_Ast expression);
-Ruja_Ast ast_new_binary_op(Ruja_Token* binary_token, Ruja_Ast left_expression, Ruja_Ast right_expression);
-Ruja_Ast ast_new_ternary_op(Ruja_Token* tok_question, Ruja_Token* tok_colon, Ruja_Ast condition, Ruja_Ast true_expression, Ruja_Ast false_expression);
-Ruja_Ast ast_new_expression(Ruja_Ast expression);
+Ruja_Ast ast_new_literal(Ruja_Arena* arena, Ruja_Token* literal_token);
+Ruja_Ast ast_new_identifier(Ruja_Arena* arena, Ruja_Token* identifier_token);
+Ruja_Ast ast_new_unary_op(Ruja_Arena* arena, Ruja_Token* unary_token, Ruja_Ast expression);
+Ruja_Ast ast_new_binary_op(Ruja_Arena* arena, Ruja_Token* binary_token, Ruja_Ast left_expression, Ruja_Ast right_expression);
+Ruja_Ast ast_new_ternary_op(Ruja_Arena* arena, Ruja_Token* tok_question, Ruja_Token* tok_colon, Ruja_Ast condition, Ruja_Ast true_expression, Ruja_Ast false_expression);
+Ruja_Ast ast_new_expression(Ruja_Arena* arena, Ruja_Ast expression);
 
-Ruja_Ast ast_new_assign(Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
-Ruja_Ast ast_new_typed_decl(Ruja_Token* dtype_token, Ruja_Ast identifier);
-Ruja_Ast ast_new_typed_decl_assign(Ruja_Token* dtype_token, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
-Ruja_Ast ast_new_inferred_decl_assign(Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
+Ruja_Ast ast_new_assign(Ruja_Arena* arena, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
+Ruja_Ast ast_new_typed_decl(Ruja_Arena* arena, Ruja_Token* dtype_token, Ruja_Ast identifier);
+Ruja_Ast ast_new_typed_decl_assign(Ruja_Arena* arena, Ruja_Token* dtype_token, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
+Ruja_Ast ast_new_inferred_decl_assign(Ruja_Arena* arena, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression);
 
-Ruja_Ast ast_new_if_stmt(Ruja_Token* if_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt);
-Ruja_Ast ast_new_elif_stmt(Ruja_Token* elif_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt);
-Ruja_Ast ast_new_else_stmt(Ruja_Token* else_token, Ruja_Ast body);
+Ruja_Ast ast_new_if_stmt(Ruja_Arena* arena, Ruja_Token* if_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt);
+Ruja_Ast ast_new_elif_stmt(Ruja_Arena* arena, Ruja_Token* elif_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt);
+Ruja_Ast ast_new_else_stmt(Ruja_Arena* arena, Ruja_Token* else_token, Ruja_Ast body);
 
-Ruja_Ast ast_new_ranged_iter(Ruja_Ast start_expr, Ruja_Ast end_expr, Ruja_Ast step_expr);
-Ruja_Ast ast_new_for_loop(Ruja_Token* for_token, Ruja_Ast identifier, Ruja_Ast iter, Ruja_Ast body);
-Ruja_Ast ast_new_while_loop(Ruja_Token* while_token, Ruja_Ast condition, Ruja_Ast body);
+Ruja_Ast ast_new_ranged_iter(Ruja_Arena* arena, Ruja_Ast start_expr, Ruja_Ast end_expr, Ruja_Ast step_expr);
+Ruja_Ast ast_new_for_loop(Ruja_Arena* arena, Ruja_Token* for_token, Ruja_Ast identifier, Ruja_Ast iter, Ruja_Ast body);
+Ruja_Ast ast_new_while_loop(Ruja_Arena* arena, Ruja_Token* while_token, Ruja_Ast condition, Ruja_Ast body);
 
-Ruja_Ast ast_new_struct_members(Ruja_Ast identifier_token, Ruja_Ast next_member);
-Ruja_Ast ast_new_struct_def(Ruja_Token* struct_token, Ruja_Ast identifier_token, Ruja_Ast members);
+Ruja_Ast ast_new_struct_members(Ruja_Arena* arena, Ruja_Ast identifier_token, Ruja_Ast next_member);
+Ruja_Ast ast_new_struct_def(Ruja_Arena* arena, Ruja_Token* struct_token, Ruja_Ast identifier_token, Ruja_Ast members);
 
-Ruja_Ast ast_new_stmt(Ruja_Ast statement, Ruja_Ast next);
+Ruja_Ast ast_new_stmt(Ruja_Arena* arena, Ruja_Ast statement, Ruja_Ast next);
 
 void ast_dot(Ruja_Ast ast, FILE *file);
 
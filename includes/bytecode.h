@@ -2,38 +2,129 @@
 #define RUJA_BYTECODE_H
 
 #include "common.h"
+#include "memory.h"
 #include "word.h"
 
-typedef enum {
-    OP_HALT,
-
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
+#include <string.h>
+
+/*
+ * The instruction set. An instruction is its opcode byte followed by up to two operands, stored
+ * in native byte order. This table is the only place that knows their widths (in bytes, 0 for
+ * an operand the instruction does not have): the compiler, the vm, the disassembler and the
+ * serializer all go through it.
+ *
+ *  X(name, width of the first operand, width of the second operand)
+ */
+#define RUJA_OPCODES(X) \
+    X(HALT, 0, 0) \
+    \
+    X(NIL, 0, 0) \
+    X(TRUE, 0, 0) \
+    X(FALSE, 0, 0) \
+    \
+    X(NOT, 0, 0) \
+    X(NEG, 0, 0) \
+    \
+    X(ADD, 0, 0) \
+    X(SUB, 0, 0) \
+    X(MUL, 0, 0) \
+    X(DIV, 0, 0) \
+    X(MOD, 0, 0) \
+    X(CONCAT_N, 1, 0)  /* Joins as many strings as its operand into one, for a '+' chain */ \
+    \
+    X(EQ, 0, 0) \
+    X(NEQ, 0, 0) \
+    X(LT, 0, 0) \
+    X(LTE, 0, 0) \
+    X(GT, 0, 0) \
+    X(GTE, 0, 0) \
+    \
+    X(AND, 0, 0) \
+    X(OR, 0, 0) \
+    \
+    /* Jump operands are distances from the start of the instruction */ \
+    X(JUMP, 4, 0) \
+    X(JZ, 4, 0) \
+    X(LOOP, 4, 0)      /* Jumps backward */ \
+    X(FOR_PREP, 2, 4)  /* Slot of the range, forward jump past the loop if it is empty */ \
+    X(FOR_RANGE, 2, 4) /* Slot of the range, backward jump to the body while it is not over */ \
+    \
+    X(POP, 2, 0)       /* Pops as many words as its operand */ \
+    \
+    X(CONST, 4, 0) \
+    X(CONST8, 1, 0)    /* Constant whose index fits in a byte */ \
+    \
+    /* Integers carried in the instruction, without a trip to the constant pool */ \
+    X(PUSH_ZERO, 0, 0) \
+    X(PUSH_ONE, 0, 0) \
+    X(PUSH_I8, 1, 0) \
+    X(PUSH_I32, 4, 0) \
+    \
+    /* The operand is a slot resolved by the compiler, names are never looked up at run time */ \
+    X(GET_LOCAL, 2, 0) \
+    X(SET_LOCAL, 2, 0) \
+    X(GET_GLOBAL, 4, 0) \
+    X(SET_GLOBAL, 4, 0) \
+    \
+    /* In place updates of a variable, for compound assignments. The value is never pushed */ \
+    X(INC_LOCAL, 2, 0) \
+    X(INC_GLOBAL, 4, 0) \
+    X(ADD_LOCAL_CONST, 2, 4)  /* Slot, i32 added to it */ \
+    X(ADD_GLOBAL_CONST, 4, 4) \
+    X(ADD_LOCAL, 2, 0)        /* Pops the value added to the slot */ \
+    X(ADD_GLOBAL, 4, 0)
 
-    OP_NOT,
-    OP_NEG,
+typedef enum {
+#define X(name, width0, width1) OP_##name,
+    RUJA_OPCODES(X)
+#undef X
+} Opcode;
 
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
+// Constant expressions, so the vm decodes every operand with a fixed size load
+enum {
+#define X(name, width0, width1) OP_##name##_WIDTH0 = width0, OP_##name##_WIDTH1 = width1,
+    RUJA_OPCODES(X)
+#undef X
+};
 
-    OP_EQ,
-    OP_NEQ,
-    OP_LT,
-    OP_LTE,
-    OP_GT,
-    OP_GTE,
+#define OPCODE_COUNT (0 RUJA_OPCODES(OPCODE_ONE))
+#define OPCODE_ONE(name, width0, width1) + 1
 
-    OP_AND,
-    OP_OR,
+#define OPERAND_WIDTH(name, i) (OP_##name##_WIDTH##i)
+#define INSTRUCTION_SIZE(name) (1 + OP_##name##_WIDTH0 + OP_##name##_WIDTH1)
 
-    OP_JUMP,
-    OP_JZ,
+// Local slots and counts of locals are 2 byte operands
+#define MAX_LOCALS UINT16_MAX
 
-    OP_CONST,
-} Opcode;
+typedef struct {
+    const char* name;
+    uint8_t widths[2];
+} Opcode_Info;
+
+extern const Opcode_Info opcode_infos[OPCODE_COUNT];
+
+static inline size_t instruction_size(Opcode opcode) {
+    return 1 + (size_t) opcode_infos[opcode].widths[0] + opcode_infos[opcode].widths[1];
+}
+
+/**
+ * @brief Reads an operand of width bytes. With a constant width it compiles to a single load.
+ */
+static inline uint32_t read_operand(const uint8_t* at, size_t width) {
+    switch (width) {
+        case 1: return *at;
+        case 2: { uint16_t value; memcpy(&value, at, sizeof(value)); return value; }
+        default: { uint32_t value; memcpy(&value, at, sizeof(value)); return value; }
+    }
+}
+
+static inline void write_operand(uint8_t* at, size_t width, uint32_t value) {
+    switch (width) {
+        case 1: *at = (uint8_t) value; break;
+        case 2: { uint16_t narrow = (uint16_t) value; memcpy(at, &narrow, sizeof(narrow)); } break;
+        default: memcpy(at, &value, sizeof(value)); break;
+    }
+}
 
 typedef struct {
     size_t count;
@@ -41,8 +132,8 @@ typedef struct {
     Word* items;
 } Constants;
 
-Constants* constants_new();
-void constants_free(Constants* constants);
+Constants* constants_new(const Ruja_Allocator* allocator);
+void constants_free(const Ruja_Allocator* allocator, Constants* constants);
 
 typedef struct {
     size_t count;
@@ -51,22 +142,53 @@ typedef struct {
     size_t*  lines;
 
     Constants* constants;
+    Ruja_Allocator allocator;
+    bool out_of_memory; // An append failed, the code is incomplete and must not be run
 } Bytecode;
 
-Bytecode* bytecode_new();
+Bytecode* bytecode_new(const Ruja_Allocator* allocator);
 void bytecode_free(Bytecode* bytecode);
 
+/**
+ * @brief Appends a constant. If memory runs out the bytecode is marked out_of_memory, as it
+ *      is by the other appends, and the index returned must not be used.
+ */
 size_t add_constant(Bytecode* bytecode, Word word);
 void add_opcode(Bytecode* bytecode, uint8_t byte, size_t line);
-void add_operand(Bytecode* bytecode, size_t bytes, size_t line);
 
+/**
+ * @brief Appends an instruction, its operands are encoded with the widths of the opcode.
+ *      Operands the instruction does not have are ignored.
+ *
+ * @return size_t The offset of the instruction.
+ */
+size_t add_instruction(Bytecode* bytecode, Opcode opcode, uint32_t operand0, uint32_t operand1, size_t line);
+
+/**
+ * @brief Rewrites an operand of the instruction at offset, to patch jumps.
+ */
+void patch_operand(Bytecode* bytecode, size_t offset, size_t i, uint32_t operand);
 
-void print_operand(Bytecode* bytecode, size_t index, int format);
 const char* opcode_to_string(Opcode opcode);
 void disassemble(Bytecode* bytecode, const char* name);
 
-void save_bytecode(Bytecode* bytecode, const char* filename);
-Bytecode* load_bytecode(const char* filename);
+/**
+ * @brief Writes the code, the lines and the constants to a file. Strings are the only
+ *      objects that can be saved, they are interned again when loaded.
+ *
+ * @return false If the file could not be written.
+ */
+bool save_bytecode(Bytecode* bytecode, const char* filename);
+
+/**
+ * @brief Reads bytecode written by save_bytecode on a machine of the same byte order.
+ *      The instructions are checked: they only use existing constants, every jump lands
+ *      on the start of an instruction and the code ends with a HALT or a jump, so the vm
+ *      never reads past the code or the constants.
+ *
+ * @return Bytecode* The bytecode or NULL if the file could not be read or is invalid.
+ */
+Bytecode* load_bytecode(const char* filename, const Ruja_Allocator* allocator);
 
 
 
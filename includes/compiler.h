@@ -4,17 +4,31 @@
 #include "common.h"
 #include "vm.h"
 #include "ir.h"
+#include "symbol_table.h"
 
 typedef enum {
     RUJA_COMPILER_OK,
     RUJA_COMPILER_ERROR,
 } Ruja_Compile_Error;
 
+/*
+ * Variables are resolved to slots at compile time. Globals are indexes in vm->globals and locals
+ * are indexes in the vm stack: the locals of the open scopes are the bottom n_locals words of the
+ * stack at every statement boundary, temporaries of expressions live above them.
+ */
 typedef struct {
-    Ruja_Ast ast;
+    Ruja_Allocator allocator; // Lexer, parser, IR and scopes of every compile
+    bool out_of_memory;       // Set by the allocations of a compile, which then fails
+
+    Ruja_Ast ast;          // AST being compiled. Borrowed from the IR, only valid during compile
+    const char* source;    // Name used in diagnostics, only valid during compile
+
+    Ruja_Symbol_Table* scopes; // Variables visible at the point being compiled, with their slots
+    size_t n_locals;
+    size_t n_globals;
 } Ruja_Compiler;
 
-Ruja_Compiler* compiler_new();
+Ruja_Compiler* compiler_new(const Ruja_Allocator* allocator);
 void compiler_free(Ruja_Compiler *compiler);
 
 Ruja_Compile_Error compile(Ruja_Compiler *compiler, const char *source_path, Ruja_Vm* vm);
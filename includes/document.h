@@ -0,0 +1,85 @@
+#ifndef RUJA_DOCUMENT_H
+#define RUJA_DOCUMENT_H
+
+#include "common.h"
+#include "lexer.h"
+#include "ir.h"
+
+/*
+ * A source file kept in memory for incremental re-lexing and re-parsing (editors, watch mode).
+ *
+ * The document is a sequence of items, one per top-level statement as split by
+ * parse_split_top_level. Every item owns its text, its tokens and its AST (in its own IR), so an
+ * edit only lexes and parses again the items it touches, plus the neighbours it merges with
+ * (opening a block, removing a ';', ...). Unchanged items and their symbols are reused as they are.
+ *
+ * The text of an item runs from its first token up to the first token of the next one, the
+ * whitespace and comments in between included. The first item also holds the leading ones.
+ */
+typedef struct {
+    char* text;
+    size_t length;
+    size_t newlines;       // Number of '\n' in text
+    size_t start;          // Byte offset in the document, see document_item_start
+    size_t line;           // Line of the first byte
+    long line_shift;       // Lines added before the item since it was lexed, see document_token_line
+    Ruja_Token_Kind first; // Kind of the first token, RUJA_TOK_EOF if the item has none
+
+    Ruja_Ir* ir;
+    Ruja_Ast tail;         // Last node of ir->ast, NULL if the item has no statements
+    bool ok;               // Parsed without errors
+} Ruja_Document_Item;
+
+typedef struct {
+    const char* source; // Name used in diagnostics
+    size_t length;
+
+    size_t count;
+    size_t capacity;
+    Ruja_Document_Item* items;
+
+    // Items from shift_from on still have to be moved by shift_bytes and shift_lines. Applying
+    // the shift lazily keeps the cost of an edit independent of the number of items after it.
+    size_t shift_from;
+    long shift_bytes;
+    long shift_lines;
+
+    Ruja_Ast ast;       // Statements of every item linked in source order
+    size_t n_errors;    // Number of items that failed to parse
+    size_t reparsed;    // Number of items lexed and parsed by the last edit
+} Ruja_Document;
+
+/**
+ * @brief Reads, lexes and parses a file into a document.
+ *
+ * @return Ruja_Document* The document or NULL if the file could not be read or memory ran out.
+ *      Parse errors are reported and counted in n_errors.
+ */
+Ruja_Document* document_new(const char* filepath);
+void document_free(Ruja_Document* doc);
+
+/**
+ * @brief Replaces the bytes [begin, end) of the document by text. Only the items the edit
+ *      touches are lexed and parsed again. Errors are reported with their current line.
+ *
+ * @return true If the edit was applied, even if the new text has parse errors. If it is invalid
+ *      or memory ran out the document is left as it was.
+ */
+bool document_edit(Ruja_Document* doc, size_t begin, size_t end, const char* text, size_t length);
+
+/**
+ * @brief Returns the statements of the whole document. The list is only valid until the next edit.
+ */
+static inline Ruja_Ast document_ast(const Ruja_Document* doc) {
+    return doc->ast;
+}
+
+size_t document_item_start(const Ruja_Document* doc, size_t item);
+
+/**
+ * @brief Returns the current line of a token of the given item. Tokens keep the line they
+ *      were lexed at, edits before the item do not touch them.
+ */
+size_t document_token_line(const Ruja_Document* doc, size_t item, const Ruja_Token* token);
+
+#endif // RUJA_DOCUMENT_H
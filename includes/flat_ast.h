@@ -0,0 +1,104 @@
+#ifndef RUJA_FLAT_AST_H
+#define RUJA_FLAT_AST_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "ast.h"
+
+// Index of a node in a Ruja_Flat_Ast. Index 0 is reserved and means "no node"
+typedef uint32_t Flat_Index;
+#define FLAT_NULL ((Flat_Index)0)
+
+/*
+ * Flat, index based version of the AST. Nodes live in parallel arrays (struct of arrays), so a
+ * pass that only looks at the kinds never touches the payloads. Every node has a main token and
+ * two 32 bit operands, lhs and rhs. Whatever does not fit in them lives in the extra array.
+ *
+ * Node layout per kind (tok is the main token):
+ *   LITERAL, IDENTIFIER         tok
+ *   UNARY_OP                    tok, lhs = expression
+ *   BINARY_OP                   tok, lhs = left, rhs = right
+ *   TERNARY_OP                  tok = '?', lhs = condition, extra[rhs] = {true, false, tok ':'}
+ *   EXPRESSION                  lhs = expression
+ *   STMT_ASSIGN                 tok = '=', lhs = identifier, rhs = expression
+ *   STMT_TYPED_DECL             tok = type, lhs = identifier
+ *   STMT_TYPED_DECL_ASSIGN      tok = '=', lhs = identifier, extra[rhs] = {expression, tok type}
+ *   STMT_INFERRED_DECL_ASSIGN   tok = '=', lhs = identifier, rhs = expression
+ *   STMT_IF, STMT_ELIF          tok, lhs = condition, extra[rhs] = {body, next branch}
+ *   STMT_ELSE                   tok, lhs = body
+ *   RANGED_ITER                 lhs = start, extra[rhs] = {end, step}
+ *   STMT_FOR                    tok, lhs = identifier, extra[rhs] = {iter, body, tok 'in'}
+ *   STMT_WHILE                  tok, lhs = condition, rhs = body
+ *   STMT_STRUCT_MEMBER          tok = type, lhs = identifier
+ *   STMT_STRUCT_DEF             tok, lhs = identifier, extra[rhs] = {count, member...}
+ *   STMTS                       lhs = first child in extra, rhs = child count
+ *
+ * Tokens are stored once in the tokens array and referenced by index, tokens[0] is NULL.
+ * Children are always created before their parent, so the root is the last node.
+ */
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint8_t* kinds;      // ast_node_type of each node
+    uint32_t* main_tokens;
+    Flat_Index* lhs;
+    Flat_Index* rhs;
+
+    struct {
+        size_t count;
+        size_t capacity;
+        uint32_t* items;
+    } extra;
+
+    struct {
+        size_t count;
+        size_t capacity;
+        Ruja_Token** items; // Borrowed from the tree the flat AST was built from
+    } tokens;
+
+    Flat_Index root;
+    bool out_of_memory; // An append failed while building, the nodes are incomplete
+} Ruja_Flat_Ast;
+
+Ruja_Flat_Ast* flat_ast_new(size_t capacity);
+void flat_ast_free(Ruja_Flat_Ast* ast);
+
+/**
+ * @brief Builds the flat representation of a pointer based AST.
+ *
+ * The flat AST references the tokens of the tree, so the tree (its IR) must outlive it.
+ *
+ * @param tree The root of the tree.
+ * @return Ruja_Flat_Ast* The flat AST or NULL on failure.
+ */
+Ruja_Flat_Ast* flat_ast_from_tree(Ruja_Ast tree);
+
+static inline ast_node_type flat_ast_kind(const Ruja_Flat_Ast* ast, Flat_Index node) {
+    return (ast_node_type)ast->kinds[node];
+}
+
+static inline Ruja_Token* flat_ast_token(const Ruja_Flat_Ast* ast, uint32_t token) {
+    return ast->tokens.items[token];
+}
+
+static inline Ruja_Token* flat_ast_main_token(const Ruja_Flat_Ast* ast, Flat_Index node) {
+    return ast->tokens.items[ast->main_tokens[node]];
+}
+
+/**
+ * @brief Returns the contiguous children of a STMTS or STMT_STRUCT_DEF node.
+ *
+ * @param ast The flat AST.
+ * @param node A STMTS or STMT_STRUCT_DEF node.
+ * @param count Where the number of children is stored.
+ * @return const Flat_Index* The first child.
+ */
+const Flat_Index* flat_ast_children(const Ruja_Flat_Ast* ast, Flat_Index node, uint32_t* count);
+
+/**
+ * @brief Prints one line per node, in storage order.
+ */
+void flat_ast_print(const Ruja_Flat_Ast* ast, FILE* file);
+
+#endif // RUJA_FLAT_AST_H
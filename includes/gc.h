@@ -0,0 +1,237 @@
+#ifndef RUJA_GC_H
+#define RUJA_GC_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "objects.h"
+
+/*
+ * Precise tracing mark-and-sweep collector for the objects of a vm.
+ *
+ * The roots are the live part of the value stack, the globals and the constants of the bytecode.
+ * Every object the vm allocates is handed to gc_track, which also drives the collector: once
+ * enough bytes were allocated since the last cycle a new one starts.
+ *
+ * In incremental mode a cycle is split in slices, one per allocation. A slice marks or sweeps
+ * step_budget objects for every GC_STEP_BYTES allocated since the previous one, so the collector
+ * keeps pace with the vm and a pause depends on the allocation that triggered it, not on the size
+ * of the heap. A cycle that still runs once GC_FINISH_FACTOR times its threshold was allocated
+ * is finished at once. Marking is tri-colour: the roots
+ * are grayed when the cycle starts and the gray objects are blackened a few at a time. The vm
+ * keeps running in between, so marking finishes with an atomic rescan of the roots (the stack and
+ * the globals have no barrier) and objects allocated meanwhile are born marked. A store of a
+ * white object into a black one must go through gc_write_barrier. The sweep is incremental too.
+ *
+ * gc_collect runs a whole cycle at once. With mark_threads > 1 and enough roots, the roots are
+ * split between helper threads that claim objects with a compare and swap on their colour.
+ *
+ * Short-lived objects are allocated young, by bumping a pointer in the nursery of the vm. When
+ * the nursery is full a minor collection copies the young objects still referenced to the old
+ * space (malloc and vm->objects) and the whole nursery is reused. Its cost is the value stack,
+ * which is scanned, plus the survivors: the other places that can hold a young object, the old
+ * ones, record it with a barrier (gc_store_global, gc_write_barrier). Only leaf objects are
+ * allocated young, so the major collector never has to trace through the nursery, and young
+ * objects are GC_YOUNG so that it leaves them alone.
+ *
+ * Running out of memory never stops the collector. A gray object that does not fit in the gray
+ * stack stays gray and the end of the marking scans the heap for it. A slot or an object that
+ * does not fit in a remembered set makes the next minor collection scan every global and old
+ * object. A young object that can not be promoted stays in the nursery, which is then pinned:
+ * nothing more is allocated young until a minor collection empties it.
+ */
+
+// Number of buckets of the pause histogram. Bucket i counts the pauses under 2^i microseconds,
+// the last one every longer pause.
+#define GC_HISTOGRAM_BUCKETS 16
+
+// Below this number of roots gc_collect marks on the calling thread only
+#define GC_PARALLEL_MIN_ROOTS 4096
+
+// A slice does step_budget objects of work per this many bytes allocated since the last one
+#define GC_STEP_BYTES 1024
+// A running cycle is finished in one go once allocated reaches this many times threshold
+#define GC_FINISH_FACTOR 2
+
+typedef enum {
+    GC_PHASE_IDLE,
+    GC_PHASE_MARK,
+    GC_PHASE_SWEEP,
+} Gc_Phase;
+
+typedef struct {
+    bool incremental;         // Split cycles in slices instead of stopping the vm for a whole cycle
+    size_t step_budget;       // Objects marked or swept by a slice, per GC_STEP_BYTES allocated
+    size_t mark_threads;      // Threads used by gc_collect to mark, 0 or 1 to mark on the vm thread
+    size_t initial_threshold; // Bytes allocated before the first cycle
+    double growth;            // The next cycle starts once the live bytes grew by this factor
+    size_t nursery_size;      // Bytes of the nursery, 0 to allocate every object old
+} Gc_Config;
+
+#define GC_DEFAULT_CONFIG ((Gc_Config) { \
+    .incremental = true, \
+    .step_budget = 256, \
+    .mark_threads = 0, \
+    .initial_threshold = 1024 * 1024, \
+    .growth = 2.0, \
+    .nursery_size = 256 * 1024, \
+})
+
+typedef struct {
+    size_t cycles;
+    size_t slices;
+    size_t bytes_allocated;   // Since the vm was created
+    size_t bytes_reclaimed;
+    size_t objects_allocated;
+    size_t objects_reclaimed;
+    size_t live_bytes;        // Bytes of the old space right now
+    size_t minor_cycles;
+    size_t bytes_promoted;    // Copied out of the nursery by minor collections
+    size_t objects_promoted;
+
+    uint64_t pause_total_ns;
+    uint64_t pause_max_ns;
+    size_t pause_histogram[GC_HISTOGRAM_BUCKETS];
+} Gc_Stats;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Object** items;
+    const Ruja_Allocator* allocator;
+    bool overflowed; // A gray object could not be pushed, see finish_mark
+} Gray_Stack;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    size_t* items;
+} Remembered_Slots;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Object** items;
+} Remembered_Objects;
+
+typedef struct {
+    uint8_t* start;
+    uint8_t* top;   // Next free byte
+    uint8_t* end;
+    size_t objects; // Number of objects allocated since the last minor collection
+    size_t bytes;   // Their object_size, padding excluded
+
+    Remembered_Slots globals;   // Global slots that were given a young object
+    Remembered_Objects objects_with_young; // Old objects that were given a young child
+    bool overflowed; // A remembered set could not grow, every global and old object is a root
+    bool pinned;     // Holds objects that could not be promoted, top can not go back to start
+} Nursery;
+
+typedef struct {
+    Gc_Config config;
+    Gc_Stats stats;
+    Gc_Phase phase;
+
+    Gray_Stack gray;
+    Object* sweeping;  // Objects of the cycle not swept yet, detached from vm->objects
+    Object* survivors; // Swept objects that are still alive, given back to vm->objects at the end
+    Object* survivors_tail;
+
+    size_t allocated;  // Bytes allocated since the last cycle ended
+    size_t threshold;  // Value of allocated that starts the next cycle
+    size_t debt;       // Bytes allocated since the last slice, paid by the next one
+
+    Nursery nursery;
+    Ruja_Slab slab;    // Memory of the old objects
+    const Ruja_Allocator* allocator; // The one of the vm
+} Ruja_Gc;
+
+struct Ruja_Vm;
+
+void gc_init(struct Ruja_Vm* vm, Gc_Config config);
+
+/**
+ * @brief Frees every object of the vm, whatever the phase of the collector.
+ */
+void gc_free(struct Ruja_Vm* vm);
+
+/**
+ * @brief Gives a new object to the gc of the vm, linking it into vm->objects. Runs a slice
+ *      of the collector first if a cycle is due.
+ *
+ *      The object is not a root: it must be reachable (pushed, stored) before the next
+ *      allocation. Anything it refers to must already be reachable from the roots.
+ */
+void gc_track(struct Ruja_Vm* vm, Object* obj);
+
+/**
+ * @brief Gives several new objects to the gc at once, with a single slice of the collector
+ *      that does the work of count slices.
+ *      Unlike with gc_track they may already be reachable from the roots, through each other.
+ */
+void gc_track_all(struct Ruja_Vm* vm, Object** objs, size_t count);
+
+/**
+ * @brief Returns size bytes of the nursery for a new leaf object, running a minor collection
+ *      if it is full. Every young object may move: pointers to them that are not in the roots
+ *      are stale afterwards.
+ *
+ * @return void* The memory or NULL if the object does not fit in the nursery. It must then be
+ *      allocated old, with gc_track.
+ */
+void* gc_allocate_young(struct Ruja_Vm* vm, size_t size);
+
+/**
+ * @brief Counts a new object built in memory given by gc_allocate_young.
+ */
+void gc_track_young(struct Ruja_Vm* vm, Object* obj);
+
+/**
+ * @brief Copies the young objects still referenced to the old space and empties the nursery,
+ *      unless one of them could not be copied.
+ */
+void gc_minor_collect(struct Ruja_Vm* vm);
+
+/**
+ * @brief Empties the nursery, finishes the running cycle, if any, and runs a full one
+ *      without yielding to the vm.
+ */
+void gc_collect(struct Ruja_Vm* vm);
+
+void gc_mark_object(Ruja_Gc* gc, Object* obj);
+void gc_remember_global(Ruja_Gc* gc, size_t slot);
+void gc_remember_object(Ruja_Gc* gc, Object* obj);
+
+static inline bool gc_is_young(const Ruja_Gc* gc, const Object* obj) {
+    return (const uint8_t*) obj >= gc->nursery.start && (const uint8_t*) obj < gc->nursery.end;
+}
+
+/**
+ * @brief Must be called after storing value into a global. The globals are old, the slot
+ *      is remembered if the value is young.
+ */
+static inline void gc_store_global(Ruja_Gc* gc, size_t slot, Word value) {
+    if (IS_OBJECT(value) && gc_is_young(gc, AS_OBJECT(value))) gc_remember_global(gc, slot);
+}
+
+/**
+ * @brief Must be called after storing child into parent. While marking, a black object
+ *      can not point to a white one or the white one would be freed, and an old object
+ *      pointing to a young one is a root of the next minor collection.
+ */
+static inline void gc_write_barrier(Ruja_Gc* gc, Object* parent, Object* child) {
+    if (gc->phase == GC_PHASE_MARK
+        && object_color(parent) == GC_BLACK
+        && object_color(child) == GC_WHITE) {
+        gc_mark_object(gc, child);
+    }
+    if (gc_is_young(gc, child) && !gc_is_young(gc, parent)) gc_remember_object(gc, parent);
+}
+
+static inline const Gc_Stats* gc_stats(const Ruja_Gc* gc) {
+    return &gc->stats;
+}
+
+void gc_print_stats(FILE* stream, const Ruja_Gc* gc);
+
+#endif // RUJA_GC_H
@@ -0,0 +1,26 @@
+#ifndef RUJA_INTERNER_H
+#define RUJA_INTERNER_H
+
+#include "common.h"
+#include "string.h"
+
+// Set of unique strings keyed by content. Interned strings live until the interner is freed,
+// so two interned strings are equal if and only if they are the same pointer.
+typedef struct {
+    size_t count;
+    size_t capacity;
+    ObjString** strings;
+} Ruja_Interner;
+
+#define DEFAULT_INTERNER_CAPACITY 64
+
+Ruja_Interner* interner_new(size_t capacity);
+void interner_free(Ruja_Interner* interner);
+ObjString* interner_intern(Ruja_Interner* interner, const char* chars, size_t length);
+
+// The interner shared by the lexer, the symbol table and the vm. It is not thread safe:
+// only the thread driving the compilation may intern.
+Ruja_Interner* interner_global();
+void interner_global_free();
+
+#endif // RUJA_INTERNER_H
@@ -7,11 +7,20 @@
 
 
 typedef struct {
+    Ruja_Allocator allocator;
+    Ruja_Arena *arena; // Owns every node of the AST and the tokens they reference
     Ruja_Ast ast;
     Ruja_Symbol_Table *symbol_table;
 } Ruja_Ir;
 
-Ruja_Ir *ir_new();
+/**
+ * @brief Creates a new IR with an empty AST.
+ *
+ * @param size_hint Rough number of bytes the AST will need. The size of the source is a good guess.
+ * @param allocator Allocator of the arena and of the symbol table, NULL for the default one.
+ * @return Ruja_Ir* The new IR or NULL on failure.
+ */
+Ruja_Ir *ir_new(size_t size_hint, const Ruja_Allocator *allocator);
 void ir_free(Ruja_Ir *ir);
 
 #endif // RUJA_IR_H
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define RUJA_LEXER_H
 
 #include "common.h"
+#include "memory.h"
+#include "string.h"
 
 typedef enum {
     RUJA_TOK_ERR = -2,
@@ -44,23 +46,54 @@ typedef struct {
     const char *start;
     size_t length;
     size_t line;
-    bool in_ast;
+    union {
+        int32_t i32; // RUJA_TOK_INT
+        double f64;  // RUJA_TOK_FLOAT
+    } as;
+    ObjString* interned; // RUJA_TOK_ID and RUJA_TOK_STRING
 } Ruja_Token;
 
-Ruja_Token* token_new(Ruja_Token_Kind kind, const char *start, size_t length, size_t line);
-void token_free(Ruja_Token *token);
+/**
+ * @brief Returns a new token or NULL if memory ran out. Tokens are freed with the allocator of
+ *      the lexer that made them.
+ */
+Ruja_Token* token_new(const Ruja_Allocator* allocator, Ruja_Token_Kind kind, const char *start, size_t length, size_t line);
+void token_free(const Ruja_Allocator* allocator, Ruja_Token *token);
 void token_to_string(Ruja_Token* token);
 
 typedef struct {
+    size_t count;
+    size_t capacity;
+    Ruja_Token** items;
+} Ruja_Tokens;
+
+// Sources smaller than this are always lexed on the calling thread
+#define LEXER_PARALLEL_THRESHOLD (1 << 20)
+#define LEXER_MIN_CHUNK_SIZE (1 << 16)
+
+typedef struct {
+    Ruja_Allocator allocator; // Content, tokens and the lexer itself
     const char *source;
     char *content_start;
+    char *content_end;
     char *start;
     char *current;
     size_t line;
+    bool speculative; // Parallel lexing worker: do not report errors nor intern
+
+    Ruja_Tokens* tokens; // Tokens lexed ahead of time. NULL when lexing on demand
+    size_t next;
 } Ruja_Lexer;
 
-Ruja_Lexer* lexer_new(const char* filepath);
+Ruja_Lexer* lexer_new(const char* filepath, const Ruja_Allocator* allocator);
+
+/**
+ * @brief Initializes a lexer over a buffer owned by the caller, starting at the given line.
+ *      The buffer must outlive the tokens. Such a lexer must not be passed to lexer_free.
+ */
+void lexer_init(Ruja_Lexer *lexer, const char* source, char* content, size_t length, size_t line, const Ruja_Allocator* allocator);
 void lexer_free(Ruja_Lexer *lexer);
 Ruja_Token* next_token(Ruja_Lexer *lexer);
+bool lexer_lex_parallel(Ruja_Lexer *lexer, size_t n_workers);
 
 #endif // RUJA_LEXER_H
\ No newline at end of file
@@ -2,18 +2,64 @@
 #define RUJA_MEMORY_H
 
 #include "common.h"
+#include <stdio.h>
 #include <stdlib.h>
 
-//TODO: This should throw an error if the allocation fails not just exit
-#define REALLOC_DA(type, da) \
-    do { \
-        size_t new_capacity = da->capacity == 0 ? 8 : da->capacity * 2; \
-        da->items = realloc(da->items, sizeof(type) * new_capacity); \
-        if (da->items == NULL) { \
-            fprintf(stderr, "Out of memory. Could not allocate %"PRIu64" bytes. for %s\n", sizeof(type) * new_capacity, #da); \
-            exit(1); \
-        } \
-        da->capacity = new_capacity; \
-    } while (0)
-
-#endif // RUJA_MEMORY_H
\ No newline at end of file
+/*
+ * Memory of the embedder. Every module that allocates takes a Ruja_Allocator when it is created
+ * (NULL for ruja_default_allocator), keeps a copy and allocates, grows and frees through it, so
+ * a host can give each vm its own arena, pool or accounting allocator. Memory must be aligned
+ * like the one of malloc. An allocator given to a lexer, a parser or a vm whose gc marks with
+ * several threads must be thread safe.
+ *
+ * Running out of memory is never fatal: the allocation reports the error and the module hands
+ * a failure back to its caller.
+ */
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* memory, size_t size); // Like realloc, memory may be NULL
+    void (*free)(void* ctx, void* memory);
+    void* ctx;
+} Ruja_Allocator;
+
+// malloc, realloc and free
+extern const Ruja_Allocator ruja_default_allocator;
+
+/**
+ * @brief Returns the allocator a module keeps when it is given allocator, which may be NULL.
+ */
+static inline Ruja_Allocator allocator_or_default(const Ruja_Allocator* allocator) {
+    return allocator != NULL ? *allocator : ruja_default_allocator;
+}
+
+static inline void* ruja_alloc(const Ruja_Allocator* allocator, size_t size) {
+    return allocator->alloc(allocator->ctx, size);
+}
+
+static inline void* ruja_realloc(const Ruja_Allocator* allocator, void* memory, size_t size) {
+    return allocator->realloc(allocator->ctx, memory, size);
+}
+
+static inline void ruja_free(const Ruja_Allocator* allocator, void* memory) {
+    if (memory != NULL) allocator->free(allocator->ctx, memory);
+}
+
+/**
+ * @brief Allocates count zeroed elements of size bytes.
+ */
+void* ruja_calloc(const Ruja_Allocator* allocator, size_t count, size_t size);
+
+/**
+ * @brief Doubles the capacity of a dynamic array, 8 elements at first. items points to the
+ *      items pointer of the array.
+ *
+ * @return false If memory ran out. The error is reported and the array is left as it was.
+ */
+bool grow_items(const Ruja_Allocator* allocator, void* items, size_t* capacity, size_t item_size, const char* name);
+
+// Grows a dynamic array {count, capacity, items}. Evaluates to false if memory ran out, see grow_items
+#define REALLOC_DA(type, da) REALLOC_DA_WITH(&ruja_default_allocator, type, da)
+#define REALLOC_DA_WITH(allocator, type, da) \
+    grow_items((allocator), &(da)->items, &(da)->capacity, sizeof(type), #da)
+
+#endif // RUJA_MEMORY_H
@@ -1,25 +1,129 @@
 #ifndef RUJA_OBJECTS_H
 #define RUJA_OBJECTS_H
 
+#include <stdatomic.h>
+
 #include "common.h"
+#include "slab.h"
 #include "word.h"
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_STRING_VIEW,
 } object_type;
 
-// Base object type
+// Tri-colour marking state, see gc.h
+typedef enum {
+    GC_WHITE,     // Not reached yet, freed by the sweep if it stays white
+    GC_GRAY,      // Reached, its children still have to be marked
+    GC_BLACK,     // Reached and its children are marked
+    GC_PERMANENT, // Not owned by the gc (interned strings), never marked nor swept
+    GC_YOUNG,     // In the nursery, only minor collections move or free it
+    GC_FORWARDED, // Copied out of the nursery, next is the copy
+} gc_color;
+
+// Base object type: a single word of header.
+//   bits  0-47 next, the object that follows it in its list (vm->objects, the sweep lists) or
+//              its copy once forwarded. Pointers fit in 48 bits, as they do in a Word
+//   bits 48-51 object_type
+//   bits 52-55 gc_color
+//   bit  56    remembered, in the remembered set of the nursery, see gc_remember_object
+//
+// The header is atomic so that marking threads can claim objects, see object_claim. Every other
+// change is a plain load and store: it must not race with a claim of the same object, which is
+// the case as long as the object is not white or no marking thread runs.
 typedef struct Object {
-    object_type type;
-    struct Object* next;
+    _Atomic uint64_t header;
 } Object;
 
-#define AS_OBJECT(x) ((Object*) ((x) & MASK_VALUE))
+#define OBJECT_NEXT_MASK       0x0000FFFFFFFFFFFF
+#define OBJECT_TYPE_SHIFT      48
+#define OBJECT_COLOR_SHIFT     52
+#define OBJECT_REMEMBERED_BIT  ((uint64_t) 1 << 56)
+#define OBJECT_HEADER_TYPE(h)  ((object_type) (((h) >> OBJECT_TYPE_SHIFT) & 0xF))
+#define OBJECT_HEADER_COLOR(h) ((gc_color) (((h) >> OBJECT_COLOR_SHIFT) & 0xF))
+
+static inline uint64_t object_header(const Object* obj) {
+    return atomic_load_explicit(&obj->header, memory_order_relaxed);
+}
+
+static inline void object_set_header(Object* obj, uint64_t mask, uint64_t bits) {
+    atomic_store_explicit(&obj->header, (object_header(obj) & ~mask) | bits, memory_order_relaxed);
+}
+
+/**
+ * @brief Sets the whole header of a new object, with no next and not remembered.
+ */
+static inline void object_init(Object* obj, object_type type, gc_color color) {
+    atomic_init(&obj->header, (uint64_t) type << OBJECT_TYPE_SHIFT | (uint64_t) color << OBJECT_COLOR_SHIFT);
+}
+
+static inline object_type object_get_type(const Object* obj) {
+    return OBJECT_HEADER_TYPE(object_header(obj));
+}
+
+static inline gc_color object_color(const Object* obj) {
+    return OBJECT_HEADER_COLOR(object_header(obj));
+}
+
+static inline void object_set_color(Object* obj, gc_color color) {
+    object_set_header(obj, (uint64_t) 0xF << OBJECT_COLOR_SHIFT, (uint64_t) color << OBJECT_COLOR_SHIFT);
+}
+
+/**
+ * @brief Turns obj from expected to color. Safe to call from several threads at once, a
+ *      single one succeeds.
+ *
+ * @return false If obj was not expected
+ */
+static inline bool object_claim(Object* obj, gc_color expected, gc_color color) {
+    uint64_t header = object_header(obj);
+    uint64_t claimed;
+    do {
+        if (OBJECT_HEADER_COLOR(header) != expected) return false;
+        claimed = (header & ~((uint64_t) 0xF << OBJECT_COLOR_SHIFT)) | (uint64_t) color << OBJECT_COLOR_SHIFT;
+    } while (!atomic_compare_exchange_weak_explicit(&obj->header, &header, claimed, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+static inline bool object_remembered(const Object* obj) {
+    return (object_header(obj) & OBJECT_REMEMBERED_BIT) != 0;
+}
+
+static inline void object_set_remembered(Object* obj, bool remembered) {
+    object_set_header(obj, OBJECT_REMEMBERED_BIT, remembered ? OBJECT_REMEMBERED_BIT : 0);
+}
+
+static inline Object* object_next(const Object* obj) {
+    return (Object*) (uintptr_t) (object_header(obj) & OBJECT_NEXT_MASK);
+}
+
+static inline void object_set_next(Object* obj, Object* next) {
+    object_set_header(obj, OBJECT_NEXT_MASK, (uint64_t) (uintptr_t) next);
+}
+
+#define AS_OBJECT(x) ((Object*) (uintptr_t) ((x) & MASK_VALUE))
 static inline bool is_obj_type(Word value, object_type type) {
-    return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
+    return IS_OBJECT(value) && object_get_type(AS_OBJECT(value)) == type;
 }
 
-void object_free(Object* obj);
+/**
+ * @brief Returns size bytes for a new object, from slab or from malloc if slab is NULL.
+ *
+ * @return void* The memory or NULL if it could not be allocated. The error is reported.
+ */
+void* object_alloc(Ruja_Slab* slab, size_t size);
+
+/**
+ * @brief Frees an object allocated by object_alloc with the same slab.
+ */
+void object_free(Ruja_Slab* slab, Object* obj);
+
+/**
+ * @brief Returns the number of bytes owned by an object, the header included.
+ */
+size_t object_size(Object* obj);
 void print_object(FILE* stream, Object* obj, int width);
 
 #endif // RUJA_OBJECTS_H
\ No newline at end of file
@@ -11,19 +11,77 @@ typedef enum {
 } Ruja_Parse_Error;
 
 
+// Maximum nesting of an expression, deeper expressions are reported as a parse error
+#define PARSER_DEFAULT_MAX_DEPTH (1 << 18)
+
+// Parallel parsing splits the token stream in about this many pieces per worker, but never in
+// pieces smaller than PARSER_MIN_PIECE_TOKENS
+#define PARSER_PIECES_PER_WORKER 4
+#define PARSER_MIN_PIECE_TOKENS (1 << 14)
+
 typedef struct _tstack Type_Stack;
+typedef struct _fstack Frame_Stack;
 typedef struct {
+    Ruja_Allocator allocator; // Type and frame stacks and the IRs of parallel pieces
     Ruja_Token* previous;
     Ruja_Token* current;
+    Ruja_Token out_of_memory; // Stands for the rest of the source once the lexer ran out of memory
+    Ruja_Arena* arena; // Arena of the IR being parsed
 
     bool had_error;
     bool panic_mode;
+    bool defer_errors; // Keep the first error in deferred_error instead of printing it
+    struct {
+        const char* msg; // NULL if no error was recorded
+        Ruja_Token token;
+    } deferred_error;
 
     Type_Stack* type_stack;
+    Frame_Stack* frames; // Suspended expression parses, see parse_precedence
+    size_t max_depth;    // Defaults to PARSER_DEFAULT_MAX_DEPTH
 } Ruja_Parser;
 
-Ruja_Parser* parser_new();
+/**
+ * @brief Tokens are freed with the allocator of the lexer they come from.
+ */
+Ruja_Parser* parser_new(const Ruja_Allocator* allocator);
 void parser_free(Ruja_Parser* parser);
-bool parse(Ruja_Parser* parser, Ruja_Lexer* lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb);
+bool parse(Ruja_Parser* parser, Ruja_Lexer* lexer, Ruja_Ir* ir);
+
+/**
+ * @brief Parses the tokens buffered by lexer_lex_parallel on several threads.
+ *
+ * The token stream is split at top-level boundaries, each piece is parsed into its own IR and
+ * the pieces are merged in source order. The result and the reported error are the ones a
+ * sequential parse would produce. Falls back to parse when the tokens are not buffered or
+ * too few to be worth it.
+ *
+ * @param n_workers Number of threads to use. 0 means one per online cpu.
+ */
+bool parse_parallel(Ruja_Parser* parser, Ruja_Lexer* lexer, Ruja_Ir* ir, size_t n_workers);
+
+/**
+ * @brief Splits tokens[begin..] at top-level boundaries, that is after a ';' or a '}' that
+ *      closes a block, unless an 'else', 'elif' or ';' continues the statement.
+ *
+ * @param target Minimum number of tokens of a piece, 1 splits at every boundary.
+ * @param ends Where the end of every piece is stored. Must hold one entry per target tokens.
+ * @return size_t The number of pieces. The last one always ends at the end of the stream.
+ */
+size_t parse_split_top_level(Ruja_Tokens* tokens, size_t begin, size_t target, size_t* ends);
+
+/**
+ * @brief Returns the type named by a type keyword.
+ */
+Type token_type(Ruja_Token_Kind kind);
+
+/**
+ * @brief Best effort type of an expression, used for inferred declarations. Comparisons and
+ *      logical operators are bool, any other operator has the type of its leftmost operand.
+ *      Only the left spine of the tree is walked, so it never recurses.
+ *
+ * @param sb The scopes the identifiers of the expression are looked up in.
+ */
+Type infer_type(Ruja_Ast expression, Ruja_Symbol_Table* sb);
 
 #endif // RUJA_PARSER_H
\ No newline at end of file
@@ -0,0 +1,88 @@
+#ifndef RUJA_SLAB_H
+#define RUJA_SLAB_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+
+/*
+ * Size class allocator for the objects of a vm.
+ *
+ * Sizes are rounded up to a multiple of SLAB_GRANULE and every class has its own pages of
+ * SLAB_PAGE_SIZE bytes, mapped from the OS and aligned on their size so that a slot finds its
+ * page by masking its address. A page hands out its slots in address order first, then reuses
+ * the ones freed, linked through their first word. A page whose slots are all free again is
+ * unmapped, unless it is the last page of its class with room left, which is kept to absorb
+ * a burst of allocations and frees around a page boundary.
+ *
+ * Objects larger than SLAB_MAX_SIZE are given to the allocator of the slab. Pages always come
+ * from the OS, an allocator has no way to hand out memory aligned on a page.
+ */
+
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+
+typedef struct Slab_Page {
+    struct Slab_Page* prev;  // Every page of the slab
+    struct Slab_Page* next;
+    struct Slab_Page* prev_partial; // Pages of the class with a free slot
+    struct Slab_Page* next_partial;
+    void* free;              // Freed slots
+    uint8_t* top;            // First slot never handed out
+    size_t slot_size;
+    size_t live;             // Slots handed out and not freed
+    bool partial;            // In the partial list of its class
+} Slab_Page;
+
+typedef struct {
+    Slab_Page* partial;
+    size_t pages;
+    size_t live;
+} Slab_Class;
+
+typedef struct {
+    size_t pages_mapped;   // Since the slab was created
+    size_t pages_released;
+    size_t large_objects;  // Given to malloc and not freed yet
+    size_t large_bytes;
+} Slab_Stats;
+
+typedef struct {
+    Slab_Page* pages;
+    Slab_Class classes[SLAB_CLASSES];
+    Slab_Stats stats;
+    const Ruja_Allocator* allocator; // Large objects. Must outlive the slab
+} Ruja_Slab;
+
+/**
+ * @brief allocator may be NULL for ruja_default_allocator.
+ */
+void slab_init(Ruja_Slab* slab, const Ruja_Allocator* allocator);
+
+/**
+ * @brief Unmaps every page of the slab, whether its slots were freed or not. Large objects
+ *      must have been freed already.
+ */
+void slab_free(Ruja_Slab* slab);
+
+/**
+ * @brief Returns size bytes aligned on SLAB_GRANULE.
+ *
+ * @return void* The memory or NULL if it could not be allocated. Nothing is reported.
+ */
+void* slab_alloc(Ruja_Slab* slab, size_t size);
+
+/**
+ * @brief Gives back memory returned by slab_alloc for the same size.
+ */
+void slab_release(Ruja_Slab* slab, void* memory, size_t size);
+
+/**
+ * @brief Prints the occupancy of every size class in use.
+ */
+void slab_print_stats(FILE* stream, const Ruja_Slab* slab);
+
+#endif // RUJA_SLAB_H
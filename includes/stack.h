@@ -2,17 +2,24 @@
 #define RUJA_STACK_H
 
 #include "common.h"
+#include "memory.h"
 #include "word.h"
 
 typedef struct {
     size_t count;
     size_t capacity;
     Word* items;
+    Ruja_Allocator allocator;
 } Stack;
 
-Stack *stack_new();
+Stack *stack_new(const Ruja_Allocator* allocator);
 void stack_free(Stack *stack);
 
+/**
+ * @brief Pushes word and returns the new top of the stack.
+ *
+ * @return Word* NULL if the stack could not grow, word was not pushed.
+ */
 Word* stack_push(Stack *stack, Word word);
 
 void stack_trace(Stack *stack);
@@ -4,19 +4,151 @@
 #include "common.h"
 #include "objects.h"
 
-// String object
+// String object. The bytes are stored inline after the header, a string is a single allocation
 typedef struct {
     Object obj;
     size_t length;
-    char *chars;
+    uint64_t hash;  // 0 until computed by string_hash, interned strings have it from the start
+    bool interned;
+    char chars[];   // length bytes and a '\0'
 } ObjString;
 
+// Concatenation of two string values, made by OP_ADD for long results so that building a string
+// piece by piece does not copy it over and over. The bytes are only gathered, into flat, once
+// something needs them (equality, hashing). The children are then dropped.
+typedef struct {
+    Object obj;
+    size_t length;
+    size_t depth;   // 1 + the depth of the deepest child, 0 once flattened
+    Word left;      // Any string value, NIL once flattened
+    Word right;
+    ObjString* flat;
+} ObjRope;
+
+// Substring of a flat string that shares its bytes instead of copying them. The view keeps its
+// parent alive, whatever the size of the parent. Views are never made of views: a substring of a
+// view is a view of the same parent. Its bytes are not followed by a '\0'.
+typedef struct {
+    Object obj;
+    size_t length;
+    size_t offset;      // Of the first byte in parent->chars
+    ObjString* parent;
+} ObjStringView;
+
+// Results of at least this many bytes are ropes
+#define ROPE_MIN_LENGTH 128
+// Deeper ropes are rebalanced, so walking one never needs more than this many pending nodes
+#define ROPE_MAX_DEPTH 48
+
 #define AS_STRING(x) ((ObjString*) AS_OBJECT(x))
+#define AS_ROPE(x) ((ObjRope*) AS_OBJECT(x))
+#define AS_STRING_VIEW(x) ((ObjStringView*) AS_OBJECT(x))
 #define MAKE_STRING(str, len) MAKE_OBJECT(object_new(OBJ_STRING, str, len))
 #define IS_STRING(x) is_obj_type((x), OBJ_STRING)
-ObjString* obj_string_new(const char* chars, size_t length);
-ObjString* obj_string_new_no_alloc(char* chars, size_t length);
-ObjString* string_add(ObjString* string1, ObjString* string2);
+#define IS_ROPE(x) is_obj_type((x), OBJ_ROPE)
+#define IS_STRING_VIEW(x) is_obj_type((x), OBJ_STRING_VIEW)
+// Any representation of a string value, see SSTR_MAX, ObjRope and ObjStringView
+#define IS_ANY_STRING(x) (IS_SSTR(x) || IS_STRING(x) || IS_ROPE(x) || IS_STRING_VIEW(x))
+/**
+ * @brief Allocates a copy of chars. Like every constructor of this file, the memory comes
+ *      from slab, or from malloc if it is NULL, see object_alloc.
+ */
+ObjString* obj_string_new(Ruja_Slab* slab, const char* chars, size_t length);
+
+/**
+ * @brief Allocates a string of the given length. The caller fills string->chars, the final
+ *      '\0' is already written.
+ */
+ObjString* obj_string_alloc(Ruja_Slab* slab, size_t length);
+ObjString* string_add(Ruja_Slab* slab, ObjString* string1, ObjString* string2);
+
+/**
+ * @brief Writes the header of a string of the given length at the start of memory, which must
+ *      hold sizeof(ObjString) + length + 1 bytes. The caller fills string->chars, the final
+ *      '\0' is already written.
+ */
+ObjString* string_init_into(void* memory, size_t length);
+
+/**
+ * @brief Builds the concatenation of two strings in memory, the chars right after the header.
+ *      memory must hold sizeof(ObjString) + length1 + length2 + 1 bytes.
+ *      The object owns no allocation of its own and must not be given to object_free.
+ */
+ObjString* string_concat_into(void* memory, const char* chars1, size_t length1, const char* chars2, size_t length2);
 bool string_equal(ObjString* string1, ObjString* string2);
+uint64_t hash_chars(const char* chars, size_t length);
+
+/**
+ * @brief Allocates a rope node, the caller gives it to the gc.
+ */
+ObjRope* obj_rope_new(Ruja_Slab* slab, Word left, Word right);
+
+typedef void (*Rope_Piece)(const char* chars, size_t length, void* ctx);
+
+/**
+ * @brief Calls piece on every leaf of a rope in order, without flattening it.
+ */
+void rope_pieces(ObjRope* rope, Rope_Piece piece, void* ctx);
+
+/**
+ * @brief Stores the leaves of a rope in order into leaves, if not NULL. Flattened ropes
+ *      are leaves.
+ *
+ * @return size_t The number of leaves.
+ */
+size_t rope_leaves(ObjRope* rope, Word* leaves);
+
+/**
+ * @brief Copies the bytes of a rope into flat, a string of the same length, and makes it the
+ *      flat form of the rope. The children are dropped.
+ */
+void rope_flatten_into(ObjRope* rope, ObjString* flat);
+
+/**
+ * @brief Allocates a view of length bytes of parent from offset, the caller gives it to the gc.
+ *      The bytes must be inside the parent.
+ */
+ObjStringView* obj_string_view_new(Ruja_Slab* slab, ObjString* parent, size_t offset, size_t length);
+
+static inline size_t string_word_length(Word word) {
+    if (IS_SSTR(word)) return SSTR_LENGTH(word);
+    if (IS_ROPE(word)) return AS_ROPE(word)->length;
+    if (IS_STRING_VIEW(word)) return AS_STRING_VIEW(word)->length;
+    return AS_STRING(word)->length;
+}
+
+/**
+ * @brief Returns the bytes of a string value. Small strings are unpacked into buffer, which
+ *      must hold SSTR_MAX + 1 bytes, ropes must be flattened. The bytes are not always followed
+ *      by a '\0'. The pointer is only valid until the next allocation.
+ */
+static inline const char* string_word_chars(Word word, char* buffer, size_t* length) {
+    if (IS_SSTR(word)) {
+        *length = sstr_unpack(word, buffer);
+        return buffer;
+    }
+    if (IS_STRING_VIEW(word)) {
+        ObjStringView* view = AS_STRING_VIEW(word);
+        *length = view->length;
+        return view->parent->chars + view->offset;
+    }
+    ObjString* string = IS_ROPE(word) ? AS_ROPE(word)->flat : AS_STRING(word);
+    *length = string->length;
+    return string->chars;
+}
+
+/**
+ * @brief Compares two string values, whatever their representation. Ropes must be flattened.
+ */
+bool string_words_equal(Word word1, Word word2);
+
+/**
+ * @brief Returns the hash of a string, computing it on first use. A string whose hash is
+ *      really 0 is hashed every time, which is harmless.
+ */
+static inline uint64_t string_hash(ObjString* string) {
+    if (string->hash == 0) string->hash = hash_chars(string->chars, string->length);
+    return string->hash;
+}
 
 #endif // RUJA_OBJECT_STRING_H
\ No newline at end of file
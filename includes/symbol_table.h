@@ -2,44 +2,124 @@
 #define RUJA_SYMBOL_TABLE_H
 
 #include "common.h"
+#include "memory.h"
 #include "types.h"
+#include "string.h"
 
 typedef enum {
     SYMBOL_VAR,
 } Symbol_Type;
 
-typedef struct {
+typedef struct Symbol {
     Symbol_Type type;
-    char* key;
-    size_t key_length;
+    ObjString* key; // Interned, so keys are compared by pointer
+    size_t depth;   // Scope the symbol was declared in, 0 is the global scope
+    struct Symbol* shadowed; // Symbol with the same key it hides until its scope is left
     union {
         struct {
             Type type;
+            size_t slot; // Index in the globals of the vm, or in its stack for locals. Set by the compiler
         } var;
     } as;
 } Symbol;
 
-Symbol *symbol_new_var(Type type, char *name, size_t name_length);
-void symbol_free(Symbol *symbol);
+typedef enum {
+    SYMBOL_DECLARED,   // The key was not in use
+    SYMBOL_SHADOWS,    // Hides a symbol of an enclosing scope
+    SYMBOL_REDECLARED, // Hides a symbol of the same scope
+    SYMBOL_ERROR,      // Out of memory, the symbol was not declared and still belongs to the caller
+} Symbol_Status;
+
+/**
+ * @brief Allocates a variable symbol. It must come from the allocator of the table it is
+ *      declared in, which frees it.
+ */
+Symbol *symbol_new_var(const Ruja_Allocator *allocator, Type type, ObjString *name);
+void symbol_free(const Ruja_Allocator *allocator, Symbol *symbol);
 void symbol_print(Symbol *symbol);
 
 #define DEFAUlT_SYMBOL_TABLE_CAPACITY 8
+#define SYMBOL_TABLE_GROUP_WIDTH 16
+
+/*
+ * Open addressing hash table in the style of a Swiss table. Every slot has a control byte that is
+ * either SYMBOL_CTRL_EMPTY or the low 7 bits of the hash of its key (the fingerprint). Probing
+ * walks groups of SYMBOL_TABLE_GROUP_WIDTH slots and compares all their control bytes at once
+ * (with SSE2 when available), so only slots with a matching fingerprint are ever looked at.
+ * The full hashes are cached next to the symbols: growing never touches the keys.
+ */
+#define SYMBOL_CTRL_EMPTY ((int8_t) -128)
+#define SYMBOL_CTRL_DELETED ((int8_t) -2)
+
+/*
+ * Scopes. A slot always holds the innermost symbol of its key, the ones it hides hang from it
+ * through Symbol.shadowed. Declarations made inside a scope are recorded in an undo log, so
+ * entering a scope only remembers the length of the log and leaving it undoes just the
+ * declarations made since: each one is removed or replaced by the symbol it shadowed.
+ */
 typedef struct {
+    Ruja_Allocator allocator;
     size_t count;
-    size_t capacity;
+    size_t capacity;   // Power of two, at least SYMBOL_TABLE_GROUP_WIDTH. At most 7/8 of it is used
+    size_t tombstones; // Deleted slots, they count towards the load factor
+    int8_t *ctrl;
+    uint64_t *hashes;  // Start of the block of the three arrays
     Symbol **symbols;
+
+    struct {
+        size_t count;
+        size_t capacity;
+        Symbol **items;
+    } undo; // Symbols declared in the open scopes, the innermost last
+
+    struct {
+        size_t count;
+        size_t capacity;
+        size_t *items;
+    } scopes; // Length of the undo log when each open scope was entered
 } Ruja_Symbol_Table;
 
-Ruja_Symbol_Table *symbol_table_new(size_t capacity);
+/**
+ * @brief Creates an empty table that holds capacity symbols without growing.
+ *
+ * @param allocator Allocator of the table and of its symbols, NULL for the default one.
+ */
+Ruja_Symbol_Table *symbol_table_new(size_t capacity, const Ruja_Allocator *allocator);
 void symbol_table_free(Ruja_Symbol_Table *symbol_table);
 void symbol_table_print(Ruja_Symbol_Table *symbol_table);
 
-void symbol_table_resize(Ruja_Symbol_Table *symbol_table, size_t new_capacity);
+/**
+ * @return false If memory ran out, the table is left as it was.
+ */
+bool symbol_table_resize(Ruja_Symbol_Table *symbol_table, size_t new_capacity);
+
+/**
+ * @brief Declares a symbol in the current scope. The table owns it from now on.
+ *
+ * @return Symbol_Status Whether the symbol hides another one, and from which scope.
+ *      SYMBOL_ERROR if memory ran out, the table does not own the symbol then.
+ */
+Symbol_Status symbol_table_declare(Ruja_Symbol_Table *symbol_table, Symbol *symbol);
+Symbol_Status symbol_table_insert(Ruja_Symbol_Table *symbol_table, Symbol *symbol);
+
+/**
+ * @brief Returns the innermost visible symbol of key, NULL if there is none.
+ */
+Symbol *symbol_table_lookup(Ruja_Symbol_Table *symbol_table, ObjString *key);
+
+/**
+ * @return false If memory ran out, no scope was entered.
+ */
+bool symbol_table_enter_scope(Ruja_Symbol_Table *symbol_table);
+
+/**
+ * @brief Leaves the innermost scope, its symbols are freed and the ones they hid are visible again.
+ */
+void symbol_table_exit_scope(Ruja_Symbol_Table *symbol_table);
 
-void symbol_table_insert(Ruja_Symbol_Table *symbol_table, Symbol *symbol);
-Symbol *symbol_table_lookup(Ruja_Symbol_Table *symbol_table, char *key, size_t key_length);
-//NOTE: Why would I want to remove a symbol from the symbol table?
-//bool symbol_table_remove(Ruja_Symbol_Table *symbol_table, char *key);
+static inline size_t symbol_table_depth(const Ruja_Symbol_Table *symbol_table) {
+    return symbol_table->scopes.count;
+}
 
 
 
@@ -5,26 +5,54 @@
 #include "bytecode.h"
 #include "stack.h"
 #include "objects.h"
+#include "gc.h"
 
 typedef enum {
     RUJA_VM_ERROR = -1,
     RUJA_VM_OK,
 } Ruja_Vm_Status;
 
-typedef struct {
+typedef struct Ruja_Vm {
+    Ruja_Allocator allocator; // Every allocation of the vm, objects included
     Bytecode *bytecode;
     Stack* stack;
-    Object* objects;
+    Object* objects;  // Every object owned by the gc, except while it sweeps them
+    Ruja_Gc gc;
+
+    Word* globals;    // Indexed by the slots the compiler gives to global variables
+    size_t n_globals;
 
     Word* sp;
     uint8_t* ip;
 } Ruja_Vm;
 
-Ruja_Vm *vm_new();
+/**
+ * @brief allocator may be NULL for ruja_default_allocator. Pages of the slab still come from
+ *      the OS, see slab.h.
+ */
+Ruja_Vm *vm_new(const Ruja_Allocator* allocator);
 void vm_free(Ruja_Vm *vm);
 
+/**
+ * @brief Makes room for count global variables. New globals start as nil.
+ *
+ * @return false If the memory could not be allocated.
+ */
+bool vm_reserve_globals(Ruja_Vm *vm, size_t count);
+
 Object* vm_allocate_object(Ruja_Vm *vm, object_type type, ...);
 
+/**
+ * @brief Stores into result the length bytes of a string value from offset, without copying
+ *      them: the result is a view of the flat string that holds them. Substrings that fit in
+ *      a word are small strings. string must be a root (stack or globals), the base of
+ *      substring, split and trim builtins.
+ *
+ * @return false If string is not a string, the bytes are out of its bounds or memory ran out.
+ *      The error is reported.
+ */
+bool vm_substring(Ruja_Vm *vm, Word* string, size_t offset, size_t length, Word* result);
+
 Ruja_Vm_Status vm_run(Ruja_Vm *vm);
 
 
@@ -11,6 +11,7 @@
 #define TYPE_BOOL  0x7FFA000000000000 // 0...010
 #define TYPE_CHAR  0x7FFB000000000000 // 0...011
 #define TYPE_INT   0x7FFC000000000000 // 0...100
+#define TYPE_SSTR  0x7FFD000000000000 // 0...101
 #define TYPE_OBJ   0x8FF8000000000000 // 1...000
 
 // Mask
@@ -26,6 +27,7 @@
 #define IS_BOOL(x)  (((x) & MASK_TYPE) == TYPE_BOOL)
 #define IS_CHAR(x)  (((x) & MASK_TYPE) == TYPE_CHAR)
 #define IS_INT(x)   (((x) & MASK_TYPE) == TYPE_INT)
+#define IS_SSTR(x)  (((x) & MASK_TYPE) == TYPE_SSTR)
 #define IS_DOUBLE(x) ((((x) & TYPE_NAN) != TYPE_NAN) && (((x) & TYPE_OBJ) != TYPE_OBJ))
 #define IS_OBJECT(x) (((x) & TYPE_OBJ) == TYPE_OBJ)
 
@@ -42,6 +44,12 @@
 #define AS_CHAR(x)  ((char) ((x) & MASK_VALUE))
 #define AS_BOOL(x)  as_bool(x)
 #define AS_INT(x)   ((int32_t) ((x) & MASK_VALUE)) 
+
+// Small strings: up to SSTR_MAX bytes packed in the payload, byte i in bits [8i, 8i + 8), and
+// the length in the top byte. Every string that fits is stored this way, so two small strings
+// are equal if and only if their words are.
+#define SSTR_MAX 5
+#define SSTR_LENGTH(x) ((size_t) (((x) >> 40) & 0xFF))
 #define AS_DOUBLE(x) word_to_double(x)
 
 typedef uint64_t Word;
@@ -65,6 +73,29 @@ static inline double word_to_double(Word value) {
     return data.num;
 }
 
+static inline Word make_sstr(const char* chars, size_t length) {
+    Word word = TYPE_SSTR | ((Word) length << 40);
+    for (size_t i = 0; i < length; i++) {
+        word |= (Word) (uint8_t) chars[i] << (8 * i);
+    }
+    return word;
+}
+
+/**
+ * @brief Copies the bytes of a small string into buffer, which must hold SSTR_MAX + 1 bytes,
+ *      and terminates them with a '\0'.
+ *
+ * @return size_t The length of the string.
+ */
+static inline size_t sstr_unpack(Word word, char* buffer) {
+    size_t length = SSTR_LENGTH(word);
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = (char) (word >> (8 * i));
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
 static inline Word as_bool(Word value) {
     if(IS_DOUBLE(value)) {
         return AS_DOUBLE(value) != 0.0;
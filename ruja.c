@@ -11,15 +11,22 @@
 #include "includes/compiler.h"
 #include "includes/symbol_table.h"
 #include "includes/ir.h"
+#include "includes/interner.h"
+#include "includes/flat_ast.h"
+#include "includes/document.h"
 
 #define STACK_TEST 0
 #define NAN_BOX_TEST 0
 #define BYTECODE_TEST 0
+#define LOAD_TEST 0
 #define LEXER_TEST 0
 #define PARSER_TEST 1
 #define AST_TEST 0
 #define COMPILER_TEST 0
+#define COMPOUND_ASSIGN_TEST 0
 #define SYMBOL_TABLE_TEST 0
+#define FLAT_AST_TEST 0
+#define DOCUMENT_TEST 0
 
 void shift_agrs(int* argc, char*** argv) {
     (*argc)--;
@@ -48,7 +55,7 @@ void usage() {
 
 #if STACK_TEST
 int main() {
-    Stack* stack = stack_new();
+    Stack* stack = stack_new(NULL);
 
 
     stack_trace(stack);
@@ -68,14 +75,14 @@ int main() {
 int main() {
     Word w = MAKE_STRING("Hello, World!\n", 14);
     print_word(stdout, w, 0);
-    object_free(AS_OBJECT(w));
+    object_free(NULL, AS_OBJECT(w));
     return 0;
 }
 #endif
 
 #if BYTECODE_TEST
 int main() {
-    Ruja_Vm* vm = vm_new();
+    Ruja_Vm* vm = vm_new(NULL);
 
     Word w1 = MAKE_STRING("Hello,", 6);
     Word w2 = MAKE_STRING(" World", 6);
@@ -85,34 +92,101 @@ int main() {
     size_t index2 = add_constant(vm->bytecode, w2);
     size_t index3 = add_constant(vm->bytecode, w3);
 
-    add_opcode(vm->bytecode, OP_CONST, 0);
-    add_operand(vm->bytecode, index1, 0);
-    add_opcode(vm->bytecode, OP_CONST, 0);
-    add_operand(vm->bytecode, index2, 0);
-    add_opcode(vm->bytecode, OP_CONST, 0);
-    add_operand(vm->bytecode, index3, 0);
+    add_instruction(vm->bytecode, OP_CONST, index1, 0, 0);
+    add_instruction(vm->bytecode, OP_CONST, index2, 0, 0);
+    add_instruction(vm->bytecode, OP_CONST, index3, 0, 0);
     add_opcode(vm->bytecode, OP_ADD, 0);
     add_opcode(vm->bytecode, OP_ADD, 0);
     add_opcode(vm->bytecode, OP_HALT, 0);
 
     vm_run(vm);
 
-    object_free(AS_OBJECT(w1));
-    object_free(AS_OBJECT(w2));
-    object_free(AS_OBJECT(w3));
+    object_free(NULL, AS_OBJECT(w1));
+    object_free(NULL, AS_OBJECT(w2));
+    object_free(NULL, AS_OBJECT(w3));
     vm_free(vm);
     return 0;
 }
 #endif
 
+#if LOAD_TEST
+// Saves the bytecode, loads it back and runs it if it loaded
+static bool check_load(const char* name, Bytecode* bytecode, bool loads, bool runs) {
+    const char* filename = "load_test.rjb";
+    bool ok = save_bytecode(bytecode, filename);
+    bytecode_free(bytecode);
+
+    Bytecode* loaded = ok ? load_bytecode(filename, NULL) : NULL;
+    remove(filename);
+    ok = ok && (loaded != NULL) == loads;
+    if (ok && loaded != NULL) {
+        Ruja_Vm* vm = vm_new(NULL);
+        if (vm == NULL) return false;
+        bytecode_free(vm->bytecode);
+        vm->bytecode = loaded;
+        ok = (vm_run(vm) == RUJA_VM_OK) == runs;
+        vm_free(vm);
+    } else if (loaded != NULL) {
+        bytecode_free(loaded);
+    }
+
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", name);
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+
+    Bytecode* bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_PUSH_ZERO, 0, 0, 1);
+    size_t jump = add_instruction(bytecode, OP_JZ, 0, 0, 1);
+    add_instruction(bytecode, OP_PUSH_ONE, 0, 0, 1);
+    patch_operand(bytecode, jump, 0, bytecode->count - jump);
+    add_opcode(bytecode, OP_HALT, 1);
+    ok &= check_load("valid code", bytecode, true, true);
+
+    // The operand of PUSH_I32 holds CONST8 200, with no constant 200
+    uint8_t hidden[4] = {OP_CONST8, 200, 0, 0};
+    uint32_t operand;
+    memcpy(&operand, hidden, sizeof(operand));
+    bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_JUMP, INSTRUCTION_SIZE(JUMP) + 1, 0, 1);
+    add_instruction(bytecode, OP_PUSH_I32, operand, 0, 1);
+    add_opcode(bytecode, OP_HALT, 1);
+    ok &= check_load("jump into an operand", bytecode, false, false);
+
+    bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_LOOP, 1, 0, 1);
+    add_opcode(bytecode, OP_HALT, 1);
+    ok &= check_load("loop before the code", bytecode, false, false);
+
+    bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_JUMP, 100, 0, 1);
+    add_opcode(bytecode, OP_HALT, 1);
+    ok &= check_load("jump past the code", bytecode, false, false);
+
+    bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_PUSH_ZERO, 0, 0, 1);
+    ok &= check_load("code without a HALT", bytecode, false, false);
+
+    bytecode = bytecode_new(NULL);
+    add_instruction(bytecode, OP_FOR_RANGE, 5000, 0, 1);
+    add_opcode(bytecode, OP_HALT, 1);
+    ok &= check_load("range of a slot past the stack", bytecode, true, false);
+
+    interner_global_free();
+    return ok ? 0 : 1;
+}
+#endif
+
 #if LEXER_TEST
 int main(void) {
-    Ruja_Lexer* lexer = lexer_new("input.ruja");
+    Ruja_Lexer* lexer = lexer_new("input.ruja", NULL);
     if (lexer != NULL) {
         Ruja_Token* token = NULL;
 
         do {
-            if(token != NULL) token_free(token);
+            if(token != NULL) token_free(&lexer->allocator, token);
             token = next_token(lexer);
             token_to_string(token);
             if (token->kind == RUJA_TOK_ERR) {
@@ -120,7 +194,7 @@ int main(void) {
                 break;
             }
         } while (token->kind != RUJA_TOK_EOF);
-        token_free(token);
+        token_free(&lexer->allocator, token);
 
         lexer_free(lexer);
     }
@@ -141,13 +215,14 @@ int main(int argc, char** argv) {
             } else if (strcmp(*argv, "-v") == 0 || strcmp(*argv, "--version") == 0) {
                 printf("Ruja 0.0.1\n"); return 0;
             } else if (endswith(*argv, ".ruja")) {
-                Ruja_Lexer* lexer = lexer_new(*argv);
+                Ruja_Lexer* lexer = lexer_new(*argv, NULL);
                 if (lexer != NULL) {
-                    Ruja_Parser* parser = parser_new();
+                    lexer_lex_parallel(lexer, 0);
+                    Ruja_Parser* parser = parser_new(NULL);
                     if (parser != NULL) {
-                        Ruja_Ir* ir = ir_new();
+                        Ruja_Ir* ir = ir_new(lexer->content_end - lexer->content_start, NULL);
                         if (ir != NULL) {
-                            if (parse(parser, lexer, &ir->ast, ir->symbol_table)) {
+                            if (parse_parallel(parser, lexer, ir, 0)) {
                                 ast_dot(ir->ast, stdout);
                             }
 
@@ -157,6 +232,7 @@ int main(int argc, char** argv) {
                     }
                     lexer_free(lexer);
                 }
+                interner_global_free();
             } else {
                 printf("Unknown option '%s'.\n", *argv);
                 usage(); return 1;
@@ -171,109 +247,148 @@ int main(int argc, char** argv) {
 #if AST_TEST
 int main() {
     // -(1 + 2 * 3)
+    Ruja_Arena* arena = arena_new(0, NULL);
 
     // Crete the numbers
-    Ruja_Ast number1 = ast_new_literal(MAKE_DOUBLE(1));
-    Ruja_Ast number2 = ast_new_literal(MAKE_DOUBLE(2));
-    Ruja_Ast number3 = ast_new_literal(MAKE_DOUBLE(3));
+    Ruja_Ast number1 = ast_new_literal(arena, MAKE_DOUBLE(1));
+    Ruja_Ast number2 = ast_new_literal(arena, MAKE_DOUBLE(2));
+    Ruja_Ast number3 = ast_new_literal(arena, MAKE_DOUBLE(3));
 
     // Create the multiplication
-    Ruja_Ast multiplication = ast_new_binary_op(AST_BINARY_OP_MUL, number1, number3);
+    Ruja_Ast multiplication = ast_new_binary_op(arena, AST_BINARY_OP_MUL, number1, number3);
 
     // Create the addition
-    Ruja_Ast addition = ast_new_binary_op(AST_BINARY_OP_ADD, number2, multiplication);
+    Ruja_Ast addition = ast_new_binary_op(arena, AST_BINARY_OP_ADD, number2, multiplication);
 
     // Create the negation
-    Ruja_Ast negation = ast_new_unary_op(AST_UNARY_OP_NEG, addition);
+    Ruja_Ast negation = ast_new_unary_op(arena, AST_UNARY_OP_NEG, addition);
 
     // Create the Expression
-    Ruja_Ast expression = ast_new_expression(negation);
+    Ruja_Ast expression = ast_new_expression(arena, negation);
 
     ast_dot(expression, stdout);
-    ast_free(expression);
+    arena_free(arena);
     return 0;
 }
 #endif
 
 #if COMPILER_TEST
 int main(void) {
-    Ruja_Compiler* compiler = compiler_new();
-    Ruja_Vm* vm = vm_new();
+    Ruja_Compiler* compiler = compiler_new(NULL);
+    Ruja_Vm* vm = vm_new(NULL);
 
     if (compile(compiler, "input.ruja", vm) != RUJA_COMPILER_ERROR) {
         // disassemble(vm->bytecode, "code");
         vm_run(vm);
+        gc_print_stats(stdout, &vm->gc);
+        slab_print_stats(stdout, &vm->gc.slab);
     }
 
     vm_free(vm);
     compiler_free(compiler);
+    interner_global_free();
     return 0;
 }
 #endif
 
+#if COMPOUND_ASSIGN_TEST
+// Runs every compound assignment and checks the globals it leaves
+int main(void) {
+    const char* filename = "compound_assign_test.ruja";
+    const char* source =
+        "let a = 10; a /= 2;\n"
+        "let b = 7.5; b /= 2.5;\n"
+        "let c = -7; c /= 2;\n"
+        "let d = 10; d -= 3;\n"
+        "let e = 6; e *= 7;\n"
+        "let f = 17; f %= 5;\n"
+        "let g = 1; g += 4;\n"
+        "let h = 1.5; h *= 2.0;\n";
+    FILE* file = fopen(filename, "w");
+    if (file == NULL || fputs(source, file) == EOF || fclose(file) != 0) return 1;
+
+    Ruja_Compiler* compiler = compiler_new(NULL);
+    Ruja_Vm* vm = vm_new(NULL);
+    bool ok = compile(compiler, filename, vm) != RUJA_COMPILER_ERROR && vm_run(vm) == RUJA_VM_OK && vm->n_globals == 8;
+    remove(filename);
+
+    if (ok) {
+        Word* g = vm->globals;
+        ok = AS_INT(g[0]) == 5 && AS_DOUBLE(g[1]) == 3.0 && AS_INT(g[2]) == -3 && AS_INT(g[3]) == 7
+            && AS_INT(g[4]) == 42 && AS_INT(g[5]) == 2 && AS_INT(g[6]) == 5 && AS_DOUBLE(g[7]) == 3.0;
+    }
+    printf("%s: compound assignments\n", ok ? "PASS" : "FAIL");
+
+    vm_free(vm);
+    compiler_free(compiler);
+    interner_global_free();
+    return ok ? 0 : 1;
+}
+#endif
+
 #if SYMBOL_TABLE_TEST
 int main(void) {
-    Ruja_Symbol_Table* table = symbol_table_new(8);
+    Ruja_Symbol_Table* table = symbol_table_new(8, NULL);
     Symbol* symbol = NULL;
 
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_NIL, "node", 4));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_NIL, interner_intern(interner_global(), "node", 4)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_BOOL, "Mike", 4));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_BOOL, interner_intern(interner_global(), "Mike", 4)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_I32, "Variable", 8));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_I32, interner_intern(interner_global(), "Variable", 8)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_F64, "Needed", 6));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_F64, interner_intern(interner_global(), "Needed", 6)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_STRING, "money", 5));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_STRING, interner_intern(interner_global(), "money", 5)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_CHAR, "boob", 4));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_CHAR, interner_intern(interner_global(), "boob", 4)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_CHAR, "my_char", 7));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_CHAR, interner_intern(interner_global(), "my_char", 7)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_CHAR, "n", 1));
-    if ((symbol = symbol_table_lookup(table, "boob", 4)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_CHAR, interner_intern(interner_global(), "n", 1)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "boob", 4))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
         printf("Did not find symbol!\n");
     }
-    symbol_table_insert(table, symbol_new_var(VAR_TYPE_CHAR, "p", 1));
-    if ((symbol = symbol_table_lookup(table, "p", 1)) != NULL) {
+    symbol_table_insert(table, symbol_new_var(NULL, VAR_TYPE_CHAR, interner_intern(interner_global(), "p", 1)));
+    if ((symbol = symbol_table_lookup(table, interner_intern(interner_global(), "p", 1))) != NULL) {
         printf("Found: ");
         symbol_print(symbol);
     } else {
@@ -283,6 +398,58 @@ int main(void) {
 
     symbol_table_print(table);
     symbol_table_free(table);
+    interner_global_free();
+    return 0;
+}
+#endif
+
+#if FLAT_AST_TEST
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(); return 1;
+    }
+
+    Ruja_Lexer* lexer = lexer_new(argv[1], NULL);
+    if (lexer == NULL) return 1;
+    lexer_lex_parallel(lexer, 0);
+
+    Ruja_Parser* parser = parser_new(NULL);
+    Ruja_Ir* ir = ir_new(lexer->content_end - lexer->content_start, NULL);
+    if (parser != NULL && ir != NULL && parse_parallel(parser, lexer, ir, 0)) {
+        Ruja_Flat_Ast* flat = flat_ast_from_tree(ir->ast);
+        if (flat != NULL) {
+            flat_ast_print(flat, stdout);
+            flat_ast_free(flat);
+        }
+    }
+
+    ir_free(ir);
+    parser_free(parser);
+    lexer_free(lexer);
+    interner_global_free();
+    return 0;
+}
+#endif
+
+#if DOCUMENT_TEST
+// <input-file> <begin> <end> <text>: replaces the bytes [begin, end) and prints the new AST
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        usage(); return 1;
+    }
+
+    Ruja_Document* doc = document_new(argv[1]);
+    if (doc == NULL) return 1;
+
+    size_t begin = strtoull(argv[2], NULL, 10);
+    size_t end = strtoull(argv[3], NULL, 10);
+    if (document_edit(doc, begin, end, argv[4], strlen(argv[4]))) {
+        printf("// %"PRIu64" of %"PRIu64" items parsed again\n", doc->reparsed, doc->count);
+        ast_dot(document_ast(doc), stdout);
+    }
+
+    document_free(doc);
+    interner_global_free();
     return 0;
 }
-#endif
\ No newline at end of file
+#endif
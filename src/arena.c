@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../includes/arena.h"
+
+/**
+ * @brief Allocates a new chunk and makes it the current chunk of the arena.
+ * 
+ * @param arena The arena that will own the chunk.
+ * @param capacity The number of usable bytes in the chunk.
+ * @return Arena_Chunk* The new chunk. NULL if the allocation failed.
+ */
+static Arena_Chunk* arena_push_chunk(Ruja_Arena* arena, size_t capacity) {
+    Arena_Chunk* chunk = ruja_alloc(&arena->allocator, sizeof(Arena_Chunk) + capacity);
+    if (chunk == NULL) {
+        fprintf(stderr, "Error: Could not allocate %zu bytes for arena chunk.\n", capacity);
+        return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->chunks = chunk;
+
+    return chunk;
+}
+
+Ruja_Arena* arena_new(size_t size_hint, const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Arena* arena = ruja_alloc(&owner, sizeof(Ruja_Arena));
+    if (arena == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for arena.\n");
+        return NULL;
+    }
+
+    arena->allocator = owner;
+    arena->chunks = NULL;
+    // Small hints matter: a document keeps one arena per top-level statement
+    arena->chunk_size = size_hint == 0 ? ARENA_DEFAULT_CHUNK_SIZE : ARENA_MIN_CHUNK_SIZE;
+    while (arena->chunk_size < size_hint && arena->chunk_size < ARENA_MAX_CHUNK_SIZE) {
+        arena->chunk_size *= 2;
+    }
+
+    return arena;
+}
+
+void arena_free(Ruja_Arena* arena) {
+    if (arena == NULL) return;
+
+    Arena_Chunk* chunk = arena->chunks;
+    while (chunk != NULL) {
+        Arena_Chunk* next = chunk->next;
+        ruja_free(&arena->allocator, chunk);
+        chunk = next;
+    }
+
+    Ruja_Allocator allocator = arena->allocator;
+    ruja_free(&allocator, arena);
+}
+
+void* arena_alloc(Ruja_Arena* arena, size_t size) {
+    // Round up so the next allocation stays aligned
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    Arena_Chunk* chunk = arena->chunks;
+    if (chunk == NULL || chunk->capacity - chunk->used < size) {
+        if (chunk != NULL && arena->chunk_size < ARENA_MAX_CHUNK_SIZE) arena->chunk_size *= 2;
+        chunk = arena_push_chunk(arena, size > arena->chunk_size ? size : arena->chunk_size);
+        if (chunk == NULL) return NULL;
+    }
+
+    void* result = (char*) chunk->data + chunk->used;
+    chunk->used += size;
+    return result;
+}
+
+void* arena_copy(Ruja_Arena* arena, const void* data, size_t size) {
+    void* result = arena_alloc(arena, size);
+    if (result == NULL) return NULL;
+
+    memcpy(result, data, size);
+    return result;
+}
+
+void arena_adopt(Ruja_Arena* arena, Ruja_Arena* other) {
+    if (other == NULL) return;
+
+    Arena_Chunk* last = other->chunks;
+    if (last != NULL) {
+        while (last->next != NULL) last = last->next;
+
+        // Keep the chunk being filled at the head, the adopted ones go right after it
+        if (arena->chunks == NULL) {
+            arena->chunks = other->chunks;
+        } else {
+            last->next = arena->chunks->next;
+            arena->chunks->next = other->chunks;
+        }
+        other->chunks = NULL;
+    }
+
+    arena_free(other);
+}
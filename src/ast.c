@@ -3,9 +3,16 @@
 
 #include "../includes/ast.h"
 #include "../includes/bytecode.h"
+#include "../includes/memory.h"
 
-Ruja_Ast ast_new() {
-    Ruja_Ast ast = malloc(sizeof(struct Ruja_Ast_Node));
+// Copies token into the arena. A node whose token could not be copied is not built
+#define COPY_TOKEN(field, token) do { \
+        (field) = ast_copy_token(arena, (token)); \
+        if ((field) == NULL && (token) != NULL) return NULL; \
+    } while (0)
+
+Ruja_Ast ast_new(Ruja_Arena* arena) {
+    Ruja_Ast ast = arena_alloc(arena, sizeof(struct Ruja_Ast_Node));
     if (ast == NULL) {
         fprintf(stderr, "Failed to allocate memory for ast\n");
         return NULL;
@@ -15,173 +22,70 @@ Ruja_Ast ast_new() {
     return ast;
 }
 
-void ast_free(Ruja_Ast ast) {
-    if (ast == NULL) return;
-
-    switch (ast->type) {
-        case AST_NODE_EMPTY:
-            break;
-        case AST_NODE_LITERAL:
-            token_free(ast->as.literal.tok_literal);
-            break;
-        case AST_NODE_IDENTIFIER:
-            token_free(ast->as.identifier.tok_identifier);
-            break;
-        case AST_NODE_UNARY_OP:
-            token_free(ast->as.unary_op.tok_unary);
-            ast_free(ast->as.unary_op.expression);
-            break;
-        case AST_NODE_BINARY_OP:
-            token_free(ast->as.binary_op.tok_binary);
-            ast_free(ast->as.binary_op.left_expression);
-            ast_free(ast->as.binary_op.right_expression);
-            break;
-        case AST_NODE_TERNARY_OP:
-            token_free(ast->as.ternary_op.tok_ternary.tok_question);
-            token_free(ast->as.ternary_op.tok_ternary.tok_colon);
-            ast_free(ast->as.ternary_op.condition);
-            ast_free(ast->as.ternary_op.true_expression);
-            ast_free(ast->as.ternary_op.false_expression);
-            break;
-        case AST_NODE_EXPRESSION:
-            ast_free(ast->as.expr.expression);
-            break;
-        case AST_NODE_STMT_ASSIGN:
-            token_free(ast->as.assign.tok_assign);
-            ast_free(ast->as.assign.identifier);
-            ast_free(ast->as.assign.expression);
-            break;
-        case AST_NODE_STMT_TYPED_DECL:
-            token_free(ast->as.typed_decl.tok_dtype);
-            ast_free(ast->as.typed_decl.identifier);
-            break;
-        case AST_NODE_STMT_TYPED_DECL_ASSIGN:
-            token_free(ast->as.typed_decl_assign.tok_dtype);
-            token_free(ast->as.typed_decl_assign.tok_assign);
-            ast_free(ast->as.typed_decl_assign.identifier);
-            ast_free(ast->as.typed_decl_assign.expression);
-            break;
-        case AST_NODE_STMT_INFERRED_DECL_ASSIGN:
-            token_free(ast->as.inferred_decl_assign.tok_assign);
-            ast_free(ast->as.inferred_decl_assign.identifier);
-            ast_free(ast->as.inferred_decl_assign.expression);
-            break;
-        case AST_NODE_STMT_IF:
-            token_free(ast->as.if_branch.tok_if);
-            ast_free(ast->as.if_branch.condition);
-            ast_free(ast->as.if_branch.body);
-            ast_free(ast->as.if_branch.next_branch);
-            break;
-        case AST_NODE_STMT_ELIF:
-            token_free(ast->as.elif_branch.tok_elif);
-            ast_free(ast->as.elif_branch.condition);
-            ast_free(ast->as.elif_branch.body);
-            ast_free(ast->as.elif_branch.next_branch);
-            break;
-        case AST_NODE_STMT_ELSE:
-            token_free(ast->as.else_branch.tok_else);
-            ast_free(ast->as.else_branch.body);
-            break;
-        case AST_NODE_RANGED_ITER:
-            ast_free(ast->as.ranged_iter.start_expr);
-            ast_free(ast->as.ranged_iter.end_expr);
-            ast_free(ast->as.ranged_iter.step_expr);
-            break;
-        case AST_NODE_STMT_FOR:
-            token_free(ast->as.for_loop.tok_for);
-            token_free(ast->as.for_loop.tok_in);
-            ast_free(ast->as.for_loop.identifier);
-            ast_free(ast->as.for_loop.iter);
-            ast_free(ast->as.for_loop.body);
-            break;
-        case AST_NODE_STMT_WHILE:
-            token_free(ast->as.while_loop.tok_while);
-            ast_free(ast->as.while_loop.condition);
-            ast_free(ast->as.while_loop.body);
-            break;
-        case AST_NODE_STMT_STRUCT_MEMBER:
-            token_free(ast->as.struct_member.tok_dtype);
-            ast_free(ast->as.struct_member.identifier);
-            ast_free(ast->as.struct_member.next_member);
-            break;
-        case AST_NODE_STMT_STRUCT_DEF:
-            token_free(ast->as.struct_def.tok_struct);
-            ast_free(ast->as.struct_def.identifier);
-            ast_free(ast->as.struct_def.members);
-            break;
-        case AST_NODE_STMTS:
-            ast_free(ast->as.stmts.statement);
-            ast_free(ast->as.stmts.next);
-            break;
-    }
-
-    free(ast);
+Ruja_Token* ast_copy_token(Ruja_Arena* arena, Ruja_Token* token) {
+    if (token == NULL) return NULL;
+    return arena_copy(arena, token, sizeof(Ruja_Token));
 }
 
-Ruja_Ast ast_new_literal(Ruja_Token* literal_token) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_literal(Ruja_Arena* arena, Ruja_Token* literal_token) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_LITERAL;
-    ast->as.literal.tok_literal = literal_token;
+    COPY_TOKEN(ast->as.literal.tok_literal, literal_token);
 
-    literal_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_identifier(Ruja_Token* identifier_token) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_identifier(Ruja_Arena* arena, Ruja_Token* identifier_token) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_IDENTIFIER;
-    ast->as.identifier.tok_identifier = identifier_token;
+    COPY_TOKEN(ast->as.identifier.tok_identifier, identifier_token);
 
-    identifier_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_unary_op(Ruja_Token* unary_token, Ruja_Ast expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_unary_op(Ruja_Arena* arena, Ruja_Token* unary_token, Ruja_Ast expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_UNARY_OP;
-    ast->as.unary_op.tok_unary = unary_token;
+    COPY_TOKEN(ast->as.unary_op.tok_unary, unary_token);
     ast->as.unary_op.expression = expression;
 
-    unary_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_binary_op(Ruja_Token* binary_token, Ruja_Ast left_expression, Ruja_Ast right_expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_binary_op(Ruja_Arena* arena, Ruja_Token* binary_token, Ruja_Ast left_expression, Ruja_Ast right_expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_BINARY_OP;
-    ast->as.binary_op.tok_binary = binary_token;
+    COPY_TOKEN(ast->as.binary_op.tok_binary, binary_token);
     ast->as.binary_op.left_expression = left_expression;
     ast->as.binary_op.right_expression = right_expression;
 
-    binary_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_ternary_op(Ruja_Token* tok_question, Ruja_Token* tok_colon, Ruja_Ast condition, Ruja_Ast true_expression, Ruja_Ast false_expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_ternary_op(Ruja_Arena* arena, Ruja_Token* tok_question, Ruja_Token* tok_colon, Ruja_Ast condition, Ruja_Ast true_expression, Ruja_Ast false_expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_TERNARY_OP;
-    ast->as.ternary_op.tok_ternary.tok_question = tok_question;
-    ast->as.ternary_op.tok_ternary.tok_colon = tok_colon;
+    COPY_TOKEN(ast->as.ternary_op.tok_ternary.tok_question, tok_question);
+    COPY_TOKEN(ast->as.ternary_op.tok_ternary.tok_colon, tok_colon);
     ast->as.ternary_op.condition = condition;
     ast->as.ternary_op.true_expression = true_expression;
     ast->as.ternary_op.false_expression = false_expression;
 
-    tok_question->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_expression(Ruja_Ast expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_expression(Ruja_Arena* arena, Ruja_Ast expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_EXPRESSION;
@@ -190,101 +94,93 @@ Ruja_Ast ast_new_expression(Ruja_Ast expression) {
     return ast;
 }
 
-Ruja_Ast ast_new_assign(Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_assign(Ruja_Arena* arena, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_ASSIGN;
-    ast->as.assign.tok_assign = assign_token;
+    COPY_TOKEN(ast->as.assign.tok_assign, assign_token);
     ast->as.assign.identifier = identifier;
     ast->as.assign.expression = expression;
 
-    assign_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_typed_decl(Ruja_Token* dtype_token, Ruja_Ast identifier) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_typed_decl(Ruja_Arena* arena, Ruja_Token* dtype_token, Ruja_Ast identifier) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_TYPED_DECL;
-    ast->as.typed_decl.tok_dtype = dtype_token;
+    COPY_TOKEN(ast->as.typed_decl.tok_dtype, dtype_token);
     ast->as.typed_decl.identifier = identifier;
 
-    dtype_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_typed_decl_assign(Ruja_Token* dtype_token, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_typed_decl_assign(Ruja_Arena* arena, Ruja_Token* dtype_token, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_TYPED_DECL_ASSIGN;
-    ast->as.typed_decl_assign.tok_dtype = dtype_token;
-    ast->as.typed_decl_assign.tok_assign = assign_token;
+    COPY_TOKEN(ast->as.typed_decl_assign.tok_dtype, dtype_token);
+    COPY_TOKEN(ast->as.typed_decl_assign.tok_assign, assign_token);
     ast->as.typed_decl_assign.identifier = identifier;
     ast->as.typed_decl_assign.expression = expression;
 
-    dtype_token->in_ast = true;
-    assign_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_inferred_decl_assign(Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_inferred_decl_assign(Ruja_Arena* arena, Ruja_Token* assign_token, Ruja_Ast identifier, Ruja_Ast expression) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_INFERRED_DECL_ASSIGN;
-    ast->as.inferred_decl_assign.tok_assign = assign_token;
+    COPY_TOKEN(ast->as.inferred_decl_assign.tok_assign, assign_token);
     ast->as.inferred_decl_assign.identifier = identifier;
     ast->as.inferred_decl_assign.expression = expression;
 
-    assign_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_if_stmt(Ruja_Token* if_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast next_branch) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_if_stmt(Ruja_Arena* arena, Ruja_Token* if_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast next_branch) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_IF;
-    ast->as.if_branch.tok_if = if_token;
+    COPY_TOKEN(ast->as.if_branch.tok_if, if_token);
     ast->as.if_branch.condition = condition;
     ast->as.if_branch.body = body;
     ast->as.if_branch.next_branch = next_branch;
 
-    if_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_elif_stmt(Ruja_Token* elif_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_elif_stmt(Ruja_Arena* arena, Ruja_Token* elif_token, Ruja_Ast condition, Ruja_Ast body, Ruja_Ast else_stmt) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_ELIF;
-    ast->as.elif_branch.tok_elif = elif_token;
+    COPY_TOKEN(ast->as.elif_branch.tok_elif, elif_token);
     ast->as.elif_branch.condition = condition;
     ast->as.elif_branch.body = body;
     ast->as.elif_branch.next_branch = else_stmt;
 
-    elif_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_else_stmt(Ruja_Token* else_token, Ruja_Ast body) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_else_stmt(Ruja_Arena* arena, Ruja_Token* else_token, Ruja_Ast body) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_ELSE;
-    ast->as.else_branch.tok_else = else_token;
+    COPY_TOKEN(ast->as.else_branch.tok_else, else_token);
     ast->as.else_branch.body = body;
 
-    else_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_ranged_iter(Ruja_Ast start_expr, Ruja_Ast end_expr, Ruja_Ast step_expr) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_ranged_iter(Ruja_Arena* arena, Ruja_Ast start_expr, Ruja_Ast end_expr, Ruja_Ast step_expr) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_RANGED_ITER;
@@ -295,36 +191,34 @@ Ruja_Ast ast_new_ranged_iter(Ruja_Ast start_expr, Ruja_Ast end_expr, Ruja_Ast st
     return ast;
 }
 
-Ruja_Ast ast_new_for_loop(Ruja_Token* for_token, Ruja_Ast identifier, Ruja_Ast iter, Ruja_Ast body) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_for_loop(Ruja_Arena* arena, Ruja_Token* for_token, Ruja_Ast identifier, Ruja_Ast iter, Ruja_Ast body) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_FOR;
-    ast->as.for_loop.tok_for = for_token;
+    COPY_TOKEN(ast->as.for_loop.tok_for, for_token);
     ast->as.for_loop.tok_in = NULL;
     ast->as.for_loop.identifier = identifier;
     ast->as.for_loop.iter = iter;
     ast->as.for_loop.body = body;
 
-    for_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_while_loop(Ruja_Token* while_token, Ruja_Ast condition, Ruja_Ast body) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_while_loop(Ruja_Arena* arena, Ruja_Token* while_token, Ruja_Ast condition, Ruja_Ast body) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_WHILE;
-    ast->as.while_loop.tok_while = while_token;
+    COPY_TOKEN(ast->as.while_loop.tok_while, while_token);
     ast->as.while_loop.condition = condition;
     ast->as.while_loop.body = body;
 
-    while_token->in_ast = true;
     return ast;
 }
 
-Ruja_Ast ast_new_struct_members(Ruja_Ast identifier_token, Ruja_Ast next_member) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_struct_members(Ruja_Arena* arena, Ruja_Ast identifier_token, Ruja_Ast next_member) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_STRUCT_MEMBER;
@@ -335,23 +229,22 @@ Ruja_Ast ast_new_struct_members(Ruja_Ast identifier_token, Ruja_Ast next_member)
     return ast;
 }
 
-Ruja_Ast ast_new_struct_def(Ruja_Token* struct_token, Ruja_Ast identifier_token, Ruja_Ast members) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_struct_def(Ruja_Arena* arena, Ruja_Token* struct_token, Ruja_Ast identifier_token, Ruja_Ast members) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMT_STRUCT_DEF;
-    ast->as.struct_def.tok_struct = struct_token;
+    COPY_TOKEN(ast->as.struct_def.tok_struct, struct_token);
     ast->as.struct_def.identifier = identifier_token;
     ast->as.struct_def.members = members;
 
-    struct_token->in_ast = true;
     return ast;
 }
 
 
 
-Ruja_Ast ast_new_stmt(Ruja_Ast statement, Ruja_Ast next) {
-    Ruja_Ast ast = ast_new();
+Ruja_Ast ast_new_stmt(Ruja_Arena* arena, Ruja_Ast statement, Ruja_Ast next) {
+    Ruja_Ast ast = ast_new(arena);
     if (ast == NULL) return NULL;
 
     ast->type = AST_NODE_STMTS;
@@ -361,6 +254,8 @@ Ruja_Ast ast_new_stmt(Ruja_Ast statement, Ruja_Ast next) {
     return ast;
 }
 
+#undef COPY_TOKEN
+
 static const char* assign_to_string(Ruja_Token_Kind kind) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch-enum"
@@ -489,8 +384,8 @@ static void print_token_word(FILE* file, Ruja_Token* token) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch-enum"
     switch (token->kind) {
-        case RUJA_TOK_INT: fprintf(file, "%ld", strtol(token->start, NULL, 10)); break;
-        case RUJA_TOK_FLOAT: fprintf(file, "%lf", strtod(token->start, NULL)); break;
+        case RUJA_TOK_INT: fprintf(file, "%" PRId32, token->as.i32); break;
+        case RUJA_TOK_FLOAT: fprintf(file, "%lf", token->as.f64); break;
         case RUJA_TOK_CHAR: fprintf(file, "'%c'", *(token->start)); break;
         case RUJA_TOK_TRUE: fprintf(file, "%.*s", (int) token->length, token->start); break;
         case RUJA_TOK_FALSE: fprintf(file, "%.*s", (int) token->length, token->start); break;
@@ -529,13 +424,53 @@ static void dot_arrow(FILE* file, size_t from, size_t to, const char* label) {
     fprintf(file, "    %zu -> %zu [label=\"%s\"];\n", from, to, label);
 }
 
+typedef enum {
+    DOT_CHILD, // A subtree, printed once the items before it are done
+    DOT_LEAF,  // A label node
+    DOT_WORD,  // A token node
+} Dot_Item_Kind;
+
+// Pending output of ast_dot. Every item prints an arrow from its parent followed by a node.
+typedef struct {
+    Dot_Item_Kind kind;
+    size_t parent;
+    const char* arrow;
+    union {
+        Ruja_Ast ast;
+        const char* label;
+        Ruja_Token* token;
+    } as;
+    const char* color;
+} Dot_Item;
+
+// Items of a single node, in printing order. No node has more than 4.
+typedef struct {
+    size_t count;
+    Dot_Item items[4];
+} Dot_Children;
+
+static void dot_child(Dot_Children* children, size_t parent, const char* arrow, Ruja_Ast ast) {
+    children->items[children->count++] = (Dot_Item) {.kind = DOT_CHILD, .parent = parent, .arrow = arrow, .as.ast = ast};
+}
+
+static void dot_leaf(Dot_Children* children, size_t parent, const char* arrow, const char* label, const char* color) {
+    children->items[children->count++] = (Dot_Item) {.kind = DOT_LEAF, .parent = parent, .arrow = arrow, .as.label = label, .color = color};
+}
+
+static void dot_word(Dot_Children* children, size_t parent, const char* arrow, Ruja_Token* token, const char* color) {
+    children->items[children->count++] = (Dot_Item) {.kind = DOT_WORD, .parent = parent, .arrow = arrow, .as.token = token, .color = color};
+}
+
 /**
- * @brief Internal recursive function to print an ast to a file in dot format
+ * @brief Prints a single ast node to a file in dot format. Its arrows and children are
+ *      not printed, they are collected in children so ast_dot can print them in order.
  * 
  * @param ast The ast to print
  * @param file The file pointer
+ * @param root_id The id of the node
+ * @param children Where the children of the node are collected
  */
-static void ast_dot_internal(Ruja_Ast ast, FILE* file, size_t* id) {
+static void ast_dot_node(Ruja_Ast ast, FILE* file, size_t root_id, Dot_Children* children) {
 // Dark colors
 #define DARK_BLUE "#0000CC"
 #define DARK_GREEN "#00CC00"
@@ -549,168 +484,123 @@ static void ast_dot_internal(Ruja_Ast ast, FILE* file, size_t* id) {
 #define LITERAL_COLOR "#CCFFCC"
 #define ARITHMETIC_COLOR "#FFCCCC"
 #define IDENTIFIER_COLOR "#FFFFCC"
+    children->count = 0;
     if (ast == NULL) return;
 
-    size_t root_id = *id;
     switch (ast->type) {
         case AST_NODE_EMPTY:
             dot_node(file, root_id, "Empty", DARK_RED, "filled");
             break;
         case AST_NODE_LITERAL:
             dot_node(file, root_id, "Literal", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "value");
-            dot_node_word(file, *id, ast->as.literal.tok_literal, LITERAL_COLOR, "filled");
+            dot_word(children, root_id, "value", ast->as.literal.tok_literal, LITERAL_COLOR);
             break;
         case AST_NODE_IDENTIFIER:
             dot_node(file, root_id, "Identifier", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "name");
-            dot_node_word(file, *id, ast->as.literal.tok_literal, IDENTIFIER_COLOR, "filled");
+            dot_word(children, root_id, "name", ast->as.literal.tok_literal, IDENTIFIER_COLOR);
             break;
         case AST_NODE_UNARY_OP:
             dot_node(file, root_id, "UnaryOp", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "type");
-            dot_node(file, *id, unary_token_kind_to_string(ast->as.unary_op.tok_unary->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "expression");
-            ast_dot_internal(ast->as.unary_op.expression, file, id);
+            dot_leaf(children, root_id, "type", unary_token_kind_to_string(ast->as.unary_op.tok_unary->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "expression", ast->as.unary_op.expression);
             break;
         case AST_NODE_BINARY_OP:
             dot_node(file, root_id, "BinaryOp", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "left_expression");
-            ast_dot_internal(ast->as.binary_op.left_expression, file, id);
-            dot_arrow(file, root_id, increment(id), "type");
-            dot_node(file, *id, binary_token_kind_to_string(ast->as.binary_op.tok_binary->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "right_expression");
-            ast_dot_internal(ast->as.binary_op.right_expression, file, id);
+            dot_child(children, root_id, "left_expression", ast->as.binary_op.left_expression);
+            dot_leaf(children, root_id, "type", binary_token_kind_to_string(ast->as.binary_op.tok_binary->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "right_expression", ast->as.binary_op.right_expression);
             break;
         case AST_NODE_TERNARY_OP:
             dot_node(file, root_id, "TernaryOp", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "condition");
-            ast_dot_internal(ast->as.ternary_op.condition, file, id);
-            dot_arrow(file, root_id, increment(id), "true_expression");
-            ast_dot_internal(ast->as.ternary_op.true_expression, file, id);
-            dot_arrow(file, root_id, increment(id), "false_expression");
-            ast_dot_internal(ast->as.ternary_op.false_expression, file, id);
+            dot_child(children, root_id, "condition", ast->as.ternary_op.condition);
+            dot_child(children, root_id, "true_expression", ast->as.ternary_op.true_expression);
+            dot_child(children, root_id, "false_expression", ast->as.ternary_op.false_expression);
             break;
         case AST_NODE_EXPRESSION:
             dot_node(file, root_id, "Expression", EXPRESSION_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "expression");
-            ast_dot_internal(ast->as.expr.expression, file, id);
+            dot_child(children, root_id, "expression", ast->as.expr.expression);
             break;
         case AST_NODE_STMT_ASSIGN:
             dot_node(file, root_id, "Assignment", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "assign_type");
-            dot_node(file, *id, assign_to_string(ast->as.assign.tok_assign->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.assign.identifier, file, id);
-            dot_arrow(file, root_id, increment(id), "expression");
-            ast_dot_internal(ast->as.assign.expression, file, id);
+            dot_leaf(children, root_id, "assign_type", assign_to_string(ast->as.assign.tok_assign->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "identifier", ast->as.assign.identifier);
+            dot_child(children, root_id, "expression", ast->as.assign.expression);
             break;
         case AST_NODE_STMT_TYPED_DECL:
             dot_node(file, root_id, "TypedDeclaration", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "type");
-            dot_node(file, *id, type_to_string(ast->as.typed_decl.tok_dtype->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.typed_decl.identifier, file, id);
+            dot_leaf(children, root_id, "type", type_to_string(ast->as.typed_decl.tok_dtype->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "identifier", ast->as.typed_decl.identifier);
             break;
         case AST_NODE_STMT_TYPED_DECL_ASSIGN:
             dot_node(file, root_id, "TypedDeclarationAssignment", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "type");
-            dot_node(file, *id, type_to_string(ast->as.typed_decl_assign.tok_dtype->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "assign");
-            dot_node(file, *id, assign_to_string(ast->as.typed_decl_assign.tok_assign->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.typed_decl_assign.identifier, file, id);
-            dot_arrow(file, root_id, increment(id), "expression");
-            ast_dot_internal(ast->as.typed_decl_assign.expression, file, id);
+            dot_leaf(children, root_id, "type", type_to_string(ast->as.typed_decl_assign.tok_dtype->kind), ARITHMETIC_COLOR);
+            dot_leaf(children, root_id, "assign", assign_to_string(ast->as.typed_decl_assign.tok_assign->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "identifier", ast->as.typed_decl_assign.identifier);
+            dot_child(children, root_id, "expression", ast->as.typed_decl_assign.expression);
             break;
         case AST_NODE_STMT_INFERRED_DECL_ASSIGN:
             dot_node(file, root_id, "InferredDeclarationAssignment", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.inferred_decl_assign.identifier, file, id);
-            dot_arrow(file, root_id, increment(id), "assign");
-            dot_node(file, *id, assign_to_string(ast->as.inferred_decl_assign.tok_assign->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "expression");
-            ast_dot_internal(ast->as.inferred_decl_assign.expression, file, id);
+            dot_child(children, root_id, "identifier", ast->as.inferred_decl_assign.identifier);
+            dot_leaf(children, root_id, "assign", assign_to_string(ast->as.inferred_decl_assign.tok_assign->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "expression", ast->as.inferred_decl_assign.expression);
             break;
         case AST_NODE_STMT_IF:
             dot_node(file, root_id, "IfBranch", BRANCH_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "condition");
-            ast_dot_internal(ast->as.if_branch.condition, file, id);
-            dot_arrow(file, root_id, increment(id), "body");
-            ast_dot_internal(ast->as.if_branch.body, file, id);
+            dot_child(children, root_id, "condition", ast->as.if_branch.condition);
+            dot_child(children, root_id, "body", ast->as.if_branch.body);
             if (ast->as.if_branch.next_branch != NULL) {
-                dot_arrow(file, root_id, increment(id), "next");
-                ast_dot_internal(ast->as.if_branch.next_branch, file, id);
+                dot_child(children, root_id, "next", ast->as.if_branch.next_branch);
             }
             break;
         case AST_NODE_STMT_ELIF:
             dot_node(file, root_id, "ElifBranch", BRANCH_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "condition");
-            ast_dot_internal(ast->as.elif_branch.condition, file, id);
-            dot_arrow(file, root_id, increment(id), "body");
-            ast_dot_internal(ast->as.elif_branch.body, file, id);
+            dot_child(children, root_id, "condition", ast->as.elif_branch.condition);
+            dot_child(children, root_id, "body", ast->as.elif_branch.body);
             if (ast->as.elif_branch.next_branch != NULL) {
-                dot_arrow(file, root_id, increment(id), "next");
-                ast_dot_internal(ast->as.elif_branch.next_branch, file, id);
+                dot_child(children, root_id, "next", ast->as.elif_branch.next_branch);
             }
             break;
         case AST_NODE_STMT_ELSE:
             dot_node(file, root_id, "ElseBranch", BRANCH_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "body");
-            ast_dot_internal(ast->as.else_branch.body, file, id);
+            dot_child(children, root_id, "body", ast->as.else_branch.body);
             break;
         case AST_NODE_RANGED_ITER:
             dot_node(file, root_id, "RangedIteration", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "start");
-            ast_dot_internal(ast->as.ranged_iter.start_expr, file, id);
-            dot_arrow(file, root_id, increment(id), "end");
-            ast_dot_internal(ast->as.ranged_iter.end_expr, file, id);
+            dot_child(children, root_id, "start", ast->as.ranged_iter.start_expr);
+            dot_child(children, root_id, "end", ast->as.ranged_iter.end_expr);
             if (ast->as.ranged_iter.step_expr != NULL) {
-                dot_arrow(file, root_id, increment(id), "step");
-                ast_dot_internal(ast->as.ranged_iter.step_expr, file, id);
+                dot_child(children, root_id, "step", ast->as.ranged_iter.step_expr);
             }
             break;
         case AST_NODE_STMT_FOR:
             dot_node(file, root_id, "ForLoop", LOOP_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.for_loop.identifier, file, id);
-            dot_arrow(file, root_id, increment(id), "iterable");
-            ast_dot_internal(ast->as.for_loop.iter, file, id);
-            dot_arrow(file, root_id, increment(id), "body");
-            ast_dot_internal(ast->as.for_loop.body, file, id);
+            dot_child(children, root_id, "identifier", ast->as.for_loop.identifier);
+            dot_child(children, root_id, "iterable", ast->as.for_loop.iter);
+            dot_child(children, root_id, "body", ast->as.for_loop.body);
             break;
         case AST_NODE_STMT_WHILE:
             dot_node(file, root_id, "WhileLoop", LOOP_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "condition");
-            ast_dot_internal(ast->as.while_loop.condition, file, id);
-            dot_arrow(file, root_id, increment(id), "body");
-            ast_dot_internal(ast->as.while_loop.body, file, id);
+            dot_child(children, root_id, "condition", ast->as.while_loop.condition);
+            dot_child(children, root_id, "body", ast->as.while_loop.body);
             break;
         case AST_NODE_STMT_STRUCT_MEMBER:
             dot_node(file, root_id, "StructMember", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "type");
-            dot_node(file, *id, type_to_string(ast->as.struct_member.tok_dtype->kind), ARITHMETIC_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.struct_member.identifier, file, id);
+            dot_leaf(children, root_id, "type", type_to_string(ast->as.struct_member.tok_dtype->kind), ARITHMETIC_COLOR);
+            dot_child(children, root_id, "identifier", ast->as.struct_member.identifier);
             if (ast->as.struct_member.next_member != NULL) {
-                dot_arrow(file, root_id, increment(id), "next");
-                ast_dot_internal(ast->as.struct_member.next_member, file, id);
+                dot_child(children, root_id, "next", ast->as.struct_member.next_member);
             }
             break;
         case AST_NODE_STMT_STRUCT_DEF:
             dot_node(file, root_id, "StructDefinition", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "identifier");
-            ast_dot_internal(ast->as.struct_def.identifier, file, id);
-            dot_arrow(file, root_id, increment(id), "members");
-            ast_dot_internal(ast->as.struct_def.members, file, id);
+            dot_child(children, root_id, "identifier", ast->as.struct_def.identifier);
+            dot_child(children, root_id, "members", ast->as.struct_def.members);
             break;
         case AST_NODE_STMTS:
             dot_node(file, root_id, "Statements", STATEMENT_COLOR, "filled");
-            dot_arrow(file, root_id, increment(id), "statement");
-            ast_dot_internal(ast->as.stmts.statement, file, id);
+            dot_child(children, root_id, "statement", ast->as.stmts.statement);
             if (ast->as.stmts.next != NULL) {
-                dot_arrow(file, root_id, increment(id), "next");
-                ast_dot_internal(ast->as.stmts.next, file, id);
+                dot_child(children, root_id, "next", ast->as.stmts.next);
             }
             break;
     }
@@ -734,7 +624,41 @@ void ast_dot(Ruja_Ast ast, FILE *file) {
     fprintf(file, "digraph ast {\n");
     fprintf(file, "    graph [rankdir=LR];\n");
     fprintf(file, "    node [shape=box];\n");
+
+    // The tree is walked with an explicit stack so deep expressions do not overflow the C stack
+    struct {
+        size_t count;
+        size_t capacity;
+        Dot_Item* items;
+    } stack = {0};
+
     size_t id = 0;
-    ast_dot_internal(ast, file, &id);
+    Dot_Children children;
+    Dot_Item root = {.kind = DOT_CHILD, .parent = 0, .arrow = NULL, .as.ast = ast};
+    Dot_Item* item = &root;
+    while (item != NULL) {
+        if (item->arrow != NULL) dot_arrow(file, item->parent, increment(&id), item->arrow);
+
+        children.count = 0;
+        switch (item->kind) {
+            case DOT_CHILD: ast_dot_node(item->as.ast, file, id, &children); break;
+            case DOT_LEAF: dot_node(file, id, item->as.label, item->color, "filled"); break;
+            case DOT_WORD: dot_node_word(file, id, item->as.token, item->color, "filled"); break;
+        }
+
+        // Push in reverse so the first child is printed first
+        for (size_t i = children.count; i > 0; i--) {
+            if (stack.count == stack.capacity && !REALLOC_DA(Dot_Item, (&stack))) {
+                // The graph is cut short
+                stack.count = 0;
+                break;
+            }
+            stack.items[stack.count++] = children.items[i - 1];
+        }
+
+        item = stack.count > 0 ? &stack.items[--stack.count] : NULL;
+    }
+
+    free(stack.items);
     fprintf(file, "}\n");
 }
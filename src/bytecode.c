@@ -4,9 +4,11 @@
 
 #include "../includes/bytecode.h"
 #include "../includes/memory.h"
+#include "../includes/string.h"
+#include "../includes/interner.h"
 
-Constants* constants_new() {
-    Constants* contants = malloc(sizeof(Constants));
+Constants* constants_new(const Ruja_Allocator* allocator) {
+    Constants* contants = ruja_alloc(allocator, sizeof(Constants));
     if (contants == NULL) {
         fprintf(stderr, "Could not allocate memory for contants\n");
         return NULL;
@@ -19,39 +21,49 @@ Constants* constants_new() {
     return contants;
 }
 
-void constants_free(Constants* constants) {
-    free(constants->items);
-    free(constants);
+void constants_free(const Ruja_Allocator* allocator, Constants* constants) {
+    ruja_free(allocator, constants->items);
+    ruja_free(allocator, constants);
 }
 
-Bytecode* bytecode_new() {
-    Bytecode* bytecode = malloc(sizeof(Bytecode));
+Bytecode* bytecode_new(const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Bytecode* bytecode = ruja_alloc(&owner, sizeof(Bytecode));
     if (bytecode == NULL) {
         fprintf(stderr, "Could not allocate memory for bytecode\n");
         return NULL;
     }
 
-    bytecode->constants = constants_new();
-    if (bytecode->constants == NULL) return NULL;
+    bytecode->constants = constants_new(&owner);
+    if (bytecode->constants == NULL) {
+        ruja_free(&owner, bytecode);
+        return NULL;
+    }
 
     bytecode->count = 0;
     bytecode->capacity = 0;
     bytecode->items = NULL;
     bytecode->lines = NULL;
+    bytecode->allocator = owner;
+    bytecode->out_of_memory = false;
 
     return bytecode;
 }
 
 void bytecode_free(Bytecode* bytecode) {
-    constants_free(bytecode->constants);
-    free(bytecode->items);
-    free(bytecode->lines);
-    free(bytecode);
+    Ruja_Allocator allocator = bytecode->allocator;
+    constants_free(&allocator, bytecode->constants);
+    ruja_free(&allocator, bytecode->items);
+    ruja_free(&allocator, bytecode->lines);
+    ruja_free(&allocator, bytecode);
 }
 
 size_t add_constant(Bytecode* bytecode, Word word) {
     if (bytecode->constants->count >= bytecode->constants->capacity) {
-        REALLOC_DA(Word, bytecode->constants);
+        if (!REALLOC_DA_WITH(&bytecode->allocator, Word, bytecode->constants)) {
+            bytecode->out_of_memory = true;
+            return 0;
+        }
     }
 
     bytecode->constants->items[bytecode->constants->count++] = word;
@@ -59,114 +71,118 @@ size_t add_constant(Bytecode* bytecode, Word word) {
     return bytecode->constants->count-1;
 }
 
-void add_opcode(Bytecode* bytecode, uint8_t byte, size_t line) {
-    if (bytecode->count >= bytecode->capacity) {
-        REALLOC_DA(uint8_t, bytecode);
-        bytecode->lines = realloc(bytecode->lines, sizeof(size_t) * bytecode->capacity);
+/**
+ * @brief Makes room for size more bytes of code and their lines.
+ *
+ * @return false If memory ran out. The bytecode is marked out_of_memory.
+ */
+static bool reserve_code(Bytecode* bytecode, size_t size) {
+    while (bytecode->count + size > bytecode->capacity) {
+        size_t capacity = bytecode->capacity;
+        if (!REALLOC_DA_WITH(&bytecode->allocator, uint8_t, bytecode)) {
+            bytecode->out_of_memory = true;
+            return false;
+        }
+
+        size_t* lines = ruja_realloc(&bytecode->allocator, bytecode->lines, sizeof(size_t) * bytecode->capacity);
+        if (lines == NULL) {
+            // The code has room to spare, only the lines bound the capacity
+            fprintf(stderr, "Out of memory. Could not allocate the lines of %zu bytes of code\n", bytecode->capacity);
+            bytecode->capacity = capacity;
+            bytecode->out_of_memory = true;
+            return false;
+        }
+        bytecode->lines = lines;
     }
 
+    return true;
+}
+
+void add_opcode(Bytecode* bytecode, uint8_t byte, size_t line) {
+    if (!reserve_code(bytecode, 1)) return;
+
     bytecode->items[bytecode->count] = byte;
     bytecode->lines[bytecode->count++] = line;
 }
 
-void add_operand(Bytecode* bytecode, size_t bytes, size_t line) {
-    if (bytecode->count + 4 >= bytecode->capacity) {
-        REALLOC_DA(uint8_t, bytecode);
-        bytecode->lines = realloc(bytecode->lines, sizeof(size_t) * bytecode->capacity);
+const Opcode_Info opcode_infos[OPCODE_COUNT] = {
+#define X(name, width0, width1) [OP_##name] = {#name, {width0, width1}},
+    RUJA_OPCODES(X)
+#undef X
+};
+
+size_t add_instruction(Bytecode* bytecode, Opcode opcode, uint32_t operand0, uint32_t operand1, size_t line) {
+    size_t offset = bytecode->count;
+    // An instruction is never left half written, patch_operand may rewrite it
+    if (!reserve_code(bytecode, instruction_size(opcode))) return offset;
+    add_opcode(bytecode, opcode, line);
+
+    uint32_t operands[2] = {operand0, operand1};
+    for (size_t i = 0; i < 2; i++) {
+        size_t width = opcode_infos[opcode].widths[i];
+        if (width == 0) break;
+        // The compiler checks its limits, a value that does not fit is a bug
+        assert(width == 4 || operands[i] < (1u << (8 * width)));
+
+        write_operand(&bytecode->items[bytecode->count], width, operands[i]);
+        for (size_t j = 0; j < width; j++) {
+            bytecode->lines[bytecode->count++] = line;
+        }
     }
 
-    bytecode->items[bytecode->count] = (bytes >> 24) & 0xFF;
-    bytecode->items[bytecode->count+1] = (bytes >> 16) & 0xFF;
-    bytecode->items[bytecode->count+2] = (bytes >> 8) & 0xFF;
-    bytecode->items[bytecode->count+3] = bytes & 0xFF;
-    bytecode->lines[bytecode->count] = line;
-    bytecode->lines[bytecode->count+1] = line;
-    bytecode->lines[bytecode->count+2] = line;
-    bytecode->lines[bytecode->count+3] = line;
-    bytecode->count += 4;
+    return offset;
 }
 
-void print_operand(Bytecode* bytecode, size_t index, int format) {
-    size_t operand = (bytecode->items[index] << 24) | (bytecode->items[index+1] << 16) | (bytecode->items[index+2] << 8) | bytecode->items[index+3];
-    printf("%*ld", format, operand);
+void patch_operand(Bytecode* bytecode, size_t offset, size_t i, uint32_t operand) {
+    if (offset >= bytecode->count) return; // Never appended, memory ran out
+    Opcode opcode = bytecode->items[offset];
+    size_t at = offset + 1 + (i == 0 ? 0 : opcode_infos[opcode].widths[0]);
+    write_operand(&bytecode->items[at], opcode_infos[opcode].widths[i], operand);
 }
 
 /**
  * @brief Disassembles a bytecode intruction into a human readable format
- * 
+ *
  * @param bytecode The bytecode to disassemble
- * @param index The index of the instruction to disassemble
+ * @param index The index of the instruction to disassemble, moved to its last byte
  */
 static void disassemble_instruction(Bytecode* bytecode, size_t* index) {
     Opcode opcode = bytecode->items[*index];
+    if (opcode >= OPCODE_COUNT) {
+        printf("%14s |%20s |", "Unknown", "-----");
+        return;
+    }
+
+    const Opcode_Info* info = &opcode_infos[opcode];
+    printf("%14s |", info->name);
+
+    uint8_t* operands = &bytecode->items[*index + 1];
+    uint32_t operand0 = info->widths[0] > 0 ? read_operand(operands, info->widths[0]) : 0;
+    uint32_t operand1 = info->widths[1] > 0 ? read_operand(operands + info->widths[0], info->widths[1]) : 0;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
     switch (opcode) {
-        default         : printf("%14s |%20s |", "Unknown", "-----"); break;
-        case OP_HALT    : printf("%14s |%20s |", "HALT", "-----"); break;
-        case OP_NIL     : printf("%14s |%20s |", "NIL", "-----"); break;
-        case OP_TRUE    : printf("%14s |%20s |", "TRUE", "-----"); break;
-        case OP_FALSE   : printf("%14s |%20s |", "FALSE", "-----"); break;
-        case OP_NEG     : printf("%14s |%20s |", "NEG", "-----"); break;
-        case OP_NOT     : printf("%14s |%20s |", "NOT", "-----"); break;
-        case OP_ADD     : printf("%14s |%20s |", "ADD", "-----"); break;
-        case OP_SUB     : printf("%14s |%20s |", "SUB", "-----"); break;
-        case OP_MUL     : printf("%14s |%20s |", "MUL", "-----"); break;
-        case OP_DIV     : printf("%14s |%20s |", "DIV", "-----"); break;
-        case OP_EQ      : printf("%14s |%20s |", "EQ", "-----"); break;
-        case OP_NEQ     : printf("%14s |%20s |", "NEQ", "-----"); break;
-        case OP_LT      : printf("%14s |%20s |", "LT", "-----"); break;
-        case OP_LTE     : printf("%14s |%20s |", "LTE", "-----"); break;
-        case OP_GT      : printf("%14s |%20s |", "GT", "-----"); break;
-        case OP_GTE     : printf("%14s |%20s |", "GTE", "-----"); break;
-        case OP_AND     : printf("%14s |%20s |", "AND", "-----"); break;
-        case OP_OR      : printf("%14s |%20s |", "OR", "-----"); break;
-        case OP_JUMP    : {
-            printf("%14s |", "JUMP");
-            print_operand(bytecode, ++(*index), 20); *index += 3;
-            printf(" |");
-        } break;
-        case OP_JZ      : {
-            printf("%14s |", "JZ");
-            print_operand(bytecode, ++(*index), 20); *index += 3;
-            printf(" |");
-        } break;
-        case OP_CONST: {
-            // printf("%20s |%20lf |", "CONST", bytecode->items[bytecode->items[++(*index)]]); break;
-            printf("%14s |", "CONST");
-            size_t constant_index = (bytecode->items[*index+1] << 24) |
-                                    (bytecode->items[*index+2] << 16) | 
-                                    (bytecode->items[*index+3] <<  8) | 
-                                    bytecode->items[*index+4];
-            print_word(stdout, bytecode->constants->items[constant_index], 20); *index += 4;
-            printf(" |");
+        case OP_CONST:
+        case OP_CONST8: print_word(stdout, bytecode->constants->items[operand0], 20); break;
+        case OP_PUSH_I8: printf("%20d", (int8_t) operand0); break;
+        case OP_PUSH_I32: printf("%20"PRId32, (int32_t) operand0); break;
+        case OP_ADD_LOCAL_CONST:
+        case OP_ADD_GLOBAL_CONST: printf("%9"PRIu32", %9"PRId32, operand0, (int32_t) operand1); break;
+        default: {
+            if (info->widths[1] > 0) printf("%9"PRIu32", %9"PRIu32, operand0, operand1);
+            else if (info->widths[0] > 0) printf("%20"PRIu32, operand0);
+            else printf("%20s", "-----");
         } break;
     }
+#pragma GCC diagnostic pop
+    printf(" |");
+
+    *index += info->widths[0] + info->widths[1];
 }
 
 const char* opcode_to_string(Opcode opcode) {
-    switch (opcode) {
-        default         : return "Unknown";
-        case OP_HALT    : return "HALT";
-        case OP_NIL     : return "NIL";
-        case OP_TRUE    : return "TRUE";
-        case OP_FALSE   : return "FALSE";
-        case OP_NEG     : return "NEG";
-        case OP_NOT     : return "NOT";
-        case OP_ADD     : return "ADD";
-        case OP_SUB     : return "SUB";
-        case OP_MUL     : return "MUL";
-        case OP_DIV     : return "DIV";
-        case OP_EQ      : return "EQ";
-        case OP_NEQ     : return "NEQ";
-        case OP_LTE     : return "LTE";
-        case OP_LT      : return "LT";
-        case OP_GT      : return "GT";
-        case OP_GTE     : return "GTE";
-        case OP_AND     : return "AND";
-        case OP_OR      : return "OR";
-        case OP_JUMP    : return "JUMP";
-        case OP_JZ      : return "JZ";
-        case OP_CONST   : return "CONST";
-    }
+    return opcode < OPCODE_COUNT ? opcode_infos[opcode].name : "Unknown";
 }
 
 void disassemble(Bytecode* bytecode, const char* name) {
@@ -181,14 +197,227 @@ void disassemble(Bytecode* bytecode, const char* name) {
     }
 }
 
-void save_bytecode(Bytecode* bytecode, const char* filename) {
-    UNUSED(bytecode);
-    UNUSED(filename);
-    NOT_IMPLEMENTED("save_bytecode", __FILE__, __LINE__);
+#define BYTECODE_MAGIC "RUJA"
+#define BYTECODE_VERSION 2
+
+enum {
+    CONSTANT_WORD,
+    CONSTANT_STRING,
+};
+
+static bool host_is_little_endian(void) {
+    uint16_t probe = 1;
+    uint8_t first;
+    memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+static bool write_u64(FILE* file, uint64_t value) {
+    return fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool read_u64(FILE* file, uint64_t* value) {
+    return fread(value, sizeof(*value), 1, file) == 1;
+}
+
+bool save_bytecode(Bytecode* bytecode, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file '%s' for writing\n", filename);
+        return false;
+    }
+
+    // Operands are in native byte order, the header records which one
+    uint8_t header[6] = {'R', 'U', 'J', 'A', BYTECODE_VERSION, host_is_little_endian()};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+    ok = ok && write_u64(file, bytecode->count);
+    ok = ok && fwrite(bytecode->items, 1, bytecode->count, file) == bytecode->count;
+    for (size_t i = 0; ok && i < bytecode->count; i++) {
+        ok = write_u64(file, bytecode->lines[i]);
+    }
+
+    Constants* constants = bytecode->constants;
+    ok = ok && write_u64(file, constants->count);
+    for (size_t i = 0; ok && i < constants->count; i++) {
+        Word word = constants->items[i];
+        if (IS_STRING(word)) {
+            ObjString* string = AS_STRING(word);
+            uint8_t tag = CONSTANT_STRING;
+            ok = fwrite(&tag, 1, 1, file) == 1 && write_u64(file, string->length);
+            ok = ok && fwrite(string->chars, 1, string->length, file) == string->length;
+        } else if (IS_OBJECT(word)) {
+            fprintf(stderr, "Could not save constant %zu of '%s': only strings can be saved\n", i, filename);
+            ok = false;
+        } else {
+            uint8_t tag = CONSTANT_WORD;
+            ok = fwrite(&tag, 1, 1, file) == 1 && write_u64(file, word);
+        }
+    }
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Could not write bytecode to '%s'\n", filename);
+    return ok;
+}
+
+/**
+ * @brief Reads the target of a jump, loop or range instruction at start into target,
+ *      SIZE_MAX if it jumps before the code.
+ *
+ * @return false If the instruction does not jump.
+ */
+static bool jump_target(Bytecode* bytecode, size_t start, size_t* target) {
+    Opcode opcode = bytecode->items[start];
+    const uint8_t* operands = &bytecode->items[start + 1];
+    const uint8_t* widths = opcode_infos[opcode].widths;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (opcode) {
+        case OP_JUMP:
+        case OP_JZ: *target = start + read_operand(operands, widths[0]); return true;
+        case OP_FOR_PREP: *target = start + read_operand(operands + widths[0], widths[1]); return true;
+        case OP_LOOP:
+        case OP_FOR_RANGE: {
+            size_t back = opcode == OP_LOOP ? read_operand(operands, widths[0]) : read_operand(operands + widths[0], widths[1]);
+            *target = back <= start ? start - back : SIZE_MAX;
+            return true;
+        }
+        default: return false;
+    }
+#pragma GCC diagnostic pop
 }
 
-Bytecode* load_bytecode(const char* filename) {
-    UNUSED(filename);
-    NOT_IMPLEMENTED("load_bytecode", __FILE__, __LINE__);
+/**
+ * @brief Checks that every instruction is known, fits in the code and only refers to
+ *      existing constants, that the code ends with an instruction boundary after a HALT or
+ *      a jump, and that every jump lands on the start of an instruction. starts holds a
+ *      flag per byte of the code.
+ */
+static bool verify_bytecode(Bytecode* bytecode, bool* starts) {
+    memset(starts, 0, sizeof(bool) * bytecode->count);
+
+    size_t i = 0;
+    Opcode last = OP_NIL;
+    while (i < bytecode->count) {
+        Opcode opcode = bytecode->items[i];
+        if (opcode >= OPCODE_COUNT || i + instruction_size(opcode) > bytecode->count) return false;
+
+        if (opcode == OP_CONST || opcode == OP_CONST8) {
+            uint32_t index = read_operand(&bytecode->items[i + 1], opcode_infos[opcode].widths[0]);
+            if (index >= bytecode->constants->count) return false;
+        }
+
+        starts[i] = true;
+        last = opcode;
+        i += instruction_size(opcode);
+    }
+    // The vm never runs off the end of the code
+    if (last != OP_HALT && last != OP_JUMP && last != OP_LOOP) return false;
+
+    // The targets are checked once every start is known, forward jumps land after the jump
+    for (i = 0; i < bytecode->count; i += instruction_size(bytecode->items[i])) {
+        size_t target;
+        if (jump_target(bytecode, i, &target) && (target >= bytecode->count || !starts[target])) return false;
+    }
+
+    return true;
+}
+
+Bytecode* load_bytecode(const char* filename, const Ruja_Allocator* allocator) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n", filename);
+        return NULL;
+    }
+
+    Bytecode* bytecode = bytecode_new(allocator);
+    if (bytecode == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint8_t header[6];
+    bool ok = fread(header, sizeof(header), 1, file) == 1;
+    if (!ok || memcmp(header, BYTECODE_MAGIC, 4) != 0 || header[4] != BYTECODE_VERSION) {
+        fprintf(stderr, "'%s' is not Ruja bytecode of version %d\n", filename, BYTECODE_VERSION);
+        goto error;
+    }
+    if (header[5] != host_is_little_endian()) {
+        fprintf(stderr, "'%s' was saved on a machine of a different byte order\n", filename);
+        goto error;
+    }
+
+    uint64_t count;
+    if (!read_u64(file, &count)) goto invalid;
+    bytecode->items = count <= SIZE_MAX / sizeof(size_t) ? ruja_alloc(&bytecode->allocator, count > 0 ? count : 1) : NULL;
+    bytecode->lines = bytecode->items != NULL ? ruja_alloc(&bytecode->allocator, sizeof(size_t) * (count > 0 ? count : 1)) : NULL;
+    if (bytecode->items == NULL || bytecode->lines == NULL) {
+        fprintf(stderr, "Could not allocate memory for bytecode\n");
+        goto error;
+    }
+    bytecode->capacity = count;
+    if (fread(bytecode->items, 1, count, file) != count) goto invalid;
+    bytecode->count = count;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t line;
+        if (!read_u64(file, &line)) goto invalid;
+        bytecode->lines[i] = line;
+    }
+
+    uint64_t n_constants;
+    if (!read_u64(file, &n_constants)) goto invalid;
+    for (uint64_t i = 0; i < n_constants; i++) {
+        uint8_t tag;
+        uint64_t value;
+        if (fread(&tag, 1, 1, file) != 1 || !read_u64(file, &value)) goto invalid;
+
+        if (tag == CONSTANT_WORD) {
+            // Pointers are never saved as words
+            if (IS_OBJECT(value) || (IS_SSTR(value) && SSTR_LENGTH(value) > SSTR_MAX)) goto invalid;
+            add_constant(bytecode, value);
+            if (bytecode->out_of_memory) goto error;
+        } else if (tag == CONSTANT_STRING) {
+            char* chars = value < SIZE_MAX ? ruja_alloc(&bytecode->allocator, value > 0 ? value : 1) : NULL;
+            if (chars == NULL) {
+                fprintf(stderr, "Could not allocate memory for a string constant\n");
+                goto error;
+            }
+            if (fread(chars, 1, value, file) != value) {
+                ruja_free(&bytecode->allocator, chars);
+                goto invalid;
+            }
+            if (value <= SSTR_MAX) {
+                add_constant(bytecode, make_sstr(chars, value));
+                ruja_free(&bytecode->allocator, chars);
+                if (bytecode->out_of_memory) goto error;
+                continue;
+            }
+            ObjString* string = interner_intern(interner_global(), chars, value);
+            ruja_free(&bytecode->allocator, chars);
+            if (string == NULL) goto error;
+            add_constant(bytecode, MAKE_OBJECT(string));
+            if (bytecode->out_of_memory) goto error;
+        } else {
+            goto invalid;
+        }
+    }
+
+    bool* starts = ruja_alloc(&bytecode->allocator, sizeof(bool) * (count > 0 ? count : 1));
+    if (starts == NULL) {
+        fprintf(stderr, "Could not allocate memory for bytecode\n");
+        goto error;
+    }
+    bool valid = verify_bytecode(bytecode, starts);
+    ruja_free(&bytecode->allocator, starts);
+    if (!valid) goto invalid;
+
+    fclose(file);
+    return bytecode;
+
+invalid:
+    fprintf(stderr, "'%s' is truncated or corrupted\n", filename);
+error:
+    fclose(file);
+    bytecode_free(bytecode);
     return NULL;
 }
@@ -5,23 +5,65 @@
 #include "../includes/objects.h"
 #include "../includes/parser.h"
 #include "../includes/lexer.h"
+#include "../includes/interner.h"
+#include "../includes/memory.h"
 
 
-Ruja_Compiler* compiler_new() {
-    Ruja_Compiler* compiler = malloc(sizeof(Ruja_Compiler));
+Ruja_Compiler* compiler_new(const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Compiler* compiler = ruja_alloc(&owner, sizeof(Ruja_Compiler));
     if (compiler == NULL) {
         fprintf(stderr, "Could not allocate memory for compiler\n");
         return NULL;
     }
 
-    compiler->ast = ast_new_expression(NULL);
+    compiler->allocator = owner;
+    compiler->out_of_memory = false;
+    compiler->ast = NULL;
+    compiler->source = NULL;
+    compiler->scopes = NULL;
+    compiler->n_locals = 0;
+    compiler->n_globals = 0;
 
     return compiler;
 }
 
 void compiler_free(Ruja_Compiler *compiler) {
-    ast_free(compiler->ast);
-    free(compiler);
+    if (compiler->scopes != NULL) symbol_table_free(compiler->scopes);
+    Ruja_Allocator allocator = compiler->allocator;
+    ruja_free(&allocator, compiler);
+}
+
+static void compiler_error(Ruja_Compiler* compiler, Ruja_Token* token, const char* msg) {
+    fprintf(stderr, "%s:%" PRIu64 ": " RED "compile error" RESET " %s '%.*s'.\n", compiler->source, token->line, msg, (int)token->length, token->start);
+}
+
+/**
+ * @brief Emits the push of a constant, with a 1 byte index when the pool is still small.
+ */
+static void emit_constant(Bytecode* bytecode, Word word, size_t line) {
+    size_t index = add_constant(bytecode, word);
+    if (index <= UINT8_MAX) {
+        add_instruction(bytecode, OP_CONST8, (uint32_t) index, 0, line);
+    } else {
+        add_instruction(bytecode, OP_CONST, (uint32_t) index, 0, line);
+    }
+}
+
+/**
+ * @brief Emits the push of an integer with the smallest encoding, the value is carried
+ *      in the instruction.
+ */
+static void emit_int(Bytecode* bytecode, int32_t value, size_t line) {
+    if (value == 0) {
+        add_opcode(bytecode, OP_PUSH_ZERO, line);
+    } else if (value == 1) {
+        add_opcode(bytecode, OP_PUSH_ONE, line);
+    } else if (value >= INT8_MIN && value <= INT8_MAX) {
+        add_instruction(bytecode, OP_PUSH_I8, (uint8_t) (int8_t) value, 0, line);
+    } else {
+        add_instruction(bytecode, OP_PUSH_I32, (uint32_t) value, 0, line);
+    }
 }
 
 static void push_word(Ruja_Vm* vm, Ruja_Token* token) {
@@ -31,29 +73,17 @@ static void push_word(Ruja_Vm* vm, Ruja_Token* token) {
         case RUJA_TOK_NIL: add_opcode(vm->bytecode, OP_NIL, token->line); break;
         case RUJA_TOK_FALSE: add_opcode(vm->bytecode, OP_FALSE, token->line); break;
         case RUJA_TOK_TRUE: add_opcode(vm->bytecode, OP_TRUE, token->line); break;
-        case RUJA_TOK_INT: {
-            Word word = MAKE_INT(strtod(token->start, NULL));
-            size_t index = add_constant(vm->bytecode, word);
-            add_opcode(vm->bytecode, OP_CONST, token->line);
-            add_operand(vm->bytecode, index, token->line);
-        } break;
-        case RUJA_TOK_FLOAT: {
-            Word word = MAKE_DOUBLE(strtod(token->start, NULL));
-            size_t index = add_constant(vm->bytecode, word);
-            add_opcode(vm->bytecode, OP_CONST, token->line);
-            add_operand(vm->bytecode, index, token->line);
-        } break;
-        case RUJA_TOK_CHAR: {
-            Word word = MAKE_CHAR(*(token->start));
-            size_t index = add_constant(vm->bytecode, word);
-            add_opcode(vm->bytecode, OP_CONST, token->line);
-            add_operand(vm->bytecode, index, token->line);
-        } break;
+        case RUJA_TOK_INT: emit_int(vm->bytecode, token->as.i32, token->line); break;
+        case RUJA_TOK_FLOAT: emit_constant(vm->bytecode, MAKE_DOUBLE(token->as.f64), token->line); break;
+        case RUJA_TOK_CHAR: emit_constant(vm->bytecode, MAKE_CHAR(*(token->start)), token->line); break;
         case RUJA_TOK_STRING: {
-            Word word = MAKE_OBJECT(vm_allocate_object(vm, OBJ_STRING, token->start, token->length));
-            size_t index = add_constant(vm->bytecode, word);
-            add_opcode(vm->bytecode, OP_CONST, token->line);
-            add_operand(vm->bytecode, index, token->line);
+            if (token->length <= SSTR_MAX) {
+                emit_constant(vm->bytecode, make_sstr(token->start, token->length), token->line);
+                break;
+            }
+            // String constants are interned: duplicate literals share one object that outlives the vm
+            ObjString* string = token->interned != NULL ? token->interned : interner_intern(interner_global(), token->start, token->length);
+            emit_constant(vm->bytecode, MAKE_OBJECT(string), token->line);
         } break;
         default: {
             fprintf(stderr, "Unknown token kind: %d (%s)\n", token->kind, token->start);
@@ -62,93 +92,544 @@ static void push_word(Ruja_Vm* vm, Ruja_Token* token) {
 #pragma GCC diagnostic pop
 }
 
-static Ruja_Compile_Error compile_internal(Ruja_Ast ast, Ruja_Vm* vm) {
+/**
+ * @brief Pushes the zero value of a type, the value of variables declared without one.
+ */
+static void push_default(Ruja_Vm* vm, Ruja_Token* tok_dtype) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
     Bytecode* bytecode = vm->bytecode;
-    switch (ast->type) {
-        case AST_NODE_EMPTY: {
-            fprintf(stderr, "Empty AST\n");
-            return RUJA_COMPILER_ERROR;
-        }
-        case AST_NODE_LITERAL: {
-            push_word(vm, ast->as.literal.tok_literal);
-        } break;
-        case AST_NODE_UNARY_OP: {
-            Ruja_Compile_Error error = compile_internal(ast->as.unary_op.expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
-            Ruja_Token* tok_unary = ast->as.unary_op.tok_unary;
+    switch (tok_dtype->kind) {
+        case RUJA_TOK_TYPE_BOOL: add_opcode(bytecode, OP_FALSE, tok_dtype->line); break;
+        case RUJA_TOK_TYPE_CHAR: emit_constant(bytecode, MAKE_CHAR('\0'), tok_dtype->line); break;
+        case RUJA_TOK_TYPE_I32: emit_int(bytecode, 0, tok_dtype->line); break;
+        case RUJA_TOK_TYPE_F64: emit_constant(bytecode, MAKE_DOUBLE(0.0), tok_dtype->line); break;
+        case RUJA_TOK_TYPE_STRING: emit_constant(bytecode, make_sstr("", 0), tok_dtype->line); break;
+        default: add_opcode(bytecode, OP_NIL, tok_dtype->line); break;
+    }
+#pragma GCC diagnostic pop
+}
+
+/**
+ * @brief Returns the variable an identifier refers to, NULL (after reporting it) if there is none.
+ */
+static Symbol* resolve(Ruja_Compiler* compiler, Ruja_Token* identifier) {
+    Symbol* symbol = identifier->interned != NULL ? symbol_table_lookup(compiler->scopes, identifier->interned) : NULL;
+    if (symbol == NULL) compiler_error(compiler, identifier, "Undeclared variable");
+    return symbol;
+}
+
+/**
+ * @brief Declares a variable whose initial value was just pushed. A global pops it into its
+ *      slot, a local takes the stack slot the value is already in.
+ */
+static bool declare(Ruja_Compiler* compiler, Ruja_Token* identifier, Type type, Ruja_Vm* vm) {
+    if (identifier->interned == NULL) {
+        compiler_error(compiler, identifier, "Invalid variable name");
+        return false;
+    }
+    if (symbol_table_depth(compiler->scopes) > 0 && compiler->n_locals >= MAX_LOCALS) {
+        compiler_error(compiler, identifier, "Too many local variables");
+        return false;
+    }
+
+    // The parser already did the typing, the type is kept for infer_type
+    Symbol* symbol = symbol_new_var(&compiler->allocator, type, identifier->interned);
+    if (symbol == NULL || symbol_table_declare(compiler->scopes, symbol) == SYMBOL_ERROR) {
+        symbol_free(&compiler->allocator, symbol);
+        compiler->out_of_memory = true;
+        return false;
+    }
+
+    if (symbol->depth == 0) {
+        symbol->as.var.slot = compiler->n_globals++;
+        add_instruction(vm->bytecode, OP_SET_GLOBAL, (uint32_t) symbol->as.var.slot, 0, identifier->line);
+    } else {
+        symbol->as.var.slot = compiler->n_locals++;
+    }
+
+    return true;
+}
+
+static void emit_get(Bytecode* bytecode, Symbol* symbol, size_t line) {
+    add_instruction(bytecode, symbol->depth == 0 ? OP_GET_GLOBAL : OP_GET_LOCAL, (uint32_t) symbol->as.var.slot, 0, line);
+}
+
+static void emit_set(Bytecode* bytecode, Symbol* symbol, size_t line) {
+    add_instruction(bytecode, symbol->depth == 0 ? OP_SET_GLOBAL : OP_SET_LOCAL, (uint32_t) symbol->as.var.slot, 0, line);
+}
+
+/**
+ * @brief Enters a scope. Returns the number of locals alive before it, to give to end_scope.
+ */
+static size_t begin_scope(Ruja_Compiler* compiler) {
+    if (!symbol_table_enter_scope(compiler->scopes)) compiler->out_of_memory = true;
+    return compiler->n_locals;
+}
+
+/**
+ * @brief Leaves the innermost scope and pops the locals declared in it.
+ */
+static void end_scope(Ruja_Compiler* compiler, Bytecode* bytecode, size_t locals, size_t line) {
+    symbol_table_exit_scope(compiler->scopes);
+    if (compiler->n_locals > locals) {
+        add_instruction(bytecode, OP_POP, (uint32_t) (compiler->n_locals - locals), 0, line);
+    }
+    compiler->n_locals = locals;
+}
+
+/**
+ * @brief Emits an OP_LOOP back to the instruction at target.
+ */
+static void emit_loop(Bytecode* bytecode, size_t target, size_t line) {
+    add_instruction(bytecode, OP_LOOP, (uint32_t) (bytecode->count - target), 0, line);
+}
+
+/**
+ * @brief Returns the operator of a compound assignment ('+=', ...), OP_HALT for a plain '='.
+ */
+static Opcode compound_operator(Ruja_Token* tok_assign) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (tok_assign->kind) {
+        case RUJA_TOK_ADD_EQ: return OP_ADD;
+        case RUJA_TOK_SUB_EQ: return OP_SUB;
+        case RUJA_TOK_MUL_EQ: return OP_MUL;
+        case RUJA_TOK_DIV_EQ: return OP_DIV;
+        case RUJA_TOK_PERCENT_EQ: return OP_MOD;
+        default:              return OP_HALT;
+    }
+#pragma GCC diagnostic pop
+}
+
+/**
+ * @brief Whether an expression is an integer literal, whose value is stored in value.
+ */
+static bool int_literal(Ruja_Ast expression, int32_t* value) {
+    if (expression != NULL && expression->type == AST_NODE_EXPRESSION) expression = expression->as.expr.expression;
+    if (expression == NULL || expression->type != AST_NODE_LITERAL) return false;
+
+    Ruja_Token* tok_literal = expression->as.literal.tok_literal;
+    if (tok_literal->kind != RUJA_TOK_INT) return false;
+
+    *value = tok_literal->as.i32;
+    return true;
+}
+
+/**
+ * @brief Emits '+=' and '-=' of an integer literal as a single in place update of the variable.
+ *
+ * @return false If the assignment is not of that form, nothing is emitted then.
+ */
+static bool emit_add_const(Bytecode* bytecode, Symbol* symbol, Ruja_Token* tok_assign, Ruja_Ast expression) {
+    int32_t k;
+    if (tok_assign->kind != RUJA_TOK_ADD_EQ && tok_assign->kind != RUJA_TOK_SUB_EQ) return false;
+    if (!int_literal(expression, &k)) return false;
+    if (tok_assign->kind == RUJA_TOK_SUB_EQ) {
+        if (k == INT32_MIN) return false;
+        k = -k;
+    }
+
+    bool local = symbol->depth != 0;
+    if (k == 1) {
+        add_instruction(bytecode, local ? OP_INC_LOCAL : OP_INC_GLOBAL, (uint32_t) symbol->as.var.slot, 0, tok_assign->line);
+    } else {
+        add_instruction(bytecode, local ? OP_ADD_LOCAL_CONST : OP_ADD_GLOBAL_CONST, (uint32_t) symbol->as.var.slot, (uint32_t) k, tok_assign->line);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Points the jump operand i of the instruction at offset to the next instruction emitted.
+ */
+static void patch_jump(Bytecode* bytecode, size_t offset, size_t i) {
+    patch_operand(bytecode, offset, i, (uint32_t) (bytecode->count - offset));
+}
+
+// A node whose code is being emitted. stage counts the children already compiled.
+typedef struct {
+    Ruja_Ast ast;
+    size_t stage;
+    size_t jump_false; // Offset of the OP_JZ of a ternary or a branch, of the OP_FOR_PREP of a for
+    size_t jump;       // Offset of the OP_JUMP of a ternary or a branch, start of a while
+    Symbol* target;    // Variable assigned by an assignment
+    size_t locals;     // Locals alive before the scope of a body, see begin_scope
+    size_t concat;     // Strings joined by the OP_CONCAT_N of a '+' chain rooted at this node
+    bool fused;        // Inner '+' of such a chain, it only compiles its operands
+} Compile_Frame;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Compile_Frame* items;
+    Ruja_Compiler* compiler; // Its allocator grows the stack
+} Compile_Stack;
+
+static bool is_add(Ruja_Ast ast) {
+    return ast->type == AST_NODE_BINARY_OP && ast->as.binary_op.tok_binary->kind == RUJA_TOK_ADD;
+}
+
+/**
+ * @brief Counts the operands of the chain of '+' along the left spine of node, a '+' itself:
+ *      a + b + c is (a + b) + c and has 3. A chain longer than an OP_CONCAT_N can take is
+ *      not counted, the '+' nearer to its bottom are fused instead.
+ */
+static size_t concat_operands(Ruja_Ast node) {
+    size_t count = 1;
+    while (is_add(node)) {
+        if (++count > UINT8_MAX) return 0;
+        node = node->as.binary_op.left_expression;
+    }
+    return count;
+}
+
+static void compile_push(Compile_Stack* stack, Ruja_Ast ast) {
+    if (ast == NULL) return; // Empty bodies and lists
+    if (stack->count == stack->capacity && !REALLOC_DA_WITH(&stack->compiler->allocator, Compile_Frame, stack)) {
+        stack->compiler->out_of_memory = true;
+        return;
+    }
+    stack->items[stack->count++] = (Compile_Frame) {.ast = ast, .stage = 0};
+}
+
+/**
+ * @brief Emits the code of an AST. Children are scheduled on an explicit stack instead of
+ *      compiled recursively, so deeply nested expressions do not overflow the C stack.
+ *
+ * @param compiler The compiler in use, it resolves the variables
+ * @param ast The AST to compile
+ * @param vm The vm that owns the bytecode
+ * @return Ruja_Compile_Error RUJA_COMPILER_OK on success
+ */
+static Ruja_Compile_Error compile_internal(Ruja_Compiler* compiler, Ruja_Ast ast, Ruja_Vm* vm) {
+    Bytecode* bytecode = vm->bytecode;
+    Ruja_Compile_Error error = RUJA_COMPILER_OK;
+
+    Compile_Stack stack = {.compiler = compiler};
+    compile_push(&stack, ast);
+
+    while (stack.count > 0 && error == RUJA_COMPILER_OK && !compiler->out_of_memory && !bytecode->out_of_memory) {
+        Compile_Frame* frame = &stack.items[stack.count - 1];
+        Ruja_Ast node = frame->ast;
+        size_t stage = frame->stage++;
+
+        switch (node->type) {
+            case AST_NODE_EMPTY: {
+                fprintf(stderr, "Empty AST\n");
+                error = RUJA_COMPILER_ERROR;
+            } break;
+            case AST_NODE_LITERAL: {
+                push_word(vm, node->as.literal.tok_literal);
+                stack.count--;
+            } break;
+            case AST_NODE_IDENTIFIER: {
+                Ruja_Token* tok_identifier = node->as.identifier.tok_identifier;
+                Symbol* symbol = resolve(compiler, tok_identifier);
+                if (symbol == NULL) {
+                    error = RUJA_COMPILER_ERROR;
+                    break;
+                }
+
+                emit_get(bytecode, symbol, tok_identifier->line);
+                stack.count--;
+            } break;
+            case AST_NODE_UNARY_OP: {
+                if (stage == 0) {
+                    compile_push(&stack, node->as.unary_op.expression);
+                    break;
+                }
 
+                Ruja_Token* tok_unary = node->as.unary_op.tok_unary;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch"
-            switch (tok_unary->kind) {
-                case RUJA_TOK_NOT: add_opcode(bytecode, OP_NOT, tok_unary->line); break;
-                case RUJA_TOK_SUB: add_opcode(bytecode, OP_NEG, tok_unary->line); break;
-            }
+                switch (tok_unary->kind) {
+                    case RUJA_TOK_NOT: add_opcode(bytecode, OP_NOT, tok_unary->line); break;
+                    case RUJA_TOK_SUB: add_opcode(bytecode, OP_NEG, tok_unary->line); break;
+                }
 #pragma GCC diagnostic pop
-        } break;
-        case AST_NODE_BINARY_OP: {
-            Ruja_Compile_Error error = compile_internal(ast->as.binary_op.left_expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
-
-            error = compile_internal(ast->as.binary_op.right_expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
-
-            Ruja_Token* tok_binary = ast->as.binary_op.tok_binary;
-
-            #pragma GCC diagnostic push
-            #pragma GCC diagnostic ignored "-Wswitch"
-            switch (tok_binary->kind) {
-                case RUJA_TOK_ADD : add_opcode(bytecode, OP_ADD, tok_binary->line); break;
-                case RUJA_TOK_SUB : add_opcode(bytecode, OP_SUB, tok_binary->line); break;
-                case RUJA_TOK_MUL : add_opcode(bytecode, OP_MUL, tok_binary->line); break;
-                case RUJA_TOK_DIV : add_opcode(bytecode, OP_DIV, tok_binary->line); break;
-                case RUJA_TOK_EQ  : add_opcode(bytecode, OP_EQ, tok_binary->line); break;
-                case RUJA_TOK_NE  : add_opcode(bytecode, OP_NEQ, tok_binary->line); break;
-                case RUJA_TOK_LT  : add_opcode(bytecode, OP_LT, tok_binary->line); break;
-                case RUJA_TOK_LE  : add_opcode(bytecode, OP_LTE, tok_binary->line); break;
-                case RUJA_TOK_GT  : add_opcode(bytecode, OP_GT, tok_binary->line); break;
-                case RUJA_TOK_GE  : add_opcode(bytecode, OP_GTE, tok_binary->line); break;
-                case RUJA_TOK_AND : add_opcode(bytecode, OP_AND, tok_binary->line); break;
-                case RUJA_TOK_OR  : add_opcode(bytecode, OP_OR, tok_binary->line); break;
-            }
-            #pragma GCC diagnostic pop
-        } break;
-        case AST_NODE_TERNARY_OP: {
-            Ruja_Compile_Error error = compile_internal(ast->as.ternary_op.condition, vm);
-            if (error != RUJA_COMPILER_OK) return error;
+                stack.count--;
+            } break;
+            case AST_NODE_BINARY_OP: {
+                Ruja_Ast left = node->as.binary_op.left_expression;
+                if (stage == 0) {
+                    if (!frame->fused && node->as.binary_op.tok_binary->kind == RUJA_TOK_ADD) {
+                        frame->concat = concat_operands(node);
+                        if (frame->concat < 3 || infer_type(node, compiler->scopes) != VAR_TYPE_STRING) frame->concat = 0;
+                    }
+                    bool fuse = (frame->fused || frame->concat > 0) && is_add(left);
+                    compile_push(&stack, left);
+                    stack.items[stack.count - 1].fused = fuse;
+                    break;
+                }
+                if (stage == 1) {
+                    compile_push(&stack, node->as.binary_op.right_expression);
+                    break;
+                }
 
-            add_opcode(bytecode, OP_JZ, ast->as.ternary_op.tok_ternary.tok_question->line);
-            size_t jmp_false = bytecode->count;
-            add_operand(bytecode, 0, ast->as.ternary_op.tok_ternary.tok_question->line);
+                Ruja_Token* tok_binary = node->as.binary_op.tok_binary;
+                if (frame->fused) {
+                    stack.count--;
+                    break;
+                }
+                if (frame->concat > 0) {
+                    add_instruction(bytecode, OP_CONCAT_N, (uint32_t) frame->concat, 0, tok_binary->line);
+                    stack.count--;
+                    break;
+                }
 
-            error = compile_internal(ast->as.ternary_op.true_expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
+                #pragma GCC diagnostic push
+                #pragma GCC diagnostic ignored "-Wswitch"
+                switch (tok_binary->kind) {
+                    case RUJA_TOK_ADD : add_opcode(bytecode, OP_ADD, tok_binary->line); break;
+                    case RUJA_TOK_SUB : add_opcode(bytecode, OP_SUB, tok_binary->line); break;
+                    case RUJA_TOK_MUL : add_opcode(bytecode, OP_MUL, tok_binary->line); break;
+                    case RUJA_TOK_DIV : add_opcode(bytecode, OP_DIV, tok_binary->line); break;
+                    case RUJA_TOK_PERCENT: add_opcode(bytecode, OP_MOD, tok_binary->line); break;
+                    case RUJA_TOK_EQ  : add_opcode(bytecode, OP_EQ, tok_binary->line); break;
+                    case RUJA_TOK_NE  : add_opcode(bytecode, OP_NEQ, tok_binary->line); break;
+                    case RUJA_TOK_LT  : add_opcode(bytecode, OP_LT, tok_binary->line); break;
+                    case RUJA_TOK_LE  : add_opcode(bytecode, OP_LTE, tok_binary->line); break;
+                    case RUJA_TOK_GT  : add_opcode(bytecode, OP_GT, tok_binary->line); break;
+                    case RUJA_TOK_GE  : add_opcode(bytecode, OP_GTE, tok_binary->line); break;
+                    case RUJA_TOK_AND : add_opcode(bytecode, OP_AND, tok_binary->line); break;
+                    case RUJA_TOK_OR  : add_opcode(bytecode, OP_OR, tok_binary->line); break;
+                }
+                #pragma GCC diagnostic pop
+                stack.count--;
+            } break;
+            case AST_NODE_TERNARY_OP: {
+                Ruja_Token* tok_question = node->as.ternary_op.tok_ternary.tok_question;
+                Ruja_Token* tok_colon = node->as.ternary_op.tok_ternary.tok_colon;
+                if (stage == 0) {
+                    compile_push(&stack, node->as.ternary_op.condition);
+                } else if (stage == 1) {
+                    frame->jump_false = add_instruction(bytecode, OP_JZ, 0, 0, tok_question->line);
 
-            add_opcode(bytecode, OP_JUMP, ast->as.ternary_op.tok_ternary.tok_colon->line);
-            size_t jmp = bytecode->count;
-            add_operand(bytecode, 0, ast->as.ternary_op.tok_ternary.tok_colon->line);
+                    compile_push(&stack, node->as.ternary_op.true_expression);
+                } else if (stage == 2) {
+                    frame->jump = add_instruction(bytecode, OP_JUMP, 0, 0, tok_colon->line);
+                    patch_jump(bytecode, frame->jump_false, 0);
 
-            size_t operand_offset = jmp - jmp_false + 5;
-            bytecode->items[jmp_false] = (uint8_t) ((operand_offset >> 24) & 0xFF);
-            bytecode->items[jmp_false + 1] = (uint8_t) ((operand_offset >> 16) & 0xFF);
-            bytecode->items[jmp_false + 2] = (uint8_t) ((operand_offset >> 8) & 0xFF);
-            bytecode->items[jmp_false + 3] = (uint8_t) (operand_offset & 0xFF);
+                    compile_push(&stack, node->as.ternary_op.false_expression);
+                } else {
+                    patch_jump(bytecode, frame->jump, 0);
+                    stack.count--;
+                }
+            } break;
+            case AST_NODE_EXPRESSION: {
+                if (stage == 0) {
+                    compile_push(&stack, node->as.expr.expression);
+                    break;
+                }
+                stack.count--;
+            } break;
+            case AST_NODE_STMTS: {
+                // The frame walks the list, it stays below the statement it schedules
+                Ruja_Ast statement = node->as.stmts.statement;
+                if (node->as.stmts.next != NULL) {
+                    frame->ast = node->as.stmts.next;
+                    frame->stage = 0;
+                } else {
+                    stack.count--;
+                }
+                compile_push(&stack, statement);
+            } break;
+            case AST_NODE_STMT_TYPED_DECL: {
+                push_default(vm, node->as.typed_decl.tok_dtype);
+                Type type = token_type(node->as.typed_decl.tok_dtype->kind);
+                if (!declare(compiler, node->as.typed_decl.identifier->as.identifier.tok_identifier, type, vm)) {
+                    error = RUJA_COMPILER_ERROR;
+                }
+                stack.count--;
+            } break;
+            case AST_NODE_STMT_TYPED_DECL_ASSIGN:
+            case AST_NODE_STMT_INFERRED_DECL_ASSIGN: {
+                bool typed = node->type == AST_NODE_STMT_TYPED_DECL_ASSIGN;
+                Ruja_Token* tok_assign = typed ? node->as.typed_decl_assign.tok_assign : node->as.inferred_decl_assign.tok_assign;
+                Ruja_Ast identifier = typed ? node->as.typed_decl_assign.identifier : node->as.inferred_decl_assign.identifier;
+                if (stage == 0) {
+                    if (compound_operator(tok_assign) != OP_HALT) {
+                        compiler_error(compiler, tok_assign, "Compound assignment in the declaration of a variable");
+                        error = RUJA_COMPILER_ERROR;
+                        break;
+                    }
 
-            error = compile_internal(ast->as.ternary_op.false_expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
+                    // The initializer is compiled before the variable exists, it sees the one it may shadow
+                    compile_push(&stack, typed ? node->as.typed_decl_assign.expression : node->as.inferred_decl_assign.expression);
+                    break;
+                }
 
-            operand_offset = bytecode->count - jmp + 1;
-            bytecode->items[jmp] = (uint8_t) ((operand_offset >> 24) & 0xFF);
-            bytecode->items[jmp + 1] = (uint8_t) ((operand_offset >> 16) & 0xFF);
-            bytecode->items[jmp + 2] = (uint8_t) ((operand_offset >> 8) & 0xFF);
-            bytecode->items[jmp + 3] = (uint8_t) (operand_offset & 0xFF);
+                Type type = typed ? token_type(node->as.typed_decl_assign.tok_dtype->kind)
+                                  : infer_type(node->as.inferred_decl_assign.expression, compiler->scopes);
+                if (!declare(compiler, identifier->as.identifier.tok_identifier, type, vm)) {
+                    error = RUJA_COMPILER_ERROR;
+                }
+                stack.count--;
+            } break;
+            case AST_NODE_STMT_ASSIGN: {
+                Ruja_Token* tok_assign = node->as.assign.tok_assign;
+                Opcode compound = compound_operator(tok_assign);
+                if (stage == 0) {
+                    frame->target = resolve(compiler, node->as.assign.identifier->as.identifier.tok_identifier);
+                    if (frame->target == NULL) {
+                        error = RUJA_COMPILER_ERROR;
+                        break;
+                    }
 
-        } break;
-        case AST_NODE_EXPRESSION: {
-            Ruja_Compile_Error error = compile_internal(ast->as.expr.expression, vm);
-            if (error != RUJA_COMPILER_OK) return error;
-        } break;
+                    if (emit_add_const(bytecode, frame->target, tok_assign, node->as.assign.expression)) {
+                        stack.count--;
+                        break;
+                    }
+
+                    // '+=' adds the value into the variable, other operators load it first
+                    if (compound != OP_HALT && compound != OP_ADD) emit_get(bytecode, frame->target, tok_assign->line);
+                    compile_push(&stack, node->as.assign.expression);
+                    break;
+                }
+
+                if (compound == OP_ADD) {
+                    add_instruction(bytecode, frame->target->depth == 0 ? OP_ADD_GLOBAL : OP_ADD_LOCAL, (uint32_t) frame->target->as.var.slot, 0, tok_assign->line);
+                } else {
+                    if (compound != OP_HALT) add_opcode(bytecode, compound, tok_assign->line);
+                    emit_set(bytecode, frame->target, tok_assign->line);
+                }
+                stack.count--;
+            } break;
+            case AST_NODE_STMT_IF:
+            case AST_NODE_STMT_ELIF: {
+                bool is_if = node->type == AST_NODE_STMT_IF;
+                Ruja_Token* tok_if = is_if ? node->as.if_branch.tok_if : node->as.elif_branch.tok_elif;
+                Ruja_Ast next_branch = is_if ? node->as.if_branch.next_branch : node->as.elif_branch.next_branch;
+                if (stage == 0) {
+                    compile_push(&stack, is_if ? node->as.if_branch.condition : node->as.elif_branch.condition);
+                } else if (stage == 1) {
+                    frame->jump_false = add_instruction(bytecode, OP_JZ, 0, 0, tok_if->line);
+
+                    frame->locals = begin_scope(compiler);
+                    compile_push(&stack, is_if ? node->as.if_branch.body : node->as.elif_branch.body);
+                } else if (stage == 2) {
+                    end_scope(compiler, bytecode, frame->locals, tok_if->line);
+                    if (next_branch == NULL) {
+                        patch_jump(bytecode, frame->jump_false, 0);
+                        stack.count--;
+                        break;
+                    }
+
+                    // The end of the body skips the other branches
+                    frame->jump = add_instruction(bytecode, OP_JUMP, 0, 0, tok_if->line);
+                    patch_jump(bytecode, frame->jump_false, 0);
+                    compile_push(&stack, next_branch);
+                } else {
+                    patch_jump(bytecode, frame->jump, 0);
+                    stack.count--;
+                }
+            } break;
+            case AST_NODE_STMT_ELSE: {
+                if (stage == 0) {
+                    frame->locals = begin_scope(compiler);
+                    compile_push(&stack, node->as.else_branch.body);
+                    break;
+                }
+
+                end_scope(compiler, bytecode, frame->locals, node->as.else_branch.tok_else->line);
+                stack.count--;
+            } break;
+            case AST_NODE_STMT_WHILE: {
+                Ruja_Token* tok_while = node->as.while_loop.tok_while;
+                if (stage == 0) {
+                    frame->jump = bytecode->count;
+                    compile_push(&stack, node->as.while_loop.condition);
+                } else if (stage == 1) {
+                    frame->jump_false = add_instruction(bytecode, OP_JZ, 0, 0, tok_while->line);
+
+                    frame->locals = begin_scope(compiler);
+                    compile_push(&stack, node->as.while_loop.body);
+                } else {
+                    // The locals of the body are popped before every new iteration
+                    end_scope(compiler, bytecode, frame->locals, tok_while->line);
+                    emit_loop(bytecode, frame->jump, tok_while->line);
+                    patch_jump(bytecode, frame->jump_false, 0);
+                    stack.count--;
+                }
+            } break;
+            case AST_NODE_STMT_FOR: {
+                // for i in start:end:step { body } keeps three locals: i, which is the counter itself,
+                // the end and the step. OP_FOR_PREP skips the loop if the range is empty and
+                // OP_FOR_RANGE steps the counter, compares it and branches back in one instruction.
+                Ruja_Token* tok_for = node->as.for_loop.tok_for;
+                Ruja_Ast iter = node->as.for_loop.iter;
+                if (iter == NULL || iter->type != AST_NODE_RANGED_ITER) {
+                    compiler_error(compiler, tok_for, "Only ranges can be iterated with");
+                    error = RUJA_COMPILER_ERROR;
+                    break;
+                }
+
+                Ruja_Ast step = iter->as.ranged_iter.step_expr;
+                if (stage == 0) {
+                    compile_push(&stack, iter->as.ranged_iter.start_expr);
+                    break;
+                }
+                if (stage == 1) {
+                    compile_push(&stack, iter->as.ranged_iter.end_expr);
+                    break;
+                }
+                if (stage == 2 && step != NULL) {
+                    compile_push(&stack, step);
+                    break;
+                }
+
+                if (stage <= 3) {
+                    if (step == NULL) emit_int(bytecode, 1, tok_for->line);
+
+                    // Declared once the range is compiled, which still sees the variables i may shadow
+                    size_t slot = begin_scope(compiler);
+                    if (!declare(compiler, node->as.for_loop.identifier->as.identifier.tok_identifier, VAR_TYPE_I32, vm)) {
+                        error = RUJA_COMPILER_ERROR;
+                        break;
+                    }
+                    compiler->n_locals += 2;
+                    if (compiler->n_locals > MAX_LOCALS) {
+                        compiler_error(compiler, tok_for, "Too many local variables");
+                        error = RUJA_COMPILER_ERROR;
+                        break;
+                    }
+
+                    frame->jump_false = add_instruction(bytecode, OP_FOR_PREP, (uint32_t) slot, 0, tok_for->line);
+
+                    frame->stage = 4;
+                    frame->locals = begin_scope(compiler);
+                    compile_push(&stack, node->as.for_loop.body);
+                    break;
+                }
+
+                end_scope(compiler, bytecode, frame->locals, tok_for->line);
+
+                size_t body = frame->jump_false + INSTRUCTION_SIZE(FOR_PREP);
+                add_instruction(bytecode, OP_FOR_RANGE, (uint32_t) (frame->locals - 3), (uint32_t) (bytecode->count - body), tok_for->line);
+
+                // An empty range skips to the OP_POP of the range
+                patch_jump(bytecode, frame->jump_false, 1);
+                end_scope(compiler, bytecode, frame->locals - 3, tok_for->line);
+                stack.count--;
+            } break;
+            case AST_NODE_STMT_STRUCT_DEF: {
+                compiler_error(compiler, node->as.struct_def.tok_struct, "Struct definitions are not supported yet");
+                error = RUJA_COMPILER_ERROR;
+            } break;
+            case AST_NODE_RANGED_ITER:
+            case AST_NODE_STMT_STRUCT_MEMBER:
+            default: {
+                // Ranges and members are only compiled by their for loop or struct
+                fprintf(stderr, "AST node %d is not supported yet\n", node->type);
+                error = RUJA_COMPILER_ERROR;
+            } break;
+        }
     }
-    return RUJA_COMPILER_OK;
+
+    ruja_free(&compiler->allocator, stack.items);
+    // Whatever ran out of memory already reported it
+    return compiler->out_of_memory || bytecode->out_of_memory ? RUJA_COMPILER_ERROR : error;
 }
 
 Ruja_Compile_Error compile(Ruja_Compiler *compiler, const char *source_path, Ruja_Vm* vm) {
@@ -156,37 +637,51 @@ Ruja_Compile_Error compile(Ruja_Compiler *compiler, const char *source_path, Ruj
     Ruja_Parser* parser = NULL;
     Ruja_Ir* ir = NULL;
 
-    lexer = lexer_new(source_path);
+    compiler->out_of_memory = false;
+    lexer = lexer_new(source_path, &compiler->allocator);
     if (lexer == NULL) goto error;
+    lexer_lex_parallel(lexer, 0); // Only kicks in for large sources
 
-    parser = parser_new();
+    parser = parser_new(&compiler->allocator);
     if (parser == NULL) goto error;
 
-    ir = ir_new();
+    ir = ir_new(lexer->content_end - lexer->content_start, &compiler->allocator);
     if (ir == NULL) goto error;
 
-    if (!parse(parser, lexer, &ir->ast, ir->symbol_table)) goto error;
+    if (!parse_parallel(parser, lexer, ir, 0)) goto error;
+    compiler->ast = ir->ast;
+    compiler->source = source_path;
 
-    if (compiler->ast->type != AST_NODE_EXPRESSION) {
-        fprintf(stderr, "Only expressions are supported\n");
-        goto error;
-    }
+    compiler->scopes = symbol_table_new(DEFAUlT_SYMBOL_TABLE_CAPACITY, &compiler->allocator);
+    if (compiler->scopes == NULL) goto error;
+    compiler->n_locals = 0;
+    compiler->n_globals = 0;
 
-    if (compile_internal(compiler->ast, vm)) {
+    if (compile_internal(compiler, compiler->ast, vm)) {
         fprintf(stderr, "Could not compile\n");
         goto error;
     }
 
+    if (!vm_reserve_globals(vm, compiler->n_globals)) goto error;
+
     lexer_free(lexer); lexer = NULL;
     parser_free(parser); parser = NULL;
+    ir_free(ir); ir = NULL;
+    symbol_table_free(compiler->scopes); compiler->scopes = NULL;
+    compiler->ast = NULL;
+    compiler->source = NULL;
     // from this point we no longer have access to the source code. Let's see how it goes
     // if it's a problem we can always store the source code in the compiler struct
     add_opcode(vm->bytecode, OP_HALT, 0);
-    return RUJA_COMPILER_OK;
+    return vm->bytecode->out_of_memory ? RUJA_COMPILER_ERROR : RUJA_COMPILER_OK;
 
 error:
     if (lexer != NULL) lexer_free(lexer);
     if (parser != NULL) parser_free(parser);
     if (ir != NULL) ir_free(ir);
+    if (compiler->scopes != NULL) symbol_table_free(compiler->scopes);
+    compiler->scopes = NULL;
+    compiler->ast = NULL;
+    compiler->source = NULL;
     return RUJA_COMPILER_ERROR;
 }
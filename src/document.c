@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../includes/document.h"
+#include "../includes/parser.h"
+#include "../includes/memory.h"
+
+
+/**
+ * @brief Counts the newlines in the range [from, to).
+ */
+static size_t count_newlines(const char* from, const char* to) {
+    size_t count = 0;
+    while ((from = memchr(from, '\n', (size_t) (to - from))) != NULL) {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+size_t document_item_start(const Ruja_Document* doc, size_t item) {
+    long start = (long) doc->items[item].start;
+    if (item >= doc->shift_from) start += doc->shift_bytes;
+    return (size_t) start;
+}
+
+size_t document_token_line(const Ruja_Document* doc, size_t item, const Ruja_Token* token) {
+    long shift = doc->items[item].line_shift;
+    if (item >= doc->shift_from) shift += doc->shift_lines;
+    return (size_t) ((long) token->line + shift);
+}
+
+static void move_items(Ruja_Document* doc, size_t from, size_t to, long bytes, long lines) {
+    for (size_t i = from; i < to; i++) {
+        Ruja_Document_Item* item = &doc->items[i];
+        item->start = (size_t) ((long) item->start + bytes);
+        item->line = (size_t) ((long) item->line + lines);
+        item->line_shift += lines;
+    }
+}
+
+/**
+ * @brief Applies the pending shift to the items before until.
+ */
+static void settle(Ruja_Document* doc, size_t until) {
+    if (doc->shift_from >= until) return;
+    move_items(doc, doc->shift_from, until, doc->shift_bytes, doc->shift_lines);
+    doc->shift_from = until;
+}
+
+/**
+ * @brief Returns the last item that starts at or before offset.
+ */
+static size_t find_item(const Ruja_Document* doc, size_t offset) {
+    size_t lo = 0;
+    size_t hi = doc->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (document_item_start(doc, mid) <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool tokens_push(Ruja_Tokens* tokens, Ruja_Token* token) {
+    if (tokens->count >= tokens->capacity) {
+        if (!REALLOC_DA(Ruja_Token*, tokens)) return false;
+    }
+
+    tokens->items[tokens->count++] = token;
+    return true;
+}
+
+static void probe_free(Ruja_Tokens* tokens) {
+    // The last one is the sentinel
+    for (size_t i = 0; i + 1 < tokens->count; i++) {
+        token_free(&ruja_default_allocator, tokens->items[i]);
+    }
+    tokens->count = 0;
+}
+
+/**
+ * @brief Lexes text only to find the items in it: no errors are reported and nothing is interned.
+ *      The tokens are followed by sentinel, whose kind is the one of the first token after the text.
+ *
+ * @return false If memory ran out. tokens is left empty.
+ */
+static bool probe(Ruja_Document* doc, char* text, size_t length, Ruja_Token_Kind follow, Ruja_Tokens* tokens, Ruja_Token* sentinel) {
+    Ruja_Lexer lexer;
+    lexer_init(&lexer, doc->source, text, length, 1, NULL);
+    lexer.speculative = true;
+
+    tokens->count = 0;
+    while (true) {
+        Ruja_Token* token = next_token(&lexer);
+        if (token == NULL) goto out_of_memory;
+        if (token->kind == RUJA_TOK_EOF) {
+            token_free(&lexer.allocator, token);
+            break;
+        }
+        if (!tokens_push(tokens, token)) {
+            token_free(&lexer.allocator, token);
+            goto out_of_memory;
+        }
+    }
+
+    memset(sentinel, 0, sizeof(Ruja_Token));
+    sentinel->kind = follow;
+    sentinel->start = text + length;
+    if (tokens_push(tokens, sentinel)) return true;
+
+out_of_memory:
+    // No sentinel yet, every token is a real one
+    for (size_t i = 0; i < tokens->count; i++) token_free(&lexer.allocator, tokens->items[i]);
+    tokens->count = 0;
+    return false;
+}
+
+/**
+ * @brief Checks if [from, to), which only holds whitespace and comments, ends inside a comment.
+ *      The first token of the next item would then be commented out.
+ */
+static bool ends_in_comment(const char* from, const char* to) {
+    const char* newline = NULL;
+    for (const char* c = from; c < to; c++) {
+        if (*c == '\n') newline = c;
+    }
+    if (newline != NULL) from = newline + 1;
+
+    for (const char* c = from; c + 1 < to; c++) {
+        if (c[0] == '/' && c[1] == '/') return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Checks if the probed text ends where a top-level statement does, so the item after it
+ *      can be kept as it is.
+ */
+static bool ends_cleanly(Ruja_Tokens* tokens, const char* text_end) {
+    size_t n = tokens->count - 1;
+    if (n == 0) return false;
+
+    size_t* ends = malloc(sizeof(size_t) * tokens->count);
+    if (ends == NULL) {
+        fprintf(stderr, "Could not allocate memory for document edit\n");
+        return false;
+    }
+    size_t n_pieces = parse_split_top_level(tokens, 0, 1, ends);
+    bool clean = n_pieces >= 2 && ends[n_pieces - 2] == n;
+    free(ends);
+
+    Ruja_Token* last = tokens->items[n - 1];
+    return clean && !ends_in_comment(last->start + last->length, text_end);
+}
+
+static Ruja_Ast item_ast(const Ruja_Document_Item* item) {
+    return item->ir != NULL ? item->ir->ast : NULL;
+}
+
+static void item_parse(Ruja_Document* doc, Ruja_Document_Item* item) {
+    Ruja_Lexer lexer;
+    lexer_init(&lexer, doc->source, item->text, item->length, item->line, NULL);
+
+    Ruja_Parser* parser = parser_new(NULL);
+    item->ir = ir_new(item->length, NULL);
+    item->ok = false;
+    if (parser != NULL && item->ir != NULL) {
+        item->ok = parse(parser, &lexer, item->ir);
+    }
+    if (parser != NULL) parser_free(parser);
+
+    item->tail = item_ast(item);
+    while (item->tail != NULL && item->tail->as.stmts.next != NULL) {
+        item->tail = item->tail->as.stmts.next;
+    }
+}
+
+static void item_free(Ruja_Document_Item* item) {
+    free(item->text);
+    ir_free(item->ir);
+}
+
+/**
+ * @brief Links the statements of the items [from, to) to the ones around them.
+ */
+static void relink(Ruja_Document* doc, size_t from, size_t to) {
+    Ruja_Ast tail = NULL;
+    size_t i = from;
+    while (i > 0 && tail == NULL) tail = doc->items[--i].tail;
+    Ruja_Ast* link = tail != NULL ? &tail->as.stmts.next : &doc->ast;
+
+    for (i = from; i < doc->count; i++) {
+        Ruja_Document_Item* item = &doc->items[i];
+        if (item->tail == NULL) continue;
+
+        *link = item_ast(item);
+        link = &item->tail->as.stmts.next;
+        // Everything after an untouched item is still linked
+        if (i >= to) return;
+    }
+    *link = NULL;
+}
+
+/**
+ * @brief Copies the text of every new item, so that nothing can fail once the document
+ *      starts to change.
+ *
+ * @return char** The texts or NULL if memory ran out. The error is reported.
+ */
+static char** copy_item_texts(char* text, size_t length, Ruja_Tokens* tokens, size_t* firsts, size_t m) {
+    char** texts = calloc(m, sizeof(char*));
+    for (size_t i = 0; texts != NULL && i < m; i++) {
+        const char* start = i == 0 ? text : tokens->items[firsts[i]]->start;
+        const char* end = i + 1 < m ? tokens->items[firsts[i + 1]]->start : text + length;
+        size_t size = (size_t) (end - start);
+
+        texts[i] = malloc(size + 1);
+        if (texts[i] == NULL) {
+            for (size_t j = 0; j < i; j++) free(texts[j]);
+            free(texts);
+            texts = NULL;
+            break;
+        }
+        memcpy(texts[i], start, size);
+        texts[i][size] = '\0';
+    }
+
+    if (texts == NULL) fprintf(stderr, "Out of memory. Could not allocate memory for document edit\n");
+    return texts;
+}
+
+/**
+ * @brief Replaces the items [first, last) by the ones found in text, as probed in tokens.
+ *
+ * @param reparsed Where the number of new items is stored.
+ * @return false If memory ran out. The document is left as it was.
+ */
+static bool replace_items(Ruja_Document* doc, size_t first, size_t last, char* text, size_t length, Ruja_Tokens* tokens, size_t* reparsed) {
+    // First token of every new item. The first item also holds the whitespace before it
+    size_t n = tokens->count - 1;
+    size_t* firsts = malloc(sizeof(size_t) * (tokens->count + 1));
+    if (firsts == NULL) {
+        fprintf(stderr, "Out of memory. Could not allocate memory for document edit\n");
+        return false;
+    }
+    size_t m = 1;
+    firsts[0] = 0;
+    if (n > 0) {
+        size_t n_pieces = parse_split_top_level(tokens, 0, 1, firsts + 1);
+        // The piece that only holds the sentinel is not an item
+        m = n_pieces;
+        if (firsts[m - 1] >= n) m--;
+    }
+
+    size_t removed = last - first;
+    char** texts = copy_item_texts(text, length, tokens, firsts, m);
+    while (texts != NULL && doc->count - removed + m > doc->capacity) {
+        if (REALLOC_DA(Ruja_Document_Item, doc)) continue;
+        for (size_t i = 0; i < m; i++) free(texts[i]);
+        free(texts);
+        texts = NULL;
+    }
+    if (texts == NULL) {
+        free(firsts);
+        return false;
+    }
+
+    settle(doc, last);
+    size_t region_start = first < doc->count ? doc->items[first].start : 0;
+    size_t region_line = first < doc->count ? doc->items[first].line : 1;
+
+    size_t old_length = 0;
+    size_t old_newlines = 0;
+    for (size_t i = first; i < last; i++) {
+        old_length += doc->items[i].length;
+        old_newlines += doc->items[i].newlines;
+        if (!doc->items[i].ok) doc->n_errors--;
+        item_free(&doc->items[i]);
+    }
+
+    if (m != removed) {
+        memmove(doc->items + first + m, doc->items + last, sizeof(Ruja_Document_Item) * (doc->count - last));
+        doc->count = doc->count - removed + m;
+    }
+
+    size_t line = region_line;
+    const char* counted = text;
+    for (size_t i = 0; i < m; i++) {
+        Ruja_Document_Item* item = &doc->items[first + i];
+        const char* start = i == 0 ? text : tokens->items[firsts[i]]->start;
+        const char* end = i + 1 < m ? tokens->items[firsts[i + 1]]->start : text + length;
+
+        line += count_newlines(counted, start);
+        counted = start;
+
+        item->length = (size_t) (end - start);
+        item->text = texts[i];
+
+        item->newlines = count_newlines(item->text, item->text + item->length);
+        item->start = region_start + (size_t) (start - text);
+        item->line = line;
+        item->line_shift = 0;
+        item->first = n > 0 ? tokens->items[firsts[i]]->kind : RUJA_TOK_EOF;
+        item_parse(doc, item);
+        if (!item->ok) doc->n_errors++;
+    }
+    free(firsts);
+    free(texts);
+
+    // The items after the edit move. The ones up to the pending shift are moved right away
+    // and the difference is added to the pending shift for the rest.
+    long bytes = (long) length - (long) old_length;
+    long lines = (long) count_newlines(text, text + length) - (long) old_newlines;
+    size_t after = first + m;
+    size_t shift_from = doc->shift_from + m - removed;
+    if (doc->shift_bytes == 0 && doc->shift_lines == 0) {
+        doc->shift_from = after;
+    } else {
+        move_items(doc, after, shift_from < doc->count ? shift_from : doc->count, bytes, lines);
+        doc->shift_from = shift_from;
+    }
+    doc->shift_bytes += bytes;
+    doc->shift_lines += lines;
+    if (doc->shift_from >= doc->count) {
+        doc->shift_from = doc->count;
+        doc->shift_bytes = 0;
+        doc->shift_lines = 0;
+    }
+
+    doc->length = (size_t) ((long) doc->length + bytes);
+    relink(doc, first, after);
+    *reparsed = m;
+    return true;
+}
+
+Ruja_Document* document_new(const char* filepath) {
+    // Only used to read the file
+    Ruja_Lexer* lexer = lexer_new(filepath, NULL);
+    if (lexer == NULL) return NULL;
+
+    Ruja_Document* doc = calloc(1, sizeof(Ruja_Document));
+    if (doc == NULL) {
+        fprintf(stderr, "Could not allocate memory for document\n");
+        lexer_free(lexer);
+        return NULL;
+    }
+    doc->source = filepath;
+
+    Ruja_Tokens tokens = {0};
+    Ruja_Token sentinel;
+    char* text = lexer->content_start;
+    size_t length = (size_t) (lexer->content_end - lexer->content_start);
+    bool ok = probe(doc, text, length, RUJA_TOK_EOF, &tokens, &sentinel)
+        && replace_items(doc, 0, 0, text, length, &tokens, &doc->reparsed);
+
+    probe_free(&tokens);
+    free(tokens.items);
+    lexer_free(lexer);
+    if (!ok) {
+        document_free(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+void document_free(Ruja_Document* doc) {
+    if (doc == NULL) return;
+
+    for (size_t i = 0; i < doc->count; i++) {
+        item_free(&doc->items[i]);
+    }
+    free(doc->items);
+    free(doc);
+}
+
+bool document_edit(Ruja_Document* doc, size_t begin, size_t end, const char* text, size_t length) {
+    if (begin > end || end > doc->length) {
+        fprintf(stderr, "Invalid edit [%"PRIu64", %"PRIu64") of '%s', it has %"PRIu64" bytes\n", begin, end, doc->source, doc->length);
+        return false;
+    }
+
+    // The items the edit touches. An insertion between two items belongs to the second one
+    size_t first = find_item(doc, begin);
+    size_t last = find_item(doc, end > begin ? end - 1 : begin) + 1;
+
+    Ruja_Tokens tokens = {0};
+    Ruja_Token sentinel;
+    char* buffer = NULL;
+    size_t size = 0;
+    size_t grow_back = 1;
+    size_t grow_forward = 1;
+    while (true) {
+        size_t base = document_item_start(doc, first);
+        size_t old_size = 0;
+        for (size_t i = first; i < last; i++) old_size += doc->items[i].length;
+
+        buffer = malloc(old_size + length + 1);
+        if (buffer == NULL) {
+            fprintf(stderr, "Could not allocate memory for document edit\n");
+            free(tokens.items);
+            return false;
+        }
+        char* cursor = buffer;
+        for (size_t i = first; i < last; i++) {
+            memcpy(cursor, doc->items[i].text, doc->items[i].length);
+            cursor += doc->items[i].length;
+        }
+        memmove(buffer + (begin - base) + length, buffer + (end - base), old_size - (end - base));
+        memcpy(buffer + (begin - base), text, length);
+        size = old_size - (end - begin) + length;
+        buffer[size] = '\0';
+
+        Ruja_Token_Kind follow = last < doc->count ? doc->items[last].first : RUJA_TOK_EOF;
+        if (!probe(doc, buffer, size, follow, &tokens, &sentinel)) {
+            free(tokens.items);
+            free(buffer);
+            return false;
+        }
+
+        // Grow the region until it is made of whole top-level statements. It grows faster
+        // every time, so opening a block at the top of a file does not lex it quadratically.
+        bool grow_backward = false;
+        bool grow_forwards = false;
+        if (tokens.count == 1) {
+            // No tokens left, merge the whitespace with a neighbour
+            grow_backward = first > 0;
+            grow_forwards = !grow_backward && last < doc->count;
+        } else {
+            Ruja_Token_Kind kind = tokens.items[0]->kind;
+            grow_backward = first > 0 && (kind == RUJA_TOK_ELSE || kind == RUJA_TOK_ELIF || kind == RUJA_TOK_SEMICOLON);
+            grow_forwards = last < doc->count && !ends_cleanly(&tokens, buffer + size);
+        }
+        if (!grow_backward && !grow_forwards) break;
+
+        probe_free(&tokens);
+        free(buffer);
+        if (grow_backward) {
+            size_t step = grow_back < first ? grow_back : first;
+            first -= step;
+            grow_back *= 2;
+        }
+        if (grow_forwards) {
+            size_t step = grow_forward < doc->count - last ? grow_forward : doc->count - last;
+            last += step;
+            grow_forward *= 2;
+        }
+    }
+
+    bool ok = replace_items(doc, first, last, buffer, size, &tokens, &doc->reparsed);
+
+    probe_free(&tokens);
+    free(tokens.items);
+    free(buffer);
+    return ok;
+}
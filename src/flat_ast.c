@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../includes/flat_ast.h"
+#include "../includes/memory.h"
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Flat_Index* items;
+} Flat_Scratch;
+
+Ruja_Flat_Ast* flat_ast_new(size_t capacity) {
+    Ruja_Flat_Ast* ast = calloc(1, sizeof(Ruja_Flat_Ast));
+    if (ast == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for flat AST.\n");
+        return NULL;
+    }
+
+    if (capacity < 8) capacity = 8;
+    ast->kinds = malloc(sizeof(uint8_t) * capacity);
+    ast->main_tokens = malloc(sizeof(uint32_t) * capacity);
+    ast->lhs = malloc(sizeof(Flat_Index) * capacity);
+    ast->rhs = malloc(sizeof(Flat_Index) * capacity);
+    if (ast->kinds == NULL || ast->main_tokens == NULL || ast->lhs == NULL || ast->rhs == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for flat AST nodes.\n");
+        flat_ast_free(ast);
+        return NULL;
+    }
+    ast->capacity = capacity;
+
+    // Node 0 and token 0 stand for "nothing"
+    ast->kinds[0] = AST_NODE_EMPTY;
+    ast->main_tokens[0] = 0;
+    ast->lhs[0] = FLAT_NULL;
+    ast->rhs[0] = FLAT_NULL;
+    ast->count = 1;
+
+    if (!REALLOC_DA(Ruja_Token*, (&ast->tokens))) {
+        flat_ast_free(ast);
+        return NULL;
+    }
+    ast->tokens.items[ast->tokens.count++] = NULL;
+
+    ast->root = FLAT_NULL;
+
+    return ast;
+}
+
+void flat_ast_free(Ruja_Flat_Ast* ast) {
+    if (ast == NULL) return;
+
+    free(ast->kinds);
+    free(ast->main_tokens);
+    free(ast->lhs);
+    free(ast->rhs);
+    free(ast->extra.items);
+    free(ast->tokens.items);
+    free(ast);
+}
+
+/**
+ * @brief Doubles the capacity of the node arrays.
+ *
+ * @return false If they could not grow. The arrays that did grow are kept, capacity is not
+ *      changed so it still bounds all four.
+ */
+static bool grow_nodes(Ruja_Flat_Ast* ast) {
+    size_t new_capacity = ast->capacity * 2;
+    if (new_capacity > UINT32_MAX) {
+        fprintf(stderr, "Flat AST can not hold more than %"PRIu32" nodes\n", UINT32_MAX);
+        return false;
+    }
+
+    uint8_t* kinds = realloc(ast->kinds, sizeof(uint8_t) * new_capacity);
+    if (kinds != NULL) ast->kinds = kinds;
+    uint32_t* main_tokens = realloc(ast->main_tokens, sizeof(uint32_t) * new_capacity);
+    if (main_tokens != NULL) ast->main_tokens = main_tokens;
+    Flat_Index* lhs = realloc(ast->lhs, sizeof(Flat_Index) * new_capacity);
+    if (lhs != NULL) ast->lhs = lhs;
+    Flat_Index* rhs = realloc(ast->rhs, sizeof(Flat_Index) * new_capacity);
+    if (rhs != NULL) ast->rhs = rhs;
+
+    if (kinds == NULL || main_tokens == NULL || lhs == NULL || rhs == NULL) {
+        fprintf(stderr, "Out of memory. Could not grow flat AST to %zu nodes\n", new_capacity);
+        return false;
+    }
+    ast->capacity = new_capacity;
+    return true;
+}
+
+// The appends below mark the AST out_of_memory when they fail, the build then gives up
+
+static Flat_Index add_node(Ruja_Flat_Ast* ast, ast_node_type kind, uint32_t main_token, Flat_Index lhs, Flat_Index rhs) {
+    if (ast->count == ast->capacity && !grow_nodes(ast)) {
+        ast->out_of_memory = true;
+        return FLAT_NULL;
+    }
+
+    Flat_Index node = (Flat_Index)ast->count++;
+    ast->kinds[node] = (uint8_t)kind;
+    ast->main_tokens[node] = main_token;
+    ast->lhs[node] = lhs;
+    ast->rhs[node] = rhs;
+
+    return node;
+}
+
+static uint32_t add_token(Ruja_Flat_Ast* ast, Ruja_Token* token) {
+    if (token == NULL) return 0;
+
+    if (ast->tokens.count == ast->tokens.capacity && !REALLOC_DA(Ruja_Token*, (&ast->tokens))) {
+        ast->out_of_memory = true;
+        return 0;
+    }
+    ast->tokens.items[ast->tokens.count] = token;
+    return (uint32_t)ast->tokens.count++;
+}
+
+/**
+ * @brief Appends values to the extra array.
+ *
+ * @return uint32_t The index of the first value.
+ */
+static uint32_t add_extra(Ruja_Flat_Ast* ast, const uint32_t* values, size_t count) {
+    while (ast->extra.count + count > ast->extra.capacity) {
+        if (!REALLOC_DA(uint32_t, (&ast->extra))) {
+            ast->out_of_memory = true;
+            return 0;
+        }
+    }
+
+    uint32_t start = (uint32_t)ast->extra.count;
+    if (count > 0) memcpy(ast->extra.items + start, values, sizeof(uint32_t) * count);
+    ast->extra.count += count;
+
+    return start;
+}
+
+static bool scratch_push(Flat_Scratch* scratch, Flat_Index node) {
+    if (scratch->count == scratch->capacity && !REALLOC_DA(Flat_Index, scratch)) return false;
+    scratch->items[scratch->count++] = node;
+    return true;
+}
+
+/**
+ * @brief Collects the children of a node that are not part of a list, in order.
+ *
+ * @return size_t The number of children. Missing children are NULL but still counted.
+ */
+static size_t fixed_children(Ruja_Ast tree, Ruja_Ast children[3]) {
+    switch (tree->type) {
+        case AST_NODE_EMPTY:
+        case AST_NODE_LITERAL:
+        case AST_NODE_IDENTIFIER:
+        case AST_NODE_STMTS:
+            return 0;
+        case AST_NODE_UNARY_OP:
+            children[0] = tree->as.unary_op.expression;
+            return 1;
+        case AST_NODE_BINARY_OP:
+            children[0] = tree->as.binary_op.left_expression;
+            children[1] = tree->as.binary_op.right_expression;
+            return 2;
+        case AST_NODE_TERNARY_OP:
+            children[0] = tree->as.ternary_op.condition;
+            children[1] = tree->as.ternary_op.true_expression;
+            children[2] = tree->as.ternary_op.false_expression;
+            return 3;
+        case AST_NODE_EXPRESSION:
+            children[0] = tree->as.expr.expression;
+            return 1;
+        case AST_NODE_STMT_ASSIGN:
+            children[0] = tree->as.assign.identifier;
+            children[1] = tree->as.assign.expression;
+            return 2;
+        case AST_NODE_STMT_TYPED_DECL:
+            children[0] = tree->as.typed_decl.identifier;
+            return 1;
+        case AST_NODE_STMT_TYPED_DECL_ASSIGN:
+            children[0] = tree->as.typed_decl_assign.identifier;
+            children[1] = tree->as.typed_decl_assign.expression;
+            return 2;
+        case AST_NODE_STMT_INFERRED_DECL_ASSIGN:
+            children[0] = tree->as.inferred_decl_assign.identifier;
+            children[1] = tree->as.inferred_decl_assign.expression;
+            return 2;
+        case AST_NODE_STMT_IF:
+            children[0] = tree->as.if_branch.condition;
+            children[1] = tree->as.if_branch.body;
+            children[2] = tree->as.if_branch.next_branch;
+            return 3;
+        case AST_NODE_STMT_ELIF:
+            children[0] = tree->as.elif_branch.condition;
+            children[1] = tree->as.elif_branch.body;
+            children[2] = tree->as.elif_branch.next_branch;
+            return 3;
+        case AST_NODE_STMT_ELSE:
+            children[0] = tree->as.else_branch.body;
+            return 1;
+        case AST_NODE_RANGED_ITER:
+            children[0] = tree->as.ranged_iter.start_expr;
+            children[1] = tree->as.ranged_iter.end_expr;
+            children[2] = tree->as.ranged_iter.step_expr;
+            return 3;
+        case AST_NODE_STMT_FOR:
+            children[0] = tree->as.for_loop.identifier;
+            children[1] = tree->as.for_loop.iter;
+            children[2] = tree->as.for_loop.body;
+            return 3;
+        case AST_NODE_STMT_WHILE:
+            children[0] = tree->as.while_loop.condition;
+            children[1] = tree->as.while_loop.body;
+            return 2;
+        case AST_NODE_STMT_STRUCT_MEMBER:
+            // next_member is walked by the struct definition, which flattens the list
+            children[0] = tree->as.struct_member.identifier;
+            return 1;
+        case AST_NODE_STMT_STRUCT_DEF:
+            children[0] = tree->as.struct_def.identifier;
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Returns the next element of a list node (STMTS or STMT_STRUCT_DEF) and advances the cursor.
+ *
+ * @return Ruja_Ast The next element or NULL once the list is exhausted.
+ */
+static Ruja_Ast next_list_child(Ruja_Ast tree, Ruja_Ast* cursor) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (tree->type) {
+        case AST_NODE_STMTS: {
+            while (*cursor != NULL) {
+                Ruja_Ast statement = (*cursor)->as.stmts.statement;
+                *cursor = (*cursor)->as.stmts.next;
+                if (statement != NULL) return statement;
+            }
+            return NULL;
+        }
+        case AST_NODE_STMT_STRUCT_DEF: {
+            Ruja_Ast member = *cursor;
+            if (member != NULL) *cursor = member->as.struct_member.next_member;
+            return member;
+        }
+        default: return NULL;
+    }
+#pragma GCC diagnostic pop
+}
+
+/**
+ * @brief Creates the flat node of tree once all its children have been built.
+ *
+ * @param children The flat indices of the children, fixed children first and then the list elements.
+ */
+static Flat_Index make_node(Ruja_Flat_Ast* ast, Ruja_Ast tree, const Flat_Index* children, size_t count) {
+    switch (tree->type) {
+        case AST_NODE_EMPTY: {
+            return add_node(ast, AST_NODE_EMPTY, 0, FLAT_NULL, FLAT_NULL);
+        }
+        case AST_NODE_LITERAL: {
+            return add_node(ast, AST_NODE_LITERAL, add_token(ast, tree->as.literal.tok_literal), FLAT_NULL, FLAT_NULL);
+        }
+        case AST_NODE_IDENTIFIER: {
+            return add_node(ast, AST_NODE_IDENTIFIER, add_token(ast, tree->as.identifier.tok_identifier), FLAT_NULL, FLAT_NULL);
+        }
+        case AST_NODE_UNARY_OP: {
+            return add_node(ast, AST_NODE_UNARY_OP, add_token(ast, tree->as.unary_op.tok_unary), children[0], FLAT_NULL);
+        }
+        case AST_NODE_BINARY_OP: {
+            return add_node(ast, AST_NODE_BINARY_OP, add_token(ast, tree->as.binary_op.tok_binary), children[0], children[1]);
+        }
+        case AST_NODE_TERNARY_OP: {
+            uint32_t extra[3] = {children[1], children[2], add_token(ast, tree->as.ternary_op.tok_ternary.tok_colon)};
+            return add_node(ast, AST_NODE_TERNARY_OP, add_token(ast, tree->as.ternary_op.tok_ternary.tok_question), children[0], add_extra(ast, extra, 3));
+        }
+        case AST_NODE_EXPRESSION: {
+            return add_node(ast, AST_NODE_EXPRESSION, 0, children[0], FLAT_NULL);
+        }
+        case AST_NODE_STMT_ASSIGN: {
+            return add_node(ast, AST_NODE_STMT_ASSIGN, add_token(ast, tree->as.assign.tok_assign), children[0], children[1]);
+        }
+        case AST_NODE_STMT_TYPED_DECL: {
+            return add_node(ast, AST_NODE_STMT_TYPED_DECL, add_token(ast, tree->as.typed_decl.tok_dtype), children[0], FLAT_NULL);
+        }
+        case AST_NODE_STMT_TYPED_DECL_ASSIGN: {
+            uint32_t extra[2] = {children[1], add_token(ast, tree->as.typed_decl_assign.tok_dtype)};
+            return add_node(ast, AST_NODE_STMT_TYPED_DECL_ASSIGN, add_token(ast, tree->as.typed_decl_assign.tok_assign), children[0], add_extra(ast, extra, 2));
+        }
+        case AST_NODE_STMT_INFERRED_DECL_ASSIGN: {
+            return add_node(ast, AST_NODE_STMT_INFERRED_DECL_ASSIGN, add_token(ast, tree->as.inferred_decl_assign.tok_assign), children[0], children[1]);
+        }
+        case AST_NODE_STMT_IF: {
+            uint32_t extra[2] = {children[1], children[2]};
+            return add_node(ast, AST_NODE_STMT_IF, add_token(ast, tree->as.if_branch.tok_if), children[0], add_extra(ast, extra, 2));
+        }
+        case AST_NODE_STMT_ELIF: {
+            uint32_t extra[2] = {children[1], children[2]};
+            return add_node(ast, AST_NODE_STMT_ELIF, add_token(ast, tree->as.elif_branch.tok_elif), children[0], add_extra(ast, extra, 2));
+        }
+        case AST_NODE_STMT_ELSE: {
+            return add_node(ast, AST_NODE_STMT_ELSE, add_token(ast, tree->as.else_branch.tok_else), children[0], FLAT_NULL);
+        }
+        case AST_NODE_RANGED_ITER: {
+            uint32_t extra[2] = {children[1], children[2]};
+            return add_node(ast, AST_NODE_RANGED_ITER, 0, children[0], add_extra(ast, extra, 2));
+        }
+        case AST_NODE_STMT_FOR: {
+            uint32_t extra[3] = {children[1], children[2], add_token(ast, tree->as.for_loop.tok_in)};
+            return add_node(ast, AST_NODE_STMT_FOR, add_token(ast, tree->as.for_loop.tok_for), children[0], add_extra(ast, extra, 3));
+        }
+        case AST_NODE_STMT_WHILE: {
+            return add_node(ast, AST_NODE_STMT_WHILE, add_token(ast, tree->as.while_loop.tok_while), children[0], children[1]);
+        }
+        case AST_NODE_STMT_STRUCT_MEMBER: {
+            return add_node(ast, AST_NODE_STMT_STRUCT_MEMBER, add_token(ast, tree->as.struct_member.tok_dtype), children[0], FLAT_NULL);
+        }
+        case AST_NODE_STMT_STRUCT_DEF: {
+            // The member count goes first, followed by the members
+            uint32_t member_count = (uint32_t)(count - 1);
+            uint32_t members = add_extra(ast, &member_count, 1);
+            add_extra(ast, children + 1, member_count);
+            return add_node(ast, AST_NODE_STMT_STRUCT_DEF, add_token(ast, tree->as.struct_def.tok_struct), children[0], members);
+        }
+        case AST_NODE_STMTS: {
+            uint32_t first = add_extra(ast, children, count);
+            return add_node(ast, AST_NODE_STMTS, 0, first, (uint32_t)count);
+        }
+    }
+
+    return FLAT_NULL;
+}
+
+// A tree node whose children are being built
+typedef struct {
+    Ruja_Ast tree;
+    Ruja_Ast cursor; // Next list element of STMTS and STMT_STRUCT_DEF nodes
+    size_t next;     // Next fixed child to build
+    size_t base;     // Where the indices of the children start in the scratch
+} Build_Frame;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Build_Frame* items;
+} Build_Stack;
+
+static bool build_push(Build_Stack* stack, Ruja_Ast tree, size_t base) {
+    if (stack->count == stack->capacity && !REALLOC_DA(Build_Frame, stack)) return false;
+
+    Ruja_Ast cursor = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (tree->type) {
+        case AST_NODE_STMTS: cursor = tree; break;
+        case AST_NODE_STMT_STRUCT_DEF: cursor = tree->as.struct_def.members; break;
+        default: break;
+    }
+#pragma GCC diagnostic pop
+
+    stack->items[stack->count++] = (Build_Frame) {.tree = tree, .cursor = cursor, .next = 0, .base = base};
+    return true;
+}
+
+/**
+ * @brief Builds the flat nodes of a tree in post order. The walk uses an explicit stack, so
+ *      deeply nested expressions do not overflow the C stack. The indices of built children
+ *      wait in the scratch until their parent is created.
+ */
+static Flat_Index build(Ruja_Flat_Ast* ast, Flat_Scratch* scratch, Ruja_Ast tree) {
+    if (tree == NULL) return FLAT_NULL;
+
+    Build_Stack stack = {0};
+    if (!build_push(&stack, tree, scratch->count)) ast->out_of_memory = true;
+
+    while (stack.count > 0 && !ast->out_of_memory) {
+        Build_Frame* frame = &stack.items[stack.count - 1];
+
+        Ruja_Ast children[3];
+        size_t fixed = fixed_children(frame->tree, children);
+
+        Ruja_Ast child = NULL;
+        bool has_child = false;
+        if (frame->next < fixed) {
+            child = children[frame->next++];
+            has_child = true;
+        } else if (frame->cursor != NULL) {
+            child = next_list_child(frame->tree, &frame->cursor);
+            has_child = child != NULL;
+        }
+
+        if (has_child) {
+            bool pushed = child == NULL ? scratch_push(scratch, FLAT_NULL) : build_push(&stack, child, scratch->count);
+            if (!pushed) ast->out_of_memory = true;
+            continue;
+        }
+
+        // Every child is built, create the node and hand its index to the parent
+        Flat_Index node = make_node(ast, frame->tree, scratch->items + frame->base, scratch->count - frame->base);
+        scratch->count = frame->base;
+        stack.count--;
+        if (!scratch_push(scratch, node)) ast->out_of_memory = true;
+    }
+
+    free(stack.items);
+    return ast->out_of_memory ? FLAT_NULL : scratch->items[--scratch->count];
+}
+
+Ruja_Flat_Ast* flat_ast_from_tree(Ruja_Ast tree) {
+    Ruja_Flat_Ast* ast = flat_ast_new(64);
+    if (ast == NULL) return NULL;
+
+    Flat_Scratch scratch = {0};
+    ast->root = build(ast, &scratch, tree);
+    free(scratch.items);
+    if (ast->out_of_memory) {
+        flat_ast_free(ast);
+        return NULL;
+    }
+
+    return ast;
+}
+
+const Flat_Index* flat_ast_children(const Ruja_Flat_Ast* ast, Flat_Index node, uint32_t* count) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (flat_ast_kind(ast, node)) {
+        case AST_NODE_STMTS: {
+            *count = ast->rhs[node];
+            return ast->extra.items + ast->lhs[node];
+        }
+        case AST_NODE_STMT_STRUCT_DEF: {
+            *count = ast->extra.items[ast->rhs[node]];
+            return ast->extra.items + ast->rhs[node] + 1;
+        }
+        default: {
+            *count = 0;
+            return NULL;
+        }
+    }
+#pragma GCC diagnostic pop
+}
+
+static const char* kind_to_string(ast_node_type kind) {
+    switch (kind) {
+        case AST_NODE_EMPTY: return "EMPTY";
+        case AST_NODE_LITERAL: return "LITERAL";
+        case AST_NODE_IDENTIFIER: return "IDENTIFIER";
+        case AST_NODE_UNARY_OP: return "UNARY_OP";
+        case AST_NODE_BINARY_OP: return "BINARY_OP";
+        case AST_NODE_TERNARY_OP: return "TERNARY_OP";
+        case AST_NODE_EXPRESSION: return "EXPRESSION";
+        case AST_NODE_STMT_ASSIGN: return "ASSIGN";
+        case AST_NODE_STMT_TYPED_DECL: return "TYPED_DECL";
+        case AST_NODE_STMT_TYPED_DECL_ASSIGN: return "TYPED_DECL_ASSIGN";
+        case AST_NODE_STMT_INFERRED_DECL_ASSIGN: return "INFERRED_DECL_ASSIGN";
+        case AST_NODE_STMT_IF: return "IF";
+        case AST_NODE_STMT_ELIF: return "ELIF";
+        case AST_NODE_STMT_ELSE: return "ELSE";
+        case AST_NODE_RANGED_ITER: return "RANGED_ITER";
+        case AST_NODE_STMT_FOR: return "FOR";
+        case AST_NODE_STMT_WHILE: return "WHILE";
+        case AST_NODE_STMT_STRUCT_MEMBER: return "STRUCT_MEMBER";
+        case AST_NODE_STMT_STRUCT_DEF: return "STRUCT_DEF";
+        case AST_NODE_STMTS: return "STMTS";
+    }
+    return "UNKNOWN";
+}
+
+void flat_ast_print(const Ruja_Flat_Ast* ast, FILE* file) {
+    for (Flat_Index node = 1; node < ast->count; node++) {
+        Ruja_Token* token = flat_ast_main_token(ast, node);
+        fprintf(file, "%6"PRIu32" %-22s lhs=%-6"PRIu32" rhs=%-6"PRIu32, node, kind_to_string(flat_ast_kind(ast, node)), ast->lhs[node], ast->rhs[node]);
+        if (token != NULL) fprintf(file, " '%.*s'", (int)token->length, token->start);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "root=%"PRIu32" nodes=%zu extra=%zu tokens=%zu\n", ast->root, ast->count - 1, ast->extra.count, ast->tokens.count - 1);
+}
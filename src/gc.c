@@ -0,0 +1,676 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../includes/gc.h"
+#include "../includes/vm.h"
+#include "../includes/string.h"
+#include "../includes/memory.h"
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void record_pause(Ruja_Gc* gc, uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    gc->stats.slices++;
+    gc->stats.pause_total_ns += ns;
+    if (ns > gc->stats.pause_max_ns) gc->stats.pause_max_ns = ns;
+
+    uint64_t us = ns / 1000;
+    size_t bucket = 0;
+    while (bucket < GC_HISTOGRAM_BUCKETS - 1 && us >= ((uint64_t) 1 << bucket)) bucket++;
+    gc->stats.pause_histogram[bucket]++;
+}
+
+void gc_init(Ruja_Vm* vm, Gc_Config config) {
+    Ruja_Gc* gc = &vm->gc;
+    gc->config = config;
+    if (gc->config.step_budget == 0) gc->config.step_budget = 1;
+    if (gc->config.growth < 1.0) gc->config.growth = 1.0;
+
+    gc->stats = (Gc_Stats) {0};
+    gc->phase = GC_PHASE_IDLE;
+    gc->allocator = &vm->allocator;
+    gc->gray = (Gray_Stack) {.allocator = gc->allocator};
+    gc->sweeping = NULL;
+    gc->survivors = NULL;
+    gc->survivors_tail = NULL;
+    gc->allocated = 0;
+    gc->threshold = config.initial_threshold;
+    gc->debt = 0;
+    slab_init(&gc->slab, gc->allocator);
+
+    Nursery* nursery = &gc->nursery;
+    *nursery = (Nursery) {0};
+    if (config.nursery_size > 0) {
+        nursery->start = ruja_alloc(gc->allocator, config.nursery_size);
+        if (nursery->start == NULL) {
+            fprintf(stderr, "Could not allocate memory for the nursery, every object is allocated old\n");
+        } else {
+            nursery->end = nursery->start + config.nursery_size;
+        }
+    }
+    nursery->top = nursery->start;
+}
+
+static void objects_free(Ruja_Slab* slab, Object* obj) {
+    while (obj != NULL) {
+        Object* next = object_next(obj);
+        object_free(slab, obj);
+        obj = next;
+    }
+}
+
+void gc_free(Ruja_Vm* vm) {
+    objects_free(&vm->gc.slab, vm->objects);
+    objects_free(&vm->gc.slab, vm->gc.sweeping);
+    objects_free(&vm->gc.slab, vm->gc.survivors);
+    vm->objects = NULL;
+    vm->gc.sweeping = NULL;
+    vm->gc.survivors = NULL;
+    ruja_free(vm->gc.allocator, vm->gc.gray.items);
+    vm->gc.gray = (Gray_Stack) {.allocator = vm->gc.allocator};
+
+    // Young objects own no memory of their own
+    ruja_free(vm->gc.allocator, vm->gc.nursery.start);
+    ruja_free(vm->gc.allocator, vm->gc.nursery.globals.items);
+    ruja_free(vm->gc.allocator, vm->gc.nursery.objects_with_young.items);
+    vm->gc.nursery = (Nursery) {0};
+
+    slab_free(&vm->gc.slab);
+}
+
+static bool has_children(Object* obj) {
+    switch (object_get_type(obj)) {
+        case OBJ_STRING: return false;
+        case OBJ_ROPE: return true;
+        case OBJ_STRING_VIEW: return true;
+        default: return false;
+    }
+}
+
+/**
+ * @brief Claims a white object. Leaves are blackened right away, the others are grayed
+ *      and pushed to gray. Safe to call from several marking threads at once.
+ */
+static void mark_into(Gray_Stack* gray, Object* obj) {
+    gc_color color = has_children(obj) ? GC_GRAY : GC_BLACK;
+    if (!object_claim(obj, GC_WHITE, color)) {
+        // Already claimed, or not owned by the gc
+        return;
+    }
+
+    if (color == GC_GRAY) {
+        if (gray->count >= gray->capacity && !REALLOC_DA_WITH(gray->allocator, Object*, gray)) {
+            // Left gray, the end of the marking finds it again
+            gray->overflowed = true;
+            return;
+        }
+        gray->items[gray->count++] = obj;
+    }
+}
+
+void gc_mark_object(Ruja_Gc* gc, Object* obj) {
+    mark_into(&gc->gray, obj);
+}
+
+/**
+ * @brief Marks the children of a gray object and turns it black.
+ */
+static void blacken(Gray_Stack* gray, Object* obj) {
+    switch (object_get_type(obj)) {
+        case OBJ_STRING: break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) obj;
+            if (IS_OBJECT(rope->left)) mark_into(gray, AS_OBJECT(rope->left));
+            if (IS_OBJECT(rope->right)) mark_into(gray, AS_OBJECT(rope->right));
+            if (rope->flat != NULL) mark_into(gray, (Object*) rope->flat);
+        } break;
+        case OBJ_STRING_VIEW: mark_into(gray, (Object*) ((ObjStringView*) obj)->parent); break;
+        default: break;
+    }
+    object_set_color(obj, GC_BLACK);
+}
+
+/**
+ * @brief Blackens at most budget gray objects.
+ *
+ * @return size_t The number of objects blackened. Less than budget if gray is empty.
+ */
+static size_t drain(Gray_Stack* gray, size_t budget) {
+    size_t work = 0;
+    while (gray->count > 0 && work < budget) {
+        blacken(gray, gray->items[--gray->count]);
+        work++;
+    }
+    return work;
+}
+
+// The roots as one sequence of words: the live stack, the globals and the constants
+typedef struct {
+    Word* items[3];
+    size_t counts[3];
+    size_t total;
+} Root_Set;
+
+static Root_Set root_set(Ruja_Vm* vm) {
+    Root_Set roots = {
+        .items = {vm->stack->items, vm->globals, vm->bytecode->constants->items},
+        .counts = {vm->stack->count, vm->n_globals, vm->bytecode->constants->count},
+    };
+    roots.total = roots.counts[0] + roots.counts[1] + roots.counts[2];
+    return roots;
+}
+
+static void mark_roots_range(Gray_Stack* gray, const Root_Set* roots, size_t begin, size_t end) {
+    for (size_t r = 0; r < 3 && begin < end; r++) {
+        if (begin >= roots->counts[r]) {
+            begin -= roots->counts[r];
+            end -= roots->counts[r];
+            continue;
+        }
+
+        size_t stop = end < roots->counts[r] ? end : roots->counts[r];
+        for (size_t i = begin; i < stop; i++) {
+            Word word = roots->items[r][i];
+            if (IS_OBJECT(word)) mark_into(gray, AS_OBJECT(word));
+        }
+        if (end <= roots->counts[r]) break;
+        begin = 0;
+        end -= roots->counts[r];
+    }
+}
+
+static void mark_roots(Ruja_Vm* vm) {
+    Root_Set roots = root_set(vm);
+    mark_roots_range(&vm->gc.gray, &roots, 0, roots.total);
+}
+
+typedef struct {
+    const Root_Set* roots;
+    size_t begin;
+    size_t end;
+    Gray_Stack gray; // Local to the thread, objects are claimed on their colour
+} Mark_Worker;
+
+static void* mark_worker(void* arg) {
+    Mark_Worker* worker = arg;
+    mark_roots_range(&worker->gray, worker->roots, worker->begin, worker->end);
+    drain(&worker->gray, SIZE_MAX);
+    return NULL;
+}
+
+/**
+ * @brief Marks everything reachable from the roots on n_threads threads, the calling one
+ *      included. Falls back to fewer threads if they can not be created.
+ */
+static void mark_parallel(Ruja_Vm* vm, size_t n_threads) {
+    Root_Set roots = root_set(vm);
+    const Ruja_Allocator* allocator = vm->gc.allocator;
+    Mark_Worker* workers = ruja_calloc(allocator, n_threads, sizeof(Mark_Worker));
+    pthread_t* threads = ruja_alloc(allocator, sizeof(pthread_t) * n_threads);
+    if (workers == NULL || threads == NULL) {
+        ruja_free(allocator, workers);
+        ruja_free(allocator, threads);
+        mark_roots_range(&vm->gc.gray, &roots, 0, roots.total);
+        drain(&vm->gc.gray, SIZE_MAX);
+        return;
+    }
+
+    size_t chunk = (roots.total + n_threads - 1) / n_threads;
+    for (size_t i = 0; i < n_threads; i++) {
+        workers[i].roots = &roots;
+        workers[i].begin = i * chunk < roots.total ? i * chunk : roots.total;
+        workers[i].end = (i + 1) * chunk < roots.total ? (i + 1) * chunk : roots.total;
+        workers[i].gray.allocator = allocator;
+    }
+
+    size_t started = 0;
+    for (size_t i = 1; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, mark_worker, &workers[i]) != 0) break;
+        started = i;
+    }
+    mark_worker(&workers[0]);
+    // Workers that could not be started are run here
+    for (size_t i = started + 1; i < n_threads; i++) {
+        mark_worker(&workers[i]);
+    }
+    for (size_t i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < n_threads; i++) {
+        if (workers[i].gray.overflowed) vm->gc.gray.overflowed = true;
+        ruja_free(allocator, workers[i].gray.items);
+    }
+    ruja_free(allocator, workers);
+    ruja_free(allocator, threads);
+}
+
+static void start_cycle(Ruja_Vm* vm) {
+    vm->gc.phase = GC_PHASE_MARK;
+    vm->gc.stats.cycles++;
+    mark_roots(vm);
+}
+
+/**
+ * @brief Atomic end of the marking: the roots may have changed since the cycle started.
+ *      Every object allocated so far is then handed to the sweep.
+ */
+static void finish_mark(Ruja_Vm* vm) {
+    Ruja_Gc* gc = &vm->gc;
+    mark_roots(vm);
+    drain(&gc->gray, SIZE_MAX);
+
+    // Gray objects that did not fit in the gray stack. Every pass blackens them all, only
+    // children found meanwhile can overflow again
+    while (gc->gray.overflowed) {
+        gc->gray.overflowed = false;
+        for (Object* obj = vm->objects; obj != NULL; obj = object_next(obj)) {
+            if (object_color(obj) != GC_GRAY) continue;
+            blacken(&gc->gray, obj);
+            drain(&gc->gray, SIZE_MAX);
+        }
+    }
+
+    gc->phase = GC_PHASE_SWEEP;
+    gc->sweeping = vm->objects;
+    vm->objects = NULL;
+    gc->survivors = NULL;
+    gc->survivors_tail = NULL;
+}
+
+/**
+ * @brief Frees the white objects among the next budget objects to sweep. Survivors are
+ *      whitened for the next cycle.
+ *
+ * @return size_t The number of objects swept. Less than budget if the sweep is done.
+ */
+static size_t sweep(Ruja_Gc* gc, size_t budget) {
+    size_t work = 0;
+    while (gc->sweeping != NULL && work < budget) {
+        Object* obj = gc->sweeping;
+        gc->sweeping = object_next(obj);
+        work++;
+
+        // A remembered object is kept until the next minor collection forgets it
+        if (object_color(obj) == GC_WHITE && !object_remembered(obj)) {
+            size_t size = object_size(obj);
+            gc->stats.bytes_reclaimed += size;
+            gc->stats.objects_reclaimed++;
+            gc->stats.live_bytes -= size;
+            object_free(&gc->slab, obj);
+            continue;
+        }
+
+        object_set_color(obj, GC_WHITE);
+        object_set_next(obj, NULL);
+        if (gc->survivors_tail == NULL) gc->survivors = obj;
+        else object_set_next(gc->survivors_tail, obj);
+        gc->survivors_tail = obj;
+    }
+    return work;
+}
+
+static void finish_sweep(Ruja_Vm* vm) {
+    Ruja_Gc* gc = &vm->gc;
+    if (gc->survivors_tail != NULL) {
+        object_set_next(gc->survivors_tail, vm->objects);
+        vm->objects = gc->survivors;
+    }
+    gc->survivors = NULL;
+    gc->survivors_tail = NULL;
+    gc->phase = GC_PHASE_IDLE;
+
+    gc->allocated = 0;
+    size_t threshold = (size_t) (gc->stats.live_bytes * (gc->config.growth - 1.0));
+    gc->threshold = threshold > gc->config.initial_threshold ? threshold : gc->config.initial_threshold;
+}
+
+/**
+ * @brief Runs what is left of the running cycle, if any, without yielding to the vm.
+ */
+static void finish_cycle(Ruja_Vm* vm) {
+    Ruja_Gc* gc = &vm->gc;
+    if (gc->phase == GC_PHASE_MARK) finish_mark(vm);
+    if (gc->phase == GC_PHASE_SWEEP) {
+        sweep(gc, SIZE_MAX);
+        finish_sweep(vm);
+    }
+}
+
+/**
+ * @brief Finishes the running cycle, if any, and runs a full one.
+ */
+static void full_cycle(Ruja_Vm* vm) {
+    Ruja_Gc* gc = &vm->gc;
+    uint64_t start = now_ns();
+
+    // Finish the running cycle, objects it marked may be dead by now
+    finish_cycle(vm);
+
+    gc->phase = GC_PHASE_MARK;
+    gc->stats.cycles++;
+    Root_Set roots = root_set(vm);
+    if (gc->config.mark_threads > 1 && roots.total >= GC_PARALLEL_MIN_ROOTS) {
+        mark_parallel(vm, gc->config.mark_threads);
+    }
+    finish_mark(vm);
+    sweep(gc, SIZE_MAX);
+    finish_sweep(vm);
+
+    record_pause(gc, start);
+}
+
+/**
+ * @brief Runs a slice of the collector if a cycle is running or due, sized by the bytes
+ *      allocated since the last slice. Outside of incremental mode a due cycle runs to the end.
+ *
+ * @param objects Number of objects the slice is run for, it does at least the work of as
+ *      many slices
+ */
+static void gc_step(Ruja_Vm* vm, size_t objects) {
+    Ruja_Gc* gc = &vm->gc;
+    size_t debt = gc->debt;
+    gc->debt = 0;
+    if (gc->phase == GC_PHASE_IDLE && gc->allocated < gc->threshold) return;
+
+    if (!gc->config.incremental) {
+        full_cycle(vm);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    if (gc->phase != GC_PHASE_IDLE && gc->allocated / GC_FINISH_FACTOR >= gc->threshold) {
+        // The vm allocates faster than the slices collect
+        finish_cycle(vm);
+        record_pause(gc, start);
+        return;
+    }
+
+    size_t steps = debt / GC_STEP_BYTES + 1;
+    if (steps < objects) steps = objects;
+    size_t budget = steps <= SIZE_MAX / gc->config.step_budget ? steps * gc->config.step_budget : SIZE_MAX;
+    switch (gc->phase) {
+        case GC_PHASE_IDLE: {
+            start_cycle(vm);
+        } break;
+        case GC_PHASE_MARK: {
+            if (drain(&gc->gray, budget) < budget) finish_mark(vm);
+        } break;
+        case GC_PHASE_SWEEP: {
+            if (sweep(gc, budget) < budget) finish_sweep(vm);
+        } break;
+    }
+    record_pause(gc, start);
+}
+
+/**
+ * @brief Links an object into the old space. While marking it is born marked, the roots
+ *      it will be stored in may already have been scanned.
+ */
+static void link_old(Ruja_Vm* vm, Object* obj) {
+    object_set_color(obj, GC_WHITE);
+    if (vm->gc.phase == GC_PHASE_MARK) mark_into(&vm->gc.gray, obj);
+    object_set_next(obj, vm->objects);
+    vm->objects = obj;
+}
+
+static void count_old(Ruja_Gc* gc, Object* obj) {
+    size_t size = object_size(obj);
+    gc->stats.bytes_allocated += size;
+    gc->stats.objects_allocated++;
+    gc->stats.live_bytes += size;
+    gc->allocated += size;
+    gc->debt += size;
+}
+
+void gc_track(Ruja_Vm* vm, Object* obj) {
+    count_old(&vm->gc, obj);
+
+    // The slice runs before obj is linked, it can not be swept while it is not reachable yet
+    gc_step(vm, 1);
+    link_old(vm, obj);
+}
+
+void gc_track_all(Ruja_Vm* vm, Object** objs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        count_old(&vm->gc, objs[i]);
+    }
+
+    // A single slice: the colours a slice gives to objects that are not linked yet are only
+    // valid for the cycle it runs in. It does the work of one slice per object: while marking,
+    // the objects with children are all born gray
+    gc_step(vm, count);
+    for (size_t i = 0; i < count; i++) {
+        link_old(vm, objs[i]);
+    }
+}
+
+void* gc_allocate_young(Ruja_Vm* vm, size_t size) {
+    Nursery* nursery = &vm->gc.nursery;
+    // Large objects would empty the nursery too often
+    size = (size + 7) & ~(size_t) 7;
+    if (nursery->start == NULL || size > (size_t) (nursery->end - nursery->start) / 8) return NULL;
+
+    if (size > (size_t) (nursery->end - nursery->top)) {
+        gc_minor_collect(vm);
+        if (nursery->pinned) return NULL;
+    }
+
+    void* memory = nursery->top;
+    nursery->top += size;
+    return memory;
+}
+
+void gc_track_young(Ruja_Vm* vm, Object* obj) {
+    Ruja_Gc* gc = &vm->gc;
+    object_set_color(obj, GC_YOUNG);
+    object_set_next(obj, NULL);
+    size_t size = object_size(obj);
+    gc->nursery.objects++;
+    gc->nursery.bytes += size;
+    gc->stats.bytes_allocated += size;
+    gc->stats.objects_allocated++;
+}
+
+void gc_remember_global(Ruja_Gc* gc, size_t slot) {
+    Remembered_Slots* globals = &gc->nursery.globals;
+    // Loops store to the same global over and over
+    if (globals->count > 0 && globals->items[globals->count - 1] == slot) return;
+
+    if (globals->count >= globals->capacity && !REALLOC_DA_WITH(gc->allocator, size_t, globals)) {
+        gc->nursery.overflowed = true;
+        return;
+    }
+    globals->items[globals->count++] = slot;
+}
+
+void gc_remember_object(Ruja_Gc* gc, Object* obj) {
+    Remembered_Objects* objects = &gc->nursery.objects_with_young;
+    if (object_remembered(obj)) return;
+    object_set_remembered(obj, true);
+
+    // obj stays remembered so that the sweep keeps it until the minor collection
+    if (objects->count >= objects->capacity && !REALLOC_DA_WITH(gc->allocator, Object*, objects)) {
+        gc->nursery.overflowed = true;
+        return;
+    }
+    objects->items[objects->count++] = obj;
+}
+
+/**
+ * @brief Copies a young object to the old space.
+ *
+ * @return Object* The copy or NULL if memory ran out or obj can not be young. The error is reported.
+ */
+static Object* promote(Ruja_Vm* vm, Object* obj) {
+    Object* copy = NULL;
+    switch (object_get_type(obj)) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) obj;
+            ObjString* old = obj_string_new(&vm->gc.slab, string->chars, string->length);
+            if (old != NULL) old->hash = string->hash;
+            copy = (Object*) old;
+        } break;
+        case OBJ_ROPE:
+        case OBJ_STRING_VIEW:
+        default: {
+            // Only leaves are allocated young, see gc_allocate_young
+            fprintf(stderr, RED"BUG: "WHITE"Young object of type '%d' can not be promoted, the nursery is pinned. This is probably a bug in the vm.\n"RESET, object_get_type(obj));
+            return NULL;
+        }
+    }
+
+    if (copy == NULL) {
+        fprintf(stderr, "Out of memory. Could not promote an object of %zu bytes, the nursery is pinned\n", object_size(obj));
+        return NULL;
+    }
+
+    size_t size = object_size(copy);
+    vm->gc.stats.bytes_promoted += size;
+    vm->gc.stats.objects_promoted++;
+    vm->gc.stats.live_bytes += size;
+    vm->gc.allocated += size;
+    vm->gc.debt += size;
+    link_old(vm, copy);
+    return copy;
+}
+
+/**
+ * @brief Points word to the old copy of the young object it holds, promoting it once.
+ *      If it can not be promoted the word is left alone and the nursery pinned.
+ */
+static void evacuate(Ruja_Vm* vm, Word* word) {
+    if (!IS_OBJECT(*word)) return;
+    Object* obj = AS_OBJECT(*word);
+    if (!gc_is_young(&vm->gc, obj)) return;
+
+    if (object_color(obj) != GC_FORWARDED) {
+        Object* copy = promote(vm, obj);
+        if (copy == NULL) {
+            vm->gc.nursery.pinned = true;
+            return;
+        }
+        object_set_next(obj, copy);
+        object_set_color(obj, GC_FORWARDED);
+    }
+    *word = MAKE_OBJECT(object_next(obj));
+}
+
+/**
+ * @brief Evacuates the young children of an old object.
+ */
+static void evacuate_children(Ruja_Vm* vm, Object* obj) {
+    switch (object_get_type(obj)) {
+        case OBJ_STRING: break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) obj;
+            evacuate(vm, &rope->left);
+            evacuate(vm, &rope->right);
+        } break;
+        case OBJ_STRING_VIEW: {
+            ObjStringView* view = (ObjStringView*) obj;
+            Word parent = MAKE_OBJECT(view->parent);
+            evacuate(vm, &parent);
+            view->parent = (ObjString*) AS_OBJECT(parent);
+        } break;
+        default: break;
+    }
+}
+
+void gc_minor_collect(Ruja_Vm* vm) {
+    Ruja_Gc* gc = &vm->gc;
+    Nursery* nursery = &gc->nursery;
+    if (nursery->top == nursery->start) return;
+
+    uint64_t start = now_ns();
+    size_t promoted = gc->stats.objects_promoted;
+    size_t promoted_bytes = gc->stats.bytes_promoted;
+
+    // Retried on every minor collection until it is empty again
+    bool overflowed = nursery->overflowed || nursery->pinned;
+    nursery->overflowed = false;
+    nursery->pinned = false;
+
+    for (size_t i = 0; i < vm->stack->count; i++) {
+        evacuate(vm, &vm->stack->items[i]);
+    }
+    if (overflowed) {
+        for (size_t i = 0; i < vm->n_globals; i++) {
+            evacuate(vm, &vm->globals[i]);
+        }
+        // The old objects are in one of these lists, whatever the phase of the major collector
+        Object* lists[] = {vm->objects, gc->sweeping, gc->survivors};
+        for (size_t l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) {
+            for (Object* obj = lists[l]; obj != NULL; obj = object_next(obj)) {
+                evacuate_children(vm, obj);
+                object_set_remembered(obj, false);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < nursery->globals.count; i++) {
+            size_t slot = nursery->globals.items[i];
+            if (slot < vm->n_globals) evacuate(vm, &vm->globals[slot]);
+        }
+        for (size_t i = 0; i < nursery->objects_with_young.count; i++) {
+            Object* obj = nursery->objects_with_young.items[i];
+            evacuate_children(vm, obj);
+            object_set_remembered(obj, false);
+        }
+    }
+    nursery->globals.count = 0;
+    nursery->objects_with_young.count = 0;
+
+    promoted = gc->stats.objects_promoted - promoted;
+    promoted_bytes = gc->stats.bytes_promoted - promoted_bytes;
+    gc->stats.minor_cycles++;
+    if (nursery->pinned) {
+        // The objects left behind are still referenced, the next minor collection finds them
+        // again by scanning everything
+        nursery->objects -= promoted;
+        nursery->bytes -= promoted_bytes;
+        record_pause(gc, start);
+        return;
+    }
+
+    // Every young object that was not promoted is dead
+    gc->stats.objects_reclaimed += nursery->objects - promoted;
+    gc->stats.bytes_reclaimed += nursery->bytes - promoted_bytes;
+
+    nursery->top = nursery->start;
+    nursery->objects = 0;
+    nursery->bytes = 0;
+
+    record_pause(gc, start);
+}
+
+void gc_collect(Ruja_Vm* vm) {
+    gc_minor_collect(vm);
+    full_cycle(vm);
+}
+
+void gc_print_stats(FILE* stream, const Ruja_Gc* gc) {
+    const Gc_Stats* stats = &gc->stats;
+    fprintf(stream, "GC: %zu cycles in %zu pauses\n", stats->cycles, stats->slices);
+    fprintf(stream, "  allocated: %zu bytes in %zu objects\n", stats->bytes_allocated, stats->objects_allocated);
+    fprintf(stream, "  reclaimed: %zu bytes in %zu objects\n", stats->bytes_reclaimed, stats->objects_reclaimed);
+    fprintf(stream, "  live:      %zu bytes\n", stats->live_bytes);
+    fprintf(stream, "  nursery:   %zu minor collections, %zu bytes in %zu objects promoted\n", stats->minor_cycles, stats->bytes_promoted, stats->objects_promoted);
+    fprintf(stream, "  pauses:    %.3f ms in total, %.3f ms at most\n", stats->pause_total_ns / 1e6, stats->pause_max_ns / 1e6);
+
+    for (size_t i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+        if (stats->pause_histogram[i] == 0) continue;
+        if (i == GC_HISTOGRAM_BUCKETS - 1) {
+            fprintf(stream, "    >= %6"PRIu64" us: %zu\n", (uint64_t) 1 << (i - 1), stats->pause_histogram[i]);
+        } else {
+            fprintf(stream, "    <  %6"PRIu64" us: %zu\n", (uint64_t) 1 << i, stats->pause_histogram[i]);
+        }
+    }
+}
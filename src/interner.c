@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../includes/interner.h"
+
+static Ruja_Interner* global_interner = NULL;
+
+Ruja_Interner* interner_new(size_t capacity) {
+    Ruja_Interner* interner = malloc(sizeof(Ruja_Interner));
+    if (interner == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for interner.\n");
+        return NULL;
+    }
+
+    // Capacity must be a power of two so probing can mask instead of dividing
+    size_t actual_capacity = DEFAULT_INTERNER_CAPACITY;
+    while (actual_capacity < capacity) actual_capacity *= 2;
+
+    interner->count = 0;
+    interner->capacity = actual_capacity;
+    interner->strings = calloc(actual_capacity, sizeof(ObjString*));
+    if (interner->strings == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for interner strings.\n");
+        free(interner);
+        return NULL;
+    }
+
+    return interner;
+}
+
+void interner_free(Ruja_Interner* interner) {
+    if (interner == NULL) return;
+
+    for (size_t i = 0; i < interner->capacity; i++) {
+        if (interner->strings[i] != NULL) object_free(NULL, (Object*) interner->strings[i]);
+    }
+
+    free(interner->strings);
+    free(interner);
+}
+
+/**
+ * @brief Doubles the capacity of the interner. Cached hashes are reused.
+ * 
+ * @param interner The interner to grow.
+ * @return true If the interner was resized.
+ */
+static bool interner_grow(Ruja_Interner* interner) {
+    size_t new_capacity = interner->capacity * 2;
+    ObjString** new_strings = calloc(new_capacity, sizeof(ObjString*));
+    if (new_strings == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for interner strings.\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < interner->capacity; i++) {
+        ObjString* string = interner->strings[i];
+        if (string == NULL) continue;
+
+        size_t index = string->hash & (new_capacity - 1);
+        while (new_strings[index] != NULL) index = (index + 1) & (new_capacity - 1);
+        new_strings[index] = string;
+    }
+
+    free(interner->strings);
+    interner->strings = new_strings;
+    interner->capacity = new_capacity;
+    return true;
+}
+
+ObjString* interner_intern(Ruja_Interner* interner, const char* chars, size_t length) {
+    // Keep the load factor under 3/4
+    if ((interner->count + 1) * 4 > interner->capacity * 3 && !interner_grow(interner)) return NULL;
+
+    uint64_t hash = hash_chars(chars, length);
+    size_t index = hash & (interner->capacity - 1);
+    while (interner->strings[index] != NULL) {
+        ObjString* string = interner->strings[index];
+        if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0) {
+            return string;
+        }
+        index = (index + 1) & (interner->capacity - 1);
+    }
+
+    ObjString* string = obj_string_new(NULL, chars, length);
+    if (string == NULL) return NULL;
+    string->hash = hash;
+    string->interned = true;
+    // Interned strings outlive every vm, the gc leaves them alone
+    object_set_color(&string->obj, GC_PERMANENT);
+
+    interner->strings[index] = string;
+    interner->count++;
+    return string;
+}
+
+Ruja_Interner* interner_global() {
+    if (global_interner == NULL) global_interner = interner_new(DEFAULT_INTERNER_CAPACITY);
+    return global_interner;
+}
+
+void interner_global_free() {
+    interner_free(global_interner);
+    global_interner = NULL;
+}
@@ -4,24 +4,33 @@
 #include "../includes/ir.h"
 
 
-Ruja_Ir *ir_new() {
-    Ruja_Ast ast = ast_new_stmt(NULL, NULL);
-    if (ast == NULL) return NULL;
+Ruja_Ir *ir_new(size_t size_hint, const Ruja_Allocator *allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Arena *arena = arena_new(size_hint, &owner);
+    if (arena == NULL) return NULL;
+
+    Ruja_Ast ast = ast_new_stmt(arena, NULL, NULL);
+    if (ast == NULL) {
+        arena_free(arena);
+        return NULL;
+    }
 
-    Ruja_Symbol_Table *symbol_table = symbol_table_new(8);
+    Ruja_Symbol_Table *symbol_table = symbol_table_new(8, &owner);
     if (symbol_table == NULL) {
-        ast_free(ast);
+        arena_free(arena);
         return NULL;
     }
 
-    Ruja_Ir *ir = malloc(sizeof(Ruja_Ir));
+    Ruja_Ir *ir = ruja_alloc(&owner, sizeof(Ruja_Ir));
     if (ir == NULL) {
         fprintf(stderr, "Error: Could not allocate memory for IR.\n");
-        ast_free(ast);
+        arena_free(arena);
         symbol_table_free(symbol_table);
         return NULL;
     }
 
+    ir->allocator = owner;
+    ir->arena = arena;
     ir->ast = ast;
     ir->symbol_table = symbol_table;
 
@@ -31,8 +40,9 @@ Ruja_Ir *ir_new() {
 void ir_free(Ruja_Ir *ir) {
     if (ir == NULL) return;
 
-    ast_free(ir->ast);
+    // The whole tree lives in the arena, no need to walk it
+    arena_free(ir->arena);
     symbol_table_free(ir->symbol_table);
-    free(ir);
+    Ruja_Allocator allocator = ir->allocator;
+    ruja_free(&allocator, ir);
 }
-
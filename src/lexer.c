@@ -3,8 +3,25 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "../includes/lexer.h"
+#include "../includes/memory.h"
+#include "../includes/interner.h"
+
+static void lex_error(Ruja_Lexer *lexer, Ruja_Token* token, const char* msg);
+
+/**
+ * @brief Interns the text of identifier and string tokens.
+ * 
+ * @param token The token to intern.
+ */
+static void intern_token(Ruja_Token* token) {
+    if ((token->kind == RUJA_TOK_ID || token->kind == RUJA_TOK_STRING) && token->interned == NULL) {
+        token->interned = interner_intern(interner_global(), token->start, token->length);
+    }
+}
 
 /**
  * @brief Sets the start position of the lexer to the current position.
@@ -31,7 +48,7 @@ static void advance(Ruja_Lexer *lexer) {
  * @return char The current character of the lexer.
  */
 static char peek(Ruja_Lexer *lexer) {
-    return *(lexer->current);
+    return lexer->current < lexer->content_end ? *(lexer->current) : '\0';
 }
 
 /**
@@ -52,7 +69,7 @@ static char peek_offset(Ruja_Lexer *lexer, size_t offset) {
  * @return char The next character of the lexer.
  */
 static char peek_next(Ruja_Lexer *lexer) {
-    return *(lexer->current + 1);
+    return lexer->current + 1 < lexer->content_end ? *(lexer->current + 1) : '\0';
 }
 
 /**
@@ -203,11 +220,14 @@ static Ruja_Token* tok_identifier(Ruja_Lexer *lexer) {
 
     size_t length = (size_t) (lexer->current - lexer->start);
     Ruja_Token* result = token_new(
+        &lexer->allocator,
         id_v_keyword(lexer, length),
         lexer->start,
         length,
         lexer->line
     );
+    if (result == NULL) return NULL;
+    if (!lexer->speculative) intern_token(result);
 
 #if DEBUG_TOKENS
     printf("Creating Token: ");
@@ -217,28 +237,84 @@ static Ruja_Token* tok_identifier(Ruja_Lexer *lexer) {
     return result;
 }
 
+/**
+ * @brief Parses a float literal that did not fit the fast path. The lexeme is copied
+ *      so strtod can not read past the end of the token (e.g. into "1.5e3").
+ * 
+ * @param start The start of the lexeme.
+ * @param length The length of the lexeme.
+ * @return double The parsed value.
+ */
+static double parse_float_slow(const Ruja_Allocator* allocator, const char* start, size_t length) {
+    char small[64];
+    char* buffer = length < sizeof(small) ? small : ruja_alloc(allocator, length + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Could not allocate memory for float literal\n");
+        return 0.0;
+    }
+
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    double value = strtod(buffer, NULL);
+
+    if (buffer != small) ruja_free(allocator, buffer);
+    return value;
+}
+
 /**
  * @brief Returns the next token of the lexer. Either an integer or a float.
+ *      The value of the literal is parsed while scanning and stored in the token.
  * 
  * @param lexer The lexer to get the next token of.
  * @return Ruja_Token The next token of the lexer.
  */
 static Ruja_Token* tok_number(Ruja_Lexer* lexer) {
-    while (isdigit(peek(lexer))) advance(lexer);
+    // Exact powers of ten that a double can represent
+    static const double powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    uint64_t mantissa = 0;
+    bool overflow = false;
+    while (isdigit(peek(lexer))) {
+        uint64_t digit = (uint64_t) (peek(lexer) - '0');
+        if (mantissa > (UINT64_MAX - digit) / 10) overflow = true;
+        else mantissa = mantissa * 10 + digit;
+        advance(lexer);
+    }
 
     // Look for a fractional part
     if (peek(lexer) == '.' && isdigit(peek_next(lexer))) {
         // Consume the "."
         advance(lexer);
 
-        while (isdigit(peek(lexer))) advance(lexer);
+        size_t fraction_digits = 0;
+        while (isdigit(peek(lexer))) {
+            uint64_t digit = (uint64_t) (peek(lexer) - '0');
+            if (mantissa > (UINT64_MAX - digit) / 10) overflow = true;
+            else mantissa = mantissa * 10 + digit;
+            fraction_digits++;
+            advance(lexer);
+        }
 
         Ruja_Token* result = token_new(
+            &lexer->allocator,
             RUJA_TOK_FLOAT,
             lexer->start,
             (size_t) (lexer->current - lexer->start),
             lexer->line
         );
+        if (result == NULL) return NULL;
+
+        // Clinger's fast path: both the mantissa and the power of ten are exact doubles,
+        // so a single division is correctly rounded. The grammar has no exponents, so
+        // this covers every literal with up to 15 significant digits.
+        if (!overflow && mantissa <= (UINT64_C(1) << 53) && fraction_digits < sizeof(powers_of_ten) / sizeof(powers_of_ten[0])) {
+            result->as.f64 = (double) mantissa / powers_of_ten[fraction_digits];
+        } else {
+            result->as.f64 = parse_float_slow(&lexer->allocator, result->start, result->length);
+        }
 
 #if DEBUG_TOKENS
         printf("Creating Token: ");
@@ -249,11 +325,19 @@ static Ruja_Token* tok_number(Ruja_Lexer* lexer) {
     }
 
     Ruja_Token* result = token_new(
+        &lexer->allocator,
         RUJA_TOK_INT,
         lexer->start,
         (size_t) (lexer->current - lexer->start),
         lexer->line
     );
+    if (result == NULL) return NULL;
+
+    if (overflow || mantissa > INT32_MAX) {
+        lex_error(lexer, result, "Integer literal does not fit in an i32");
+    } else {
+        result->as.i32 = (int32_t) mantissa;
+    }
 
 #if DEBUG_TOKENS
     printf("Creating Token: ");
@@ -339,14 +423,15 @@ static char* token_kind_to_string(Ruja_Token_Kind kind) {
  * @brief Reads the source code from a file and returns it as a string.
  * 
  * @param filepath The path to the file to read. 
+ * @param length Where to store the length of the source code (without the terminating '\0').
  * @return char* The source code as a string. NULL if an error occurred.
  */
-static char* read_file(const char* filepath){
+static char* read_file(const Ruja_Allocator* allocator, const char* filepath, size_t* length){
     #define READ_ERROR(condition, msg) \
         if (condition) { \
             fprintf(stderr, msg" '%s': %s.\n", filepath, strerror(errno)); \
             if (buffer != NULL) { \
-                free(buffer); \
+                ruja_free(allocator, buffer); \
             } \
             return NULL; \
         }
@@ -362,12 +447,13 @@ static char* read_file(const char* filepath){
 
     READ_ERROR(fseek(file, 0L, SEEK_SET) == -1, "Could not seek to start of file");
 
-    buffer = malloc(file_size + 1);
+    buffer = ruja_alloc(allocator, file_size + 1);
     READ_ERROR(buffer == NULL, "Could not allocate memory for file");
 
     size_t new_len = fread(buffer, sizeof(char), (size_t) file_size, file);
     READ_ERROR(ferror(file) != 0, "Could not read file");
-    buffer[new_len++] = '\0';
+    buffer[new_len] = '\0';
+    *length = new_len;
 
     READ_ERROR(fclose(file) == EOF, "Could not close file");
 
@@ -383,16 +469,17 @@ static char* read_file(const char* filepath){
  * @param msg The error message.
  */
 static void lex_error(Ruja_Lexer *lexer, Ruja_Token* token, const char* msg) {
-    fprintf(stderr, "%s:%"PRIu64": "RED"lex error"RESET" %s '%.*s'.\n", lexer->source, token->line, msg, (int) token->length, token->start);
     token->kind = RUJA_TOK_ERR;
+    if (lexer->speculative) return;
+    fprintf(stderr, "%s:%"PRIu64": "RED"lex error"RESET" %s '%.*s'.\n", lexer->source, token->line, msg, (int) token->length, token->start);
 }
 
 void token_to_string(Ruja_Token* token) {
     printf("Ruja_Token(%s,%.*s,%"PRIu64")\n", token_kind_to_string(token->kind), (int) token->length, token->start, token->line);
 }
 
-Ruja_Token* token_new(Ruja_Token_Kind kind, const char *start, size_t length, size_t line) {
-    Ruja_Token* token = malloc(sizeof(Ruja_Token));
+Ruja_Token* token_new(const Ruja_Allocator* allocator, Ruja_Token_Kind kind, const char *start, size_t length, size_t line) {
+    Ruja_Token* token = ruja_alloc(allocator, sizeof(Ruja_Token));
     if (token == NULL) {
         fprintf(stderr, "Could not allocate memory for token\n");
         return NULL;
@@ -402,47 +489,75 @@ Ruja_Token* token_new(Ruja_Token_Kind kind, const char *start, size_t length, si
     token->start = start;
     token->length = length;
     token->line = line;
-    token->in_ast = false;
+    token->as.f64 = 0.0;
+    token->interned = NULL;
 
     return token;
 }
 
-void token_free(Ruja_Token *token) {
+void token_free(const Ruja_Allocator* allocator, Ruja_Token *token) {
     if (token == NULL) return;
 #if DEBUG_TOKENS
     printf("Freeing Token: ");
     token_to_string(token);
 #endif
-    free(token);
+    ruja_free(allocator, token);
 }
 
-Ruja_Lexer* lexer_new(const char* filepath) {
-    char* content = read_file(filepath);
+Ruja_Lexer* lexer_new(const char* filepath, const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    size_t length = 0;
+    char* content = read_file(&owner, filepath, &length);
     if (content == NULL) return NULL;
 
-    Ruja_Lexer* lexer = malloc(sizeof(Ruja_Lexer));
+    Ruja_Lexer* lexer = ruja_alloc(&owner, sizeof(Ruja_Lexer));
     if (lexer == NULL) {
         fprintf(stderr, "Could not allocate memory for lexer\n");
-        free(content);
+        ruja_free(&owner, content);
         return NULL;
     }
 
-    lexer->source = filepath;
+    lexer_init(lexer, filepath, content, length, 1, &owner);
+    return lexer;
+}
+
+void lexer_init(Ruja_Lexer *lexer, const char* source, char* content, size_t length, size_t line, const Ruja_Allocator* allocator) {
+    lexer->allocator = allocator_or_default(allocator);
+    lexer->source = source;
     lexer->content_start = content;
+    lexer->content_end = content + length;
     lexer->start = content;
     lexer->current = content;
-    lexer->line = 1;
-
-    return lexer;
+    lexer->line = line;
+    lexer->speculative = false;
+    lexer->tokens = NULL;
+    lexer->next = 0;
 }
 
 void lexer_free(Ruja_Lexer *lexer) {
-    free(lexer->content_start);
-    free(lexer);
+    Ruja_Allocator allocator = lexer->allocator;
+    if (lexer->tokens != NULL) {
+        // Tokens that were never handed out to the parser are still owned by the lexer
+        for (size_t i = lexer->next; i < lexer->tokens->count; i++) {
+            token_free(&allocator, lexer->tokens->items[i]);
+        }
+        ruja_free(&allocator, lexer->tokens->items);
+        ruja_free(&allocator, lexer->tokens);
+    }
+    ruja_free(&allocator, lexer->content_start);
+    ruja_free(&allocator, lexer);
 }
 
 
 Ruja_Token* next_token(Ruja_Lexer *lexer) {
+    if (lexer->tokens != NULL) {
+        if (lexer->next < lexer->tokens->count) {
+            return lexer->tokens->items[lexer->next++];
+        }
+        // The buffered EOF was already handed out. Keep answering EOF like the on demand lexer does
+        return token_new(&lexer->allocator, RUJA_TOK_EOF, lexer->content_end, 0, lexer->line);
+    }
+
     skip_whitespace(lexer);
 
     if(isalpha(peek(lexer)) || peek(lexer) == '_')
@@ -451,7 +566,8 @@ Ruja_Token* next_token(Ruja_Lexer *lexer) {
     if(isdigit(peek(lexer)))
         return tok_number(lexer);
 
-    Ruja_Token* result = token_new(RUJA_TOK_ERR, lexer->start, 1, lexer->line);
+    Ruja_Token* result = token_new(&lexer->allocator, RUJA_TOK_ERR, lexer->start, 1, lexer->line);
+    if (result == NULL) return NULL;
 
     switch (peek(lexer)) {
         case '(' : { advance(lexer); result->kind = RUJA_TOK_LPAREN; } break;
@@ -557,7 +673,10 @@ Ruja_Token* next_token(Ruja_Lexer *lexer) {
             }
             result->length = lexer->current - result->start;
             if (peek(lexer) == '\0') lex_error(lexer, result, "Unterminated string");
-            else advance(lexer);
+            else {
+                advance(lexer);
+                if (!lexer->speculative) intern_token(result);
+            }
         } break;
         case '\0': { result->kind = RUJA_TOK_EOF; result->length = 0; } break;
         default: { lex_error(lexer, result, "Unrecognized token"); advance(lexer);} break;
@@ -569,4 +688,202 @@ Ruja_Token* next_token(Ruja_Lexer *lexer) {
 #endif
     rebase(lexer);
     return result;
-}
\ No newline at end of file
+}
+/**
+ * @brief Appends a token to a token buffer.
+ * 
+ * @param allocator The allocator of the lexer.
+ * @param tokens The buffer to append to.
+ * @param token The token to append.
+ * @return false If the buffer could not grow. The token was not appended.
+ */
+static bool tokens_push(const Ruja_Allocator* allocator, Ruja_Tokens* tokens, Ruja_Token* token) {
+    if (tokens->count >= tokens->capacity) {
+        if (!REALLOC_DA_WITH(allocator, Ruja_Token*, tokens)) return false;
+    }
+
+    tokens->items[tokens->count++] = token;
+    return true;
+}
+
+/**
+ * @brief Counts the newlines in the range [from, to).
+ */
+static size_t count_newlines(const char* from, const char* to) {
+    size_t count = 0;
+    while (from < to && (from = memchr(from, '\n', (size_t) (to - from))) != NULL) {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+typedef struct {
+    Ruja_Lexer lexer;  // Lexer bounded to [begin, end)
+    char* begin;
+    Ruja_Tokens tokens;
+    bool clean;        // No error tokens, so the chunk ends between two tokens
+    bool threaded;     // Lexed by a worker thread that must be joined
+    pthread_t thread;
+} Lex_Chunk;
+
+/**
+ * @brief Worker entry point. Lexes one chunk speculatively, assuming it starts between two tokens.
+ * 
+ * @param arg The Lex_Chunk to fill.
+ * @return void* Always NULL.
+ */
+static void* lex_chunk(void* arg) {
+    Lex_Chunk* chunk = arg;
+    chunk->clean = true;
+
+    for (;;) {
+        Ruja_Token* token = next_token(&chunk->lexer);
+        if (token == NULL) {
+            chunk->clean = false;
+            break;
+        }
+        if (token->kind == RUJA_TOK_EOF) {
+            token_free(&chunk->lexer.allocator, token);
+            break;
+        }
+        if (token->kind == RUJA_TOK_ERR) chunk->clean = false;
+        if (!tokens_push(&chunk->lexer.allocator, &chunk->tokens, token)) {
+            // The range is lexed again sequentially
+            token_free(&chunk->lexer.allocator, token);
+            chunk->clean = false;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Frees the chunks and the tokens they still own.
+ */
+static void free_chunks(const Ruja_Allocator* allocator, Lex_Chunk* chunks, size_t n_chunks) {
+    for (size_t k = 0; k < n_chunks; k++) {
+        for (size_t i = 0; i < chunks[k].tokens.count; i++) token_free(allocator, chunks[k].tokens.items[i]);
+        ruja_free(allocator, chunks[k].tokens.items);
+    }
+    ruja_free(allocator, chunks);
+}
+
+/**
+ * @brief Returns the number of workers to use when the caller did not ask for a specific number.
+ */
+static size_t default_workers(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t) online : 1;
+}
+
+bool lexer_lex_parallel(Ruja_Lexer *lexer, size_t n_workers) {
+    size_t size = (size_t) (lexer->content_end - lexer->current);
+    if (lexer->tokens != NULL || size < LEXER_PARALLEL_THRESHOLD) return false;
+
+    if (n_workers == 0) n_workers = default_workers();
+    if (n_workers > size / LEXER_MIN_CHUNK_SIZE) n_workers = size / LEXER_MIN_CHUNK_SIZE;
+    if (n_workers <= 1) return false;
+
+    const Ruja_Allocator* allocator = &lexer->allocator;
+    Lex_Chunk* chunks = ruja_calloc(allocator, n_workers, sizeof(Lex_Chunk));
+    Ruja_Tokens* tokens = ruja_calloc(allocator, 1, sizeof(Ruja_Tokens));
+    if (chunks == NULL || tokens == NULL) {
+        fprintf(stderr, "Could not allocate memory for parallel lexing\n");
+        ruja_free(allocator, chunks); ruja_free(allocator, tokens);
+        return false;
+    }
+
+    // Split the source right after newlines. Comments never cross a chunk boundary this way,
+    // only string and character literals can.
+    size_t n_chunks = 0;
+    char* begin = lexer->current;
+    for (size_t i = 0; i < n_workers && begin < lexer->content_end; i++) {
+        char* end = lexer->content_end;
+        if (i + 1 < n_workers) {
+            char* split = lexer->current + size / n_workers * (i + 1);
+            if (split < begin) split = begin;
+            char* newline = memchr(split, '\n', (size_t) (lexer->content_end - split));
+            if (newline != NULL) end = newline + 1;
+        }
+
+        Lex_Chunk* chunk = &chunks[n_chunks++];
+        chunk->begin = begin;
+        chunk->lexer = *lexer;
+        chunk->lexer.start = begin;
+        chunk->lexer.current = begin;
+        chunk->lexer.content_end = end;
+        chunk->lexer.line = 1;
+        chunk->lexer.speculative = true;
+        begin = end;
+    }
+
+    for (size_t i = 1; i < n_chunks; i++) {
+        chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, lex_chunk, &chunks[i]) == 0;
+        // Could not start a worker: lex this chunk on the calling thread instead
+        if (!chunks[i].threaded) lex_chunk(&chunks[i]);
+    }
+    lex_chunk(&chunks[0]);
+    for (size_t i = 1; i < n_chunks; i++) {
+        if (chunks[i].threaded) pthread_join(chunks[i].thread, NULL);
+    }
+
+    // Resynchronisation. A chunk is only valid if lexing really reaches its first byte in
+    // between two tokens. Otherwise (its start is inside a literal, or it hit an error) the
+    // range is lexed again sequentially until we land on the next chunk boundary.
+    Ruja_Lexer seq = *lexer;
+    size_t k = 0;
+    for (;;) {
+        char* before = seq.current;
+        size_t before_line = seq.line;
+        skip_whitespace(&seq);
+
+        while (k < n_chunks && chunks[k].begin < before) {
+            for (size_t i = 0; i < chunks[k].tokens.count; i++) token_free(allocator, chunks[k].tokens.items[i]);
+            chunks[k].tokens.count = 0;
+            k++;
+        }
+
+        if (k < n_chunks && chunks[k].begin <= seq.current && chunks[k].clean) {
+            Lex_Chunk* chunk = &chunks[k];
+            size_t base_line = before_line + count_newlines(before, chunk->begin);
+            for (size_t i = 0; i < chunk->tokens.count; i++) {
+                chunk->tokens.items[i]->line += base_line - 1;
+                intern_token(chunk->tokens.items[i]);
+                if (!tokens_push(allocator, tokens, chunk->tokens.items[i])) goto out_of_memory;
+                // Owned by tokens from now on
+                chunk->tokens.items[i] = NULL;
+            }
+            chunk->tokens.count = 0;
+            k++;
+            seq.start = seq.current = chunk->lexer.content_end;
+            seq.line = base_line + chunk->lexer.line - 1;
+            continue;
+        }
+
+        Ruja_Token* token = next_token(&seq);
+        // A stream without its EOF would end the program early, the caller lexes on demand instead
+        if (token == NULL) goto out_of_memory;
+        if (!tokens_push(allocator, tokens, token)) {
+            token_free(allocator, token);
+            goto out_of_memory;
+        }
+        if (token->kind == RUJA_TOK_EOF) break;
+    }
+
+    free_chunks(allocator, chunks, n_chunks);
+    lexer->start = lexer->current = seq.current;
+    lexer->line = seq.line;
+    lexer->tokens = tokens;
+    lexer->next = 0;
+    return true;
+
+out_of_memory:
+    // Nothing was consumed from lexer, it can still lex on demand
+    free_chunks(allocator, chunks, n_chunks);
+    for (size_t i = 0; i < tokens->count; i++) token_free(allocator, tokens->items[i]);
+    ruja_free(allocator, tokens->items);
+    ruja_free(allocator, tokens);
+    return false;
+}
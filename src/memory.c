@@ -1 +1,50 @@
-#include "../includes/memory.h"
\ No newline at end of file
+#include <string.h>
+
+#include "../includes/memory.h"
+
+static void* default_alloc(void* ctx, size_t size) {
+    UNUSED(ctx);
+    return malloc(size);
+}
+
+static void* default_realloc(void* ctx, void* memory, size_t size) {
+    UNUSED(ctx);
+    return realloc(memory, size);
+}
+
+static void default_free(void* ctx, void* memory) {
+    UNUSED(ctx);
+    free(memory);
+}
+
+const Ruja_Allocator ruja_default_allocator = {
+    .alloc = default_alloc,
+    .realloc = default_realloc,
+    .free = default_free,
+    .ctx = NULL,
+};
+
+void* ruja_calloc(const Ruja_Allocator* allocator, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+
+    void* memory = ruja_alloc(allocator, count * size);
+    if (memory != NULL) memset(memory, 0, count * size);
+    return memory;
+}
+
+bool grow_items(const Ruja_Allocator* allocator, void* items, size_t* capacity, size_t item_size, const char* name) {
+    size_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+    void* old = NULL;
+    memcpy(&old, items, sizeof(void*));
+
+    void* new = new_capacity <= SIZE_MAX / item_size ? ruja_realloc(allocator, old, item_size * new_capacity) : NULL;
+    if (new == NULL) {
+        fprintf(stderr, "Out of memory. Could not allocate %zu items of %zu bytes for %s\n", new_capacity, item_size, name);
+        return false;
+    }
+
+    // items may point to any type of pointer, it is written as raw bytes
+    memcpy(items, &new, sizeof(void*));
+    *capacity = new_capacity;
+    return true;
+}
@@ -6,24 +6,57 @@
 #include "../includes/objects.h"
 #include "../includes/string.h"
 
+static void print_piece(const char* chars, size_t length, void* ctx) {
+    fwrite(chars, 1, length, (FILE*) ctx);
+}
+
+static void print_padding(FILE* stream, size_t length, int width) {
+    for (size_t i = length; i < (size_t) width; i++) fputc(' ', stream);
+}
+
 void print_object(FILE* stream, Object* obj, int width) {
-    switch (obj->type) {
+    switch (object_get_type(obj)) {
         case OBJ_STRING:
             fprintf(stream, "%*s", width, ((ObjString*)obj)->chars);
             break;
+        case OBJ_ROPE: {
+            // Printed piece by piece, padded like "%*s"
+            ObjRope* rope = (ObjRope*)obj;
+            if (width > 0) print_padding(stream, rope->length, width);
+            rope_pieces(rope, print_piece, stream);
+            if (width < 0) print_padding(stream, rope->length, -width);
+        } break;
+        case OBJ_STRING_VIEW: {
+            ObjStringView* view = (ObjStringView*)obj;
+            fprintf(stream, "%*.*s", width, (int) view->length, view->parent->chars + view->offset);
+        } break;
         default:
             fprintf(stream, "???");
             break;
     }
 }
 
-void object_free(Object* obj) {
-    switch (obj->type) {
+void* object_alloc(Ruja_Slab* slab, size_t size) {
+    void* memory = slab != NULL ? slab_alloc(slab, size) : malloc(size);
+    if (memory == NULL) fprintf(stderr, "Could not allocate memory for object\n");
+    return memory;
+}
+
+void object_free(Ruja_Slab* slab, Object* obj) {
+    // Every object is a single allocation
+    if (slab != NULL) slab_release(slab, obj, object_size(obj));
+    else free(obj);
+}
+
+size_t object_size(Object* obj) {
+    switch (object_get_type(obj)) {
         case OBJ_STRING:
-            free(((ObjString*)obj)->chars);
-            break;
+            return sizeof(ObjString) + ((ObjString*)obj)->length + 1;
+        case OBJ_ROPE:
+            return sizeof(ObjRope);
+        case OBJ_STRING_VIEW:
+            return sizeof(ObjStringView);
         default:
-            break;
+            return sizeof(Object);
     }
-    free(obj);
-}
\ No newline at end of file
+}
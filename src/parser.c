@@ -3,6 +3,9 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "../includes/parser.h"
 #include "../includes/memory.h"
@@ -13,8 +16,8 @@ struct _tstack {
     Type *items;
 };
 
-Type_Stack* new_type_stack() {
-    Type_Stack* stack = malloc(sizeof(Type_Stack));
+Type_Stack* new_type_stack(const Ruja_Allocator* allocator) {
+    Type_Stack* stack = ruja_alloc(allocator, sizeof(Type_Stack));
     if (stack == NULL) {
         fprintf(stderr, "Error: Could not allocate memory for type stack.\n");
         return NULL;
@@ -22,27 +25,32 @@ Type_Stack* new_type_stack() {
 
     stack->count = 0;
     stack->capacity = 8;
-    stack->items = malloc(sizeof(Type) * stack->capacity);
+    stack->items = ruja_alloc(allocator, sizeof(Type) * stack->capacity);
     if (stack->items == NULL) {
         fprintf(stderr, "Error: Could not allocate memory for type stack items.\n");
+        ruja_free(allocator, stack);
         return NULL;
     }
 
     return stack;
 }
 
-void type_stack_free(Type_Stack* stack) {
+void type_stack_free(const Ruja_Allocator* allocator, Type_Stack* stack) {
     if (stack == NULL) {
         return;
     }
 
-    free(stack->items);
-    free(stack);
+    ruja_free(allocator, stack->items);
+    ruja_free(allocator, stack);
 }
 
-static void push_type(Type_Stack *stack, Type type) {
+static void push_type(Ruja_Parser *parser, Type type) {
+    Type_Stack* stack = parser->type_stack;
     if (stack->count + 1 > stack->capacity) {
-        REALLOC_DA(Type_Stack, stack);
+        if (!REALLOC_DA_WITH(&parser->allocator, Type, stack)) {
+            parser->had_error = true;
+            return;
+        }
     }
 
     stack->items[stack->count++] = type;
@@ -66,6 +74,17 @@ static void signal_lexer_error(Ruja_Parser *parser) {
     parser->had_error = true;
 }
 
+/**
+ * @brief Prints a parse error.
+ *
+ * @param lexer The lexer that holds the source file.
+ * @param token The offending token.
+ * @param msg The error message.
+ */
+static void report_error(Ruja_Lexer *lexer, Ruja_Token* token, const char *msg) {
+    fprintf(stderr, "%s:%" PRIu64 ": " RED "parse error" RESET " %s got '%.*s'.\n", lexer->source, token->line, msg, (int)token->length, token->start);
+}
+
 /**
  * @brief Signals a parser error and prints the error message.
  *
@@ -78,12 +97,50 @@ static void parser_error(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Token* tok
         return;
     parser->panic_mode = true;
 
-    fprintf(stderr, "%s:%" PRIu64 ": " RED "parse error" RESET " %s got '%.*s'.\n", lexer->source, token->line, msg, (int)token->length, token->start);
+    if (parser->defer_errors) {
+        parser->deferred_error.msg = msg;
+        parser->deferred_error.token = *token;
+    } else {
+        report_error(lexer, token, msg);
+    }
     parser->had_error = true;
 }
 
-static void maybe_free_token(Ruja_Token *token) {
-    if (!token->in_ast) token_free(token);
+/**
+ * @brief Frees a token, unless it is the out_of_memory sentinel of the parser.
+ */
+static void release_token(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Token* token) {
+    if (token != &parser->out_of_memory) token_free(&lexer->allocator, token);
+}
+
+/**
+ * @brief Ends the parse when memory ran out: the current token becomes an EOF of its own,
+ *      so that every rule unwinds as if the source ended here. The error was reported by
+ *      the allocation that failed.
+ */
+static void end_parse(Ruja_Parser *parser, Ruja_Lexer *lexer) {
+    if (parser->current != NULL && parser->current != parser->previous) release_token(parser, lexer, parser->current);
+
+    parser->out_of_memory = (Ruja_Token) {
+        .kind = RUJA_TOK_EOF,
+        .start = lexer->current,
+        .length = 0,
+        .line = lexer->line,
+    };
+    parser->current = &parser->out_of_memory;
+    signal_lexer_error(parser);
+}
+
+/**
+ * @brief Checks a node built from the arena of the parser, ending the parse if it is NULL.
+ *
+ * @return false If the arena ran out of memory
+ */
+static bool built(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast node) {
+    if (node != NULL) return true;
+
+    end_parse(parser, lexer);
+    return false;
 }
 
 /**
@@ -93,17 +150,26 @@ static void maybe_free_token(Ruja_Token *token) {
  * @param lexer The lexer that holds the source file.
  */
 static void advance(Ruja_Parser *parser, Ruja_Lexer *lexer) {
-    if (parser->previous != NULL) maybe_free_token(parser->previous);
+    // The AST keeps its own copies of the tokens it needs
+    if (parser->previous != NULL) release_token(parser, lexer, parser->previous);
 
     parser->previous = parser->current;
+    // Once memory ran out the parse stays at its end
+    if (parser->current == &parser->out_of_memory) return;
 
     while (true) {
         parser->current = next_token(lexer);
 
+        if (parser->current == NULL) {
+            // The lexer reported it. The parse ends here as if the source did
+            end_parse(parser, lexer);
+            break;
+        }
+
         if (parser->current->kind != RUJA_TOK_ERR)
             break;
 
-        token_free(parser->current);
+        token_free(&lexer->allocator, parser->current);
         signal_lexer_error(parser);
     }
 }
@@ -156,8 +222,82 @@ typedef struct {
     Precedence precedence;
 } Parse_Rule;
 
+typedef enum {
+    FRAME_GROUP,         // Waiting for the expression inside '(' ')'
+    FRAME_UNARY,         // Waiting for the operand of a unary operator
+    FRAME_BINARY,        // Waiting for the right operand of a binary operator
+    FRAME_TERNARY_TRUE,  // Waiting for the true branch of a ternary
+    FRAME_TERNARY_FALSE, // Waiting for the false branch of a ternary
+} Parse_Frame_Kind;
+
+// A parse_precedence call suspended while one of its operands is parsed.
+// Compound expressions push a frame instead of recursing, so nesting does not grow the C stack.
+typedef struct {
+    Parse_Frame_Kind kind;
+    Precedence precedence;         // Precedence of the suspended call
+    Ruja_Ast* ast;                 // Where the suspended call stores its result
+    Ruja_Ast* operand;             // Where the pending operand must be stored
+    Precedence operand_precedence; // Precedence the pending operand is parsed with
+} Parse_Frame;
+
+struct _fstack {
+    size_t count;
+    size_t capacity;
+    Parse_Frame *items;
+};
+
+static Frame_Stack* new_frame_stack(const Ruja_Allocator* allocator) {
+    Frame_Stack* stack = ruja_calloc(allocator, 1, sizeof(Frame_Stack));
+    if (stack == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for frame stack.\n");
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void frame_stack_free(const Ruja_Allocator* allocator, Frame_Stack* stack) {
+    if (stack == NULL) {
+        return;
+    }
+
+    ruja_free(allocator, stack->items);
+    ruja_free(allocator, stack);
+}
+
+/**
+ * @brief Suspends the current parse_precedence call until an operand has been parsed.
+ *
+ * @param parser The parser in use
+ * @param kind What to do once the operand has been parsed
+ * @param ast Where the suspended call stores its result
+ * @param operand Where the operand must be stored
+ * @param operand_precedence The precedence the operand is parsed with
+ * @return false If memory ran out. The parse fails and the operand is never parsed.
+ */
+static bool push_frame(Ruja_Parser *parser, Parse_Frame_Kind kind, Ruja_Ast* ast, Ruja_Ast* operand, Precedence operand_precedence) {
+    Frame_Stack* frames = parser->frames;
+    if (frames->count + 1 > frames->capacity) {
+        if (!REALLOC_DA_WITH(&parser->allocator, Parse_Frame, frames)) {
+            parser->had_error = true;
+            parser->panic_mode = true;
+            return false;
+        }
+    }
+
+    frames->items[frames->count++] = (Parse_Frame) {
+        .kind = kind,
+        .precedence = PREC_NONE, // Filled in by parse_precedence
+        .ast = ast,
+        .operand = operand,
+        .operand_precedence = operand_precedence,
+    };
+    return true;
+}
+
 //TODO: Organize these functions better
 static void statements(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb);
+static void block(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb);
 static void statement(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb);
 static void struct_member(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb);
 static void struct_members(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb);
@@ -263,11 +403,11 @@ static Parse_Rule *get_rule(Ruja_Token_Kind kind) {
  * @param lexer The Lexer is use
  */
 static void nil(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    push_type(parser->type_stack, VAR_TYPE_NIL);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_NIL);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -277,11 +417,11 @@ static void nil(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symb
  * @param lexer The Lexer is use
  */
 static void boolean(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
     
-    push_type(parser->type_stack, VAR_TYPE_BOOL);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_BOOL);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -291,11 +431,11 @@ static void boolean(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_
  * @param lexer The Lexer is use
  */
 static void integer(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    push_type(parser->type_stack, VAR_TYPE_I32);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_I32);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -305,11 +445,11 @@ static void integer(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_
  * @param lexer The Lexer is use
  */
 static void floating(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    push_type(parser->type_stack, VAR_TYPE_F64);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_F64);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -319,11 +459,11 @@ static void floating(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja
  * @param lexer The Lexer is use
  */
 static void character(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    push_type(parser->type_stack, VAR_TYPE_CHAR);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_CHAR);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -333,11 +473,11 @@ static void character(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruj
  * @param lexer The Lexer is use
  */
 static void string(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    push_type(parser->type_stack, VAR_TYPE_STRING);
-    (*ast) = ast_new_literal(parser->previous);
+    push_type(parser, VAR_TYPE_STRING);
+    (*ast) = ast_new_literal(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
@@ -347,103 +487,83 @@ static void string(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_S
  * @param lexer The Lexer is use
  */
 static void identifier(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    UNUSED(lexer);
     UNUSED(sb);
 
-    (*ast) = ast_new_identifier(parser->previous);
+    (*ast) = ast_new_identifier(parser->arena, parser->previous);
+    built(parser, lexer, *ast);
 }
 
 /**
  * @brief Parser an expression involved in paren
- * 
+ *
  * @param parser The parser in use
  * @param lexer The lexer in use
  */
 static void grouping(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    expression(parser, lexer, ast, sb);
-    expect(parser, lexer, RUJA_TOK_RPAREN, "Unclosed left parenthesis. Expected ')'");
+    UNUSED(lexer);
+    UNUSED(sb);
+
+    // The inner expression is parsed by parse_precedence, the ')' is expected once it is done
+    push_frame(parser, FRAME_GROUP, ast, ast, PREC_ASSIGNMENT);
 }
 
 /**
  * @brief Parser a unary expression
- * 
+ *
  * @param parser The parser in use
  * @param lexer The lexer in use
  */
 static void unary(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    // assert((parser->previous.kind == RUJA_TOK_NOT || parser->previous.kind == RUJA_TOK_SUB) &&
-    //         "This function assumes that a unary token has been already consumed.");
+    UNUSED(sb);
 
     // Save the previous unary operation
     Ruja_Token* unary_op = parser->previous;
-    Ruja_Ast unary = ast_new_unary_op(unary_op, NULL);
+    Ruja_Ast unary = ast_new_unary_op(parser->arena, unary_op, NULL);
+    (*ast) = unary;
+    if (!built(parser, lexer, unary)) return;
 
     // Parse any following expressions that have equal or higher precedence
-    parse_precedence(parser, lexer, &unary->as.unary_op.expression, sb, PREC_UNARY);
-
-    *ast = unary;
+    push_frame(parser, FRAME_UNARY, ast, &unary->as.unary_op.expression, PREC_UNARY);
 }
 
 /**
  * @brief Parses a binary expression
- * 
+ *
  * @param parser The parser in use
  * @param lexer The lexer in use
  */
 static void binary(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb) {
-    // assert((parser->previous.kind == RUJA_TOK_SUB || parser->previous.kind == RUJA_TOK_ADD ||
-    //         parser->previous.kind == RUJA_TOK_DIV || parser->previous.kind == RUJA_TOK_MUL ||
-    //         parser->previous.kind == RUJA_TOK_AND || parser->previous.kind == RUJA_TOK_OR  ||
-    //         parser->previous.kind == RUJA_TOK_EQ  || parser->previous.kind == RUJA_TOK_NE  ||
-    //         parser->previous.kind == RUJA_TOK_GT  || parser->previous.kind == RUJA_TOK_LT  ||
-    //         parser->previous.kind == RUJA_TOK_GE  || parser->previous.kind == RUJA_TOK_LE) &&
-    //         "This function assumes that a binary token has been already consumed.");
+    UNUSED(sb);
 
     // Save the current binary operation
     Ruja_Token* binary_op = parser->previous;
-    Ruja_Ast binary = ast_new_binary_op(binary_op, *ast, NULL);
+    Ruja_Ast binary = ast_new_binary_op(parser->arena, binary_op, *ast, NULL);
+    if (!built(parser, lexer, binary)) return;
+    (*ast) = binary;
 
     // Parse any following expressions that have higher precedence
     // Since not all binary operations have the same precedence we must search for it
     Precedence binary_op_precedence = get_rule(parser->previous->kind)->precedence;
-    parse_precedence(parser, lexer, &binary->as.binary_op.right_expression, sb, binary_op_precedence + 1);
-
-    (*ast) = binary;
+    push_frame(parser, FRAME_BINARY, ast, &binary->as.binary_op.right_expression, binary_op_precedence + 1);
 }
 
 /**
- * @brief Parses a ternary expression
- * 
+ * @brief Parses a ternary expression. The false branch is scheduled by parse_precedence
+ *      once the true branch and the ':'/'else' have been parsed.
+ *
  * @param parser The parser in use
  * @param lexer The lexer in use
  */
 static void ternary(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
+    UNUSED(sb);
+
     // At this point the ast is the expression branch of the AST_NODE_EXPRESSION node
     // this needs to be changed to the condition branch of the AST_NODE_TERNARY node
-    // assert( parser->previous.kind == RUJA_TOK_QUESTION &&
-    //         "This function assumes that a ternary token has been already consumed.");
-
-    Ruja_Ast ternary = ast_new_ternary_op(parser->previous, NULL, *ast, NULL, NULL);
-
-    expression(parser, lexer, &ternary->as.ternary_op.true_expression, sb);
-
-    // assert( parser->current.kind == RUJA_TOK_COLON &&
-    //         "This function assumes that a ternary token has been already consumed.");
-    Ruja_Token_Kind expected[] = {RUJA_TOK_COLON, RUJA_TOK_ELSE};
-    expect_either(parser, lexer, expected, "Expected ':' or 'else' after ternary operator '?'/'if'");
-    if (!parser->had_error) {
-        // If an error occurred, it means that the previous token was not a colon nor an else
-        // We must not allow the previous token to be in the AST as a tok_ternary.tok_colon
-        // A risk of double free would occur in case the previous token was a literal or identifier
-        // Try with this input: isAlive = name == 1 if y;
-        // The double free should occur in the y token
-        parser->previous->in_ast = true;
-        ternary->as.ternary_op.tok_ternary.tok_colon = parser->previous;
-
-        expression(parser, lexer, &ternary->as.ternary_op.false_expression, sb);
-    }
-
+    Ruja_Ast ternary = ast_new_ternary_op(parser->arena, parser->previous, NULL, *ast, NULL, NULL);
+    if (!built(parser, lexer, ternary)) return;
     (*ast) = ternary;
+
+    push_frame(parser, FRAME_TERNARY_TRUE, ast, &ternary->as.ternary_op.true_expression, PREC_ASSIGNMENT);
 }
 
 /**
@@ -459,74 +579,227 @@ static void expression(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ru
 }
 
 /**
- * @brief Given a Precedence level, it begins by calling the prefix parsing function 
+ * @brief Runs a prefix or infix rule. If the rule suspended the current call to wait for an
+ *      operand, the frame is completed with the precedence of the current call.
+ *
+ * @return true If the rule pushed a frame
+ */
+static bool run_rule(Ruja_Parser *parser, Ruja_Lexer *lexer, Parser_Function rule, Ruja_Ast* ast, Ruja_Symbol_Table* sb, Precedence precedence) {
+    size_t depth = parser->frames->count;
+    rule(parser, lexer, ast, sb);
+    if (parser->frames->count == depth) return false;
+
+    parser->frames->items[parser->frames->count - 1].precedence = precedence;
+    return true;
+}
+
+/**
+ * @brief Given a Precedence level, it begins by calling the prefix parsing function
  *      of the 'parser->previous' token and follows with all the infix parsing functions
  *      of the following Ruja_Token's that have less or equal precedence than the one given.
- * 
+ *
+ *      Operands of compound expressions (groupings, unary, binary and ternary operators) are
+ *      not parsed recursively. Their rules push a Parse_Frame and this loop parses the operand
+ *      right away, resuming the suspended call once it is done. Nesting is therefore bounded
+ *      by parser->max_depth and not by the size of the C stack.
+ *
  * @param parser The parser in use
  * @param lexer The lexer in use
  * @param precedence The level of precedence given by the function caller
  */
 static void parse_precedence(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast* ast, Ruja_Symbol_Table* sb, Precedence precedence) {
-    // At this point in the execution the current token can only be a token that has prefix rules (unary, primary or '(')
-    // Get the current token's prefix rule
-    advance(parser, lexer);
-    Parser_Function prefix_rule = get_rule(parser->previous->kind)->prefix;
-    if (prefix_rule == NULL)
-    {
-        parser_error(parser, lexer, parser->previous, "Expected an expression");
-        return;
+    Frame_Stack* frames = parser->frames;
+    size_t base = frames->count;
+
+    enum {
+        STEP_PREFIX, // Parse a new operand into ast
+        STEP_INFIX,  // Parse the infix operators that follow ast
+        STEP_RESUME, // The current call is finished, resume the last suspended one
+    } step = STEP_PREFIX;
+
+    while (true) {
+        switch (step) {
+            case STEP_PREFIX: {
+                if (frames->count - base >= parser->max_depth) {
+                    parser_error(parser, lexer, parser->current, "Expression is nested too deeply");
+                    step = STEP_RESUME;
+                    break;
+                }
+
+                // At this point in the execution the current token can only be a token that has prefix rules (unary, primary or '(')
+                advance(parser, lexer);
+                Parser_Function prefix_rule = get_rule(parser->previous->kind)->prefix;
+                if (prefix_rule == NULL) {
+                    parser_error(parser, lexer, parser->previous, "Expected an expression");
+                    step = STEP_RESUME;
+                    break;
+                }
+
+                if (run_rule(parser, lexer, prefix_rule, ast, sb, precedence)) {
+                    Parse_Frame* frame = &frames->items[frames->count - 1];
+                    ast = frame->operand;
+                    precedence = frame->operand_precedence;
+                } else {
+                    // Primary expressions consume a single token
+                    step = STEP_INFIX;
+                }
+            } break;
+            case STEP_INFIX: {
+                // Only parse the current token if its precedence is equal or higher than the one of this call
+                if (precedence > get_rule(parser->current->kind)->precedence) {
+                    step = STEP_RESUME;
+                    break;
+                }
+
+                advance(parser, lexer);
+                Parser_Function infix_rule = get_rule(parser->previous->kind)->infix;
+                if (infix_rule == NULL) {
+                    parser_error(parser, lexer, parser->previous, "Expected binary operator");
+                    step = STEP_RESUME;
+                    break;
+                }
+
+                if (run_rule(parser, lexer, infix_rule, ast, sb, precedence)) {
+                    Parse_Frame* frame = &frames->items[frames->count - 1];
+                    ast = frame->operand;
+                    precedence = frame->operand_precedence;
+                    step = STEP_PREFIX;
+                }
+            } break;
+            case STEP_RESUME: {
+                if (frames->count == base) return;
+
+                Parse_Frame frame = frames->items[--frames->count];
+                ast = frame.ast;
+                precedence = frame.precedence;
+                step = STEP_INFIX;
+
+                switch (frame.kind) {
+                    case FRAME_GROUP: {
+                        expect(parser, lexer, RUJA_TOK_RPAREN, "Unclosed left parenthesis. Expected ')'");
+                    } break;
+                    case FRAME_TERNARY_TRUE: {
+                        Ruja_Token_Kind expected[] = {RUJA_TOK_COLON, RUJA_TOK_ELSE};
+                        expect_either(parser, lexer, expected, "Expected ':' or 'else' after ternary operator '?'/'if'");
+                        if (!parser->had_error) {
+                            // If an error occurred, it means that the previous token was not a colon nor an else
+                            // and it must not end up in the AST as a tok_ternary.tok_colon
+                            Ruja_Ast ternary = *frame.ast;
+                            ternary->as.ternary_op.tok_ternary.tok_colon = ast_copy_token(parser->arena, parser->previous);
+
+                            if (ternary->as.ternary_op.tok_ternary.tok_colon == NULL) {
+                                end_parse(parser, lexer);
+                            } else if (push_frame(parser, FRAME_TERNARY_FALSE, frame.ast, &ternary->as.ternary_op.false_expression, PREC_ASSIGNMENT)) {
+                                frames->items[frames->count - 1].precedence = frame.precedence;
+                                ast = &ternary->as.ternary_op.false_expression;
+                                precedence = PREC_ASSIGNMENT;
+                                step = STEP_PREFIX;
+                            }
+                        }
+                    } break;
+                    case FRAME_UNARY:
+                    case FRAME_BINARY:
+                    case FRAME_TERNARY_FALSE:
+                        break;
+                }
+            } break;
+        }
     }
+}
 
-    // Consume the current token since prefix rules expect the token to be in previous
-    // Execute the obtained prefix rule
-    prefix_rule(parser, lexer, ast, sb);
-
-    /*
-    At this point there are 3 possible outcomes that have the same resolution those are.
-
-    1 - The prefix function we performed was the grouping function.
-        Remember that function calls 'expression' so when we get back to this function
-        the entire expression inside parenthesis has been parsed. This means that the
-        the current token may not even be an expression (It can be an EOF or keyword).
-        If this is the case then our expression is finished and therefore we don't want
-        to do anything else. If the current token is part of an expression than it will
-        have an associated precedence. We only want to parse it if its precedence is less
-        or equal to 'precedence' parameter
-
-    2 - The prefix function we performed was the unary function.
-        This means that the token that was read was (so far) either 
-        'not' or '-'. Remember that the function also calls parse_precedence
-        and this time every operation that has equal or higher precedence
-        has already been parsed. Once again, the current token (once we come 
-        back to this function) will be an expression or not. This means that 
-        we also just want to parse the current token if its precedence is equal
-        or higher than the 'precedence' parameter.
-
-    3 - The prefix function we performed was the one of the primary prefix functions
-        (integer, floating, character, string, identifier). These functions only parse
-        one token which means that (once again) we are in the situation that the current
-        token is either an expression in which case it has an associated precedence or it
-        is not an expression and has no precedence whatsoever. We do exactly the same has
-        before and only parse the current token if it has less precedence than the 'precedence'
-        parameter.
-    */
-
-    while (precedence <= get_rule(parser->current->kind)->precedence) {
-        advance(parser, lexer);
-        Parser_Function infix_rule = get_rule(parser->previous->kind)->infix;
-        if (infix_rule == NULL) {
-            parser_error(parser, lexer, parser->previous, "Expected binary operator");
-            return;
+Type token_type(Ruja_Token_Kind kind) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+    switch (kind) {
+        case RUJA_TOK_TYPE_BOOL:   return VAR_TYPE_BOOL;
+        case RUJA_TOK_TYPE_CHAR:   return VAR_TYPE_CHAR;
+        case RUJA_TOK_TYPE_I32:    return VAR_TYPE_I32;
+        case RUJA_TOK_TYPE_F64:    return VAR_TYPE_F64;
+        case RUJA_TOK_TYPE_STRING: return VAR_TYPE_STRING;
+        default:                   return VAR_TYPE_NIL;
+    }
+#pragma GCC diagnostic pop
+}
+
+Type infer_type(Ruja_Ast expression, Ruja_Symbol_Table* sb) {
+    while (expression != NULL) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+        switch (expression->type) {
+            case AST_NODE_EXPRESSION: expression = expression->as.expr.expression; break;
+            case AST_NODE_TERNARY_OP: expression = expression->as.ternary_op.true_expression; break;
+            case AST_NODE_UNARY_OP: {
+                if (expression->as.unary_op.tok_unary->kind == RUJA_TOK_NOT) return VAR_TYPE_BOOL;
+                expression = expression->as.unary_op.expression;
+            } break;
+            case AST_NODE_BINARY_OP: {
+                switch (expression->as.binary_op.tok_binary->kind) {
+                    case RUJA_TOK_EQ: case RUJA_TOK_NE:
+                    case RUJA_TOK_LT: case RUJA_TOK_LE:
+                    case RUJA_TOK_GT: case RUJA_TOK_GE:
+                    case RUJA_TOK_AND: case RUJA_TOK_OR:
+                        return VAR_TYPE_BOOL;
+                    default:
+                        expression = expression->as.binary_op.left_expression;
+                        break;
+                }
+            } break;
+            case AST_NODE_IDENTIFIER: {
+                Ruja_Token* token = expression->as.identifier.tok_identifier;
+                Symbol* symbol = token->interned != NULL ? symbol_table_lookup(sb, token->interned) : NULL;
+                return symbol != NULL ? symbol->as.var.type : VAR_TYPE_NIL;
+            }
+            case AST_NODE_LITERAL: {
+                switch (expression->as.literal.tok_literal->kind) {
+                    case RUJA_TOK_INT:    return VAR_TYPE_I32;
+                    case RUJA_TOK_FLOAT:  return VAR_TYPE_F64;
+                    case RUJA_TOK_CHAR:   return VAR_TYPE_CHAR;
+                    case RUJA_TOK_STRING: return VAR_TYPE_STRING;
+                    case RUJA_TOK_TRUE:
+                    case RUJA_TOK_FALSE:  return VAR_TYPE_BOOL;
+                    default:              return VAR_TYPE_NIL;
+                }
+            }
+            default: return VAR_TYPE_NIL;
         }
-        infix_rule(parser, lexer, ast, sb);
+#pragma GCC diagnostic pop
     }
+
+    return VAR_TYPE_NIL;
+}
+
+/**
+ * @brief Declares a variable in the current scope. Shadowing and redeclaring are allowed,
+ *      the new variable hides the old one until the end of its scope.
+ */
+static void declare_variable(Ruja_Parser *parser, Ruja_Ast identifier, Type type, Ruja_Symbol_Table* sb) {
+    if (parser->had_error || identifier == NULL) return;
+
+    ObjString* key = identifier->as.identifier.tok_identifier->interned;
+    if (key == NULL) return;
+
+    Symbol* symbol = symbol_new_var(&sb->allocator, type, key);
+    if (symbol == NULL || symbol_table_declare(sb, symbol) == SYMBOL_ERROR) {
+        symbol_free(&sb->allocator, symbol);
+        parser->had_error = true;
+    }
+}
+
+/**
+ * @brief Parses the statements of a block, after its '{', in a scope of its own.
+ */
+static void block(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
+    bool scoped = symbol_table_enter_scope(sb);
+    if (!scoped) parser->had_error = true;
+    statements(parser, lexer, ast, sb);
+    if (scoped) symbol_table_exit_scope(sb);
 }
 
 static void typed_declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
     // previous is the identifier and current is the colon
-    Ruja_Token* tok_id = parser->previous;
-    tok_id->in_ast = true; // signal that this token should be in the AST. If something goes wrong it is this function's responsibility to free it
+    // The identifier node must be built before advancing, since advancing frees the token
+    Ruja_Ast identifier = ast_new_identifier(parser->arena, parser->previous);
+    if (!built(parser, lexer, identifier)) return;
     advance(parser, lexer);
 
 #pragma GCC diagnostic push
@@ -544,28 +817,35 @@ static void typed_declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *
             switch (parser->current->kind) {
                 case RUJA_TOK_SEMICOLON: {
                     // This is a typed declaration
-                    *ast = ast_new_typed_decl(parser->previous, ast_new_identifier(tok_id));
+                    *ast = ast_new_typed_decl(parser->arena, parser->previous, identifier);
+                    if (!built(parser, lexer, *ast)) return;
+                    declare_variable(parser, identifier, token_type(parser->previous->kind), sb);
                 } break;
                 case RUJA_TOK_ASSIGN:
                 case RUJA_TOK_ADD_EQ:
                 case RUJA_TOK_SUB_EQ:
                 case RUJA_TOK_MUL_EQ:
-                case RUJA_TOK_DIV_EQ: {
+                case RUJA_TOK_DIV_EQ:
+                case RUJA_TOK_PERCENT_EQ: {
                     // This is a typed declaration with an assignment
-                    *ast = ast_new_typed_decl_assign(parser->previous, parser->current, ast_new_identifier(tok_id), ast_new_expression(NULL));
+                    Type type = token_type(parser->previous->kind);
+                    Ruja_Ast value = ast_new_expression(parser->arena, NULL);
+                    if (!built(parser, lexer, value)) return;
+                    *ast = ast_new_typed_decl_assign(parser->arena, parser->previous, parser->current, identifier, value);
+                    if (!built(parser, lexer, *ast)) return;
                     advance(parser, lexer);
-                    expression(parser, lexer, &(*ast)->as.typed_decl_assign.expression->as.expr.expression, sb);
+                    expression(parser, lexer, &value->as.expr.expression, sb);
+                    // Declared after its initializer, which still sees the variables it may shadow
+                    declare_variable(parser, identifier, type, sb);
                 } break;
                 default: {
                     parser_error(parser, lexer, parser->current, "Expected '=' or ';' after type");
-                    token_free(tok_id);
                     return;
                 } break;
             }
         } break;
         default: {
             parser_error(parser, lexer, parser->current, "Expected type after ':'");
-            token_free(tok_id);
             return;
         } break;
     }
@@ -574,13 +854,18 @@ static void typed_declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *
 
 static void inferred_declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
     // previous is the identifier and current is the equal sign
-    Ruja_Token* tok_id = parser->previous;
-    tok_id->in_ast = true; // signal that this token should be in the AST. If something goes wrong it is this function's responsibility to free it
+    // The identifier node must be built before advancing, since advancing frees the token
+    Ruja_Ast identifier = ast_new_identifier(parser->arena, parser->previous);
+    if (!built(parser, lexer, identifier)) return;
     advance(parser, lexer);
 
     // the next token must be an expression
-    *ast = ast_new_inferred_decl_assign(parser->previous, ast_new_identifier(tok_id), ast_new_expression(NULL));
-    expression(parser, lexer, &(*ast)->as.inferred_decl_assign.expression->as.expr.expression, sb);
+    Ruja_Ast value = ast_new_expression(parser->arena, NULL);
+    if (!built(parser, lexer, value)) return;
+    *ast = ast_new_inferred_decl_assign(parser->arena, parser->previous, identifier, value);
+    if (!built(parser, lexer, *ast)) return;
+    expression(parser, lexer, &value->as.expr.expression, sb);
+    declare_variable(parser, identifier, infer_type(value, sb), sb);
 }
 
 static void declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
@@ -596,7 +881,8 @@ static void declaration(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
             case RUJA_TOK_ADD_EQ:
             case RUJA_TOK_SUB_EQ:
             case RUJA_TOK_MUL_EQ:
-            case RUJA_TOK_DIV_EQ:{
+            case RUJA_TOK_DIV_EQ:
+            case RUJA_TOK_PERCENT_EQ: {
                 // This is an inferred declaration with an assignment
                 inferred_declaration(parser, lexer, ast, sb);
             } break;
@@ -616,10 +902,15 @@ static void assignment(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ru
         case RUJA_TOK_ADD_EQ:
         case RUJA_TOK_SUB_EQ:
         case RUJA_TOK_MUL_EQ:
-        case RUJA_TOK_DIV_EQ: {
-            *ast = ast_new_assign(parser->current, ast_new_identifier(parser->previous), ast_new_expression(NULL));
+        case RUJA_TOK_DIV_EQ:
+        case RUJA_TOK_PERCENT_EQ: {
+            Ruja_Ast identifier = ast_new_identifier(parser->arena, parser->previous);
+            Ruja_Ast value = ast_new_expression(parser->arena, NULL);
+            if (!built(parser, lexer, identifier) || !built(parser, lexer, value)) break;
+            *ast = ast_new_assign(parser->arena, parser->current, identifier, value);
+            if (!built(parser, lexer, *ast)) break;
             advance(parser, lexer);
-            expression(parser, lexer, &(*ast)->as.assign.expression->as.expr.expression, sb);
+            expression(parser, lexer, &value->as.expr.expression, sb);
         } break;
         default: {
             parser_error(parser, lexer, parser->current, "Expected assignment operator");
@@ -629,7 +920,10 @@ static void assignment(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ru
 }
 
 static void else_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast else_ast = ast_new_else_stmt(parser->previous, ast_new_stmt(NULL, NULL));
+    Ruja_Ast body = ast_new_stmt(parser->arena, NULL, NULL);
+    if (!built(parser, lexer, body)) return;
+    Ruja_Ast else_ast = ast_new_else_stmt(parser->arena, parser->previous, body);
+    if (!built(parser, lexer, else_ast)) return;
 
     expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after else keyword");
 
@@ -638,7 +932,7 @@ static void else_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
     if (!parser->had_error) {
         // Parse the body of the else statement
 
-        statements(parser, lexer, &else_ast->as.else_branch.body, sb);
+        block(parser, lexer, &else_ast->as.else_branch.body, sb);
         expect(parser, lexer, RUJA_TOK_RBRACE, "Expected '}' after else body");
     }
 
@@ -646,7 +940,11 @@ static void else_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
 }
 
 static void elif_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast elif_ast = ast_new_elif_stmt(parser->previous, ast_new_expression(NULL), ast_new_stmt(NULL, NULL), NULL);
+    Ruja_Ast condition = ast_new_expression(parser->arena, NULL);
+    Ruja_Ast body = ast_new_stmt(parser->arena, NULL, NULL);
+    if (!built(parser, lexer, condition) || !built(parser, lexer, body)) return;
+    Ruja_Ast elif_ast = ast_new_elif_stmt(parser->arena, parser->previous, condition, body, NULL);
+    if (!built(parser, lexer, elif_ast)) return;
 
     expression(parser, lexer, &elif_ast->as.elif_branch.condition->as.expr.expression, sb);
     expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after elif condition");
@@ -656,7 +954,7 @@ static void elif_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
     if (!parser->had_error) {
         // Parse the body of the elif statement
 
-        statements(parser, lexer, &elif_ast->as.elif_branch.body, sb);
+        block(parser, lexer, &elif_ast->as.elif_branch.body, sb);
         expect(parser, lexer, RUJA_TOK_RBRACE, "Expected '}' after elif body");
 
         // Same thought as before
@@ -684,7 +982,11 @@ static void elif_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
 }
 
 static void if_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast if_ast = ast_new_if_stmt(parser->previous, ast_new_expression(NULL), ast_new_stmt(NULL, NULL), NULL);
+    Ruja_Ast condition = ast_new_expression(parser->arena, NULL);
+    Ruja_Ast body = ast_new_stmt(parser->arena, NULL, NULL);
+    if (!built(parser, lexer, condition) || !built(parser, lexer, body)) return;
+    Ruja_Ast if_ast = ast_new_if_stmt(parser->arena, parser->previous, condition, body, NULL);
+    if (!built(parser, lexer, if_ast)) return;
 
     expression(parser, lexer, &if_ast->as.if_branch.condition->as.expr.expression, sb);
     expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after if condition");
@@ -694,7 +996,7 @@ static void if_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruj
     if (!parser->had_error) {
         // Parse the body of the if statement
 
-        statements(parser, lexer, &if_ast->as.if_branch.body, sb);
+        block(parser, lexer, &if_ast->as.if_branch.body, sb);
         expect(parser, lexer, RUJA_TOK_RBRACE, "Expected '}' after if body");
 
         // Same thought as before
@@ -722,7 +1024,11 @@ static void if_branch(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruj
 }
 
 static void ranged_iter(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast iter_ast = ast_new_ranged_iter(ast_new_expression(NULL), ast_new_expression(NULL), NULL); // Last expr is NULL because it is optional
+    Ruja_Ast start = ast_new_expression(parser->arena, NULL);
+    Ruja_Ast end = ast_new_expression(parser->arena, NULL);
+    if (!built(parser, lexer, start) || !built(parser, lexer, end)) return;
+    Ruja_Ast iter_ast = ast_new_ranged_iter(parser->arena, start, end, NULL); // Last expr is NULL because it is optional
+    if (!built(parser, lexer, iter_ast)) return;
 
     expression(parser, lexer, &iter_ast->as.ranged_iter.start_expr->as.expr.expression, sb);
     expect(parser, lexer, RUJA_TOK_COLON, "Expected ':' after start expression of ranged iter");
@@ -733,7 +1039,8 @@ static void ranged_iter(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
         if (parser->current->kind == RUJA_TOK_COLON) {
             // If there is a third expression, parse it
             advance(parser, lexer);
-            iter_ast->as.ranged_iter.step_expr = ast_new_expression(NULL);
+            iter_ast->as.ranged_iter.step_expr = ast_new_expression(parser->arena, NULL);
+            if (!built(parser, lexer, iter_ast->as.ranged_iter.step_expr)) return;
             expression(parser, lexer, &iter_ast->as.ranged_iter.step_expr->as.expr.expression, sb);
         }
     }
@@ -742,24 +1049,34 @@ static void ranged_iter(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, R
 }
 
 static void for_loop(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast for_ast = ast_new_for_loop(parser->previous, NULL, NULL, ast_new_stmt(NULL, NULL));
+    Ruja_Ast body = ast_new_stmt(parser->arena, NULL, NULL);
+    if (!built(parser, lexer, body)) return;
+    Ruja_Ast for_ast = ast_new_for_loop(parser->arena, parser->previous, NULL, NULL, body);
+    if (!built(parser, lexer, for_ast)) return;
 
     //NOTE: Only accept single identifiers for now
     expect(parser, lexer, RUJA_TOK_ID, "Expected identifier after for keyword");
 
     if (!parser->had_error) {
-        for_ast->as.for_loop.identifier = ast_new_identifier(parser->previous);
+        for_ast->as.for_loop.identifier = ast_new_identifier(parser->arena, parser->previous);
+        built(parser, lexer, for_ast->as.for_loop.identifier);
 
         expect(parser, lexer, RUJA_TOK_IN, "Expected 'in' after identifier");
 
         if (!parser->had_error) {
-            for_ast->as.for_loop.tok_in = parser->previous; parser->previous->in_ast = true;
+            for_ast->as.for_loop.tok_in = ast_copy_token(parser->arena, parser->previous);
+            if (for_ast->as.for_loop.tok_in == NULL) end_parse(parser, lexer);
             
             ranged_iter(parser, lexer, &for_ast->as.for_loop.iter, sb);
             expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after for iter");
 
             if (!parser->had_error) {
+                // The loop variable belongs to the scope of the body
+                bool scoped = symbol_table_enter_scope(sb);
+                if (!scoped) parser->had_error = true;
+                declare_variable(parser, for_ast->as.for_loop.identifier, VAR_TYPE_I32, sb);
                 statements(parser, lexer, &for_ast->as.for_loop.body, sb);
+                if (scoped) symbol_table_exit_scope(sb);
                 expect(parser, lexer, RUJA_TOK_RBRACE, "Expected '}' after for body");
             }
         }
@@ -769,13 +1086,17 @@ static void for_loop(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja
 }
 
 static void while_loop(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast while_ast = ast_new_while_loop(parser->previous, ast_new_expression(NULL), ast_new_stmt(NULL, NULL));
+    Ruja_Ast condition = ast_new_expression(parser->arena, NULL);
+    Ruja_Ast body = ast_new_stmt(parser->arena, NULL, NULL);
+    if (!built(parser, lexer, condition) || !built(parser, lexer, body)) return;
+    Ruja_Ast while_ast = ast_new_while_loop(parser->arena, parser->previous, condition, body);
+    if (!built(parser, lexer, while_ast)) return;
 
     expression(parser, lexer, &while_ast->as.while_loop.condition->as.expr.expression, sb);
     expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after while condition");
 
     if (!parser->had_error) {
-        statements(parser, lexer, &while_ast->as.while_loop.body, sb);
+        block(parser, lexer, &while_ast->as.while_loop.body, sb);
         expect(parser, lexer, RUJA_TOK_RBRACE, "Expected '}' after while body");
     }
 
@@ -785,7 +1106,8 @@ static void while_loop(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ru
 static void struct_member(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
     UNUSED(sb);
 
-    (*ast)->as.struct_member.identifier = ast_new_identifier(parser->previous);
+    (*ast)->as.struct_member.identifier = ast_new_identifier(parser->arena, parser->previous);
+    if (!built(parser, lexer, (*ast)->as.struct_member.identifier)) return;
 
     expect(parser, lexer, RUJA_TOK_COLON, "Expected ':' after struct member identifier");
     if (!parser->had_error) {
@@ -798,7 +1120,8 @@ static void struct_member(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast,
             case RUJA_TOK_TYPE_F64:
             case RUJA_TOK_TYPE_STRING: {
                 advance(parser, lexer);
-                (*ast)->as.struct_member.tok_dtype = parser->previous; parser->previous->in_ast = true;
+                (*ast)->as.struct_member.tok_dtype = ast_copy_token(parser->arena, parser->previous);
+                if ((*ast)->as.struct_member.tok_dtype == NULL) end_parse(parser, lexer);
                 expect(parser, lexer, RUJA_TOK_COMMA, "Expected ',' after struct member");
             } break;
             default: {
@@ -814,27 +1137,30 @@ static void struct_members(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast
     while (parser->current->kind == RUJA_TOK_ID) {
         advance(parser, lexer);
         struct_member(parser, lexer, current, sb);
-        (*current)->as.struct_member.next_member = ast_new_struct_members(NULL, NULL);
+        (*current)->as.struct_member.next_member = ast_new_struct_members(parser->arena, NULL, NULL);
+        if (!built(parser, lexer, (*current)->as.struct_member.next_member)) break;
         current = &(*current)->as.struct_member.next_member;
     }
 
-    // If the last statement was a statement with no next, then we need to free it
+    // The last member is always an empty placeholder. Unlink it, the arena reclaims it
     if ((*current)->as.struct_member.next_member == NULL) {
-        ast_free(*current);
         *current = NULL;
     }
 }
 
 static void struct_definition(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
-    Ruja_Ast struct_ast = ast_new_struct_def(parser->previous, NULL, NULL);
+    Ruja_Ast struct_ast = ast_new_struct_def(parser->arena, parser->previous, NULL, NULL);
+    if (!built(parser, lexer, struct_ast)) return;
 
     expect(parser, lexer, RUJA_TOK_ID, "Expected identifier after struct keyword");
     if (!parser->had_error) {
-        struct_ast->as.struct_def.identifier = ast_new_identifier(parser->previous);
+        struct_ast->as.struct_def.identifier = ast_new_identifier(parser->arena, parser->previous);
+        built(parser, lexer, struct_ast->as.struct_def.identifier);
 
         expect(parser, lexer, RUJA_TOK_LBRACE, "Expected '{' after struct identifier");
         if (!parser->had_error) {
-            struct_ast->as.struct_def.members = ast_new_struct_members(NULL, NULL);
+            struct_ast->as.struct_def.members = ast_new_struct_members(parser->arena, NULL, NULL);
+            if (!built(parser, lexer, struct_ast->as.struct_def.members)) return;
             struct_members(parser, lexer, &struct_ast->as.struct_def.members, sb);
             if (struct_ast->as.struct_def.members == NULL) {
                 parser_error(parser, lexer, parser->current, "Empty struct definition. Expected at least one member");
@@ -884,51 +1210,296 @@ static void statements(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ru
     Ruja_Ast *current = ast;
     while (parser->current->kind != RUJA_TOK_EOF && parser->current->kind != RUJA_TOK_RBRACE) {
         statement(parser, lexer, &(*current)->as.stmts.statement, sb);
-        (*current)->as.stmts.next = ast_new_stmt(NULL, NULL);
+        (*current)->as.stmts.next = ast_new_stmt(parser->arena, NULL, NULL);
+        if (!built(parser, lexer, (*current)->as.stmts.next)) break;
         current = &(*current)->as.stmts.next;
     }
 
-    // If the last statement was a statement with no next, then we need to free it
+    // The last statement is always an empty placeholder. Unlink it, the arena reclaims it
     if ((*current)->as.stmts.next == NULL) {
-        ast_free(*current);
         *current = NULL;
     }
 }
 
-bool parse(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ast *ast, Ruja_Symbol_Table* sb) {
+bool parse(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ir *ir) {
+    // Every node and token copy of the tree lives in the IR's arena
+    parser->arena = ir->arena;
+
     // quick start the parser
     advance(parser, lexer);
 
-    // We know that the root of the AST will be an expression
-    if (*ast == NULL) {
+    // We know that the root of the AST will be a list of statements
+    if (ir->ast == NULL) {
         fprintf(stderr, "Null AST passed to parser\n");
         return false;
     }
-    statements(parser, lexer, ast, sb);
+    statements(parser, lexer, &ir->ast, ir->symbol_table);
     expect(parser, lexer, RUJA_TOK_EOF, "Expected end of file");
-    maybe_free_token(parser->previous);
-    maybe_free_token(parser->current);
+    release_token(parser, lexer, parser->previous);
+    release_token(parser, lexer, parser->current);
+    parser->previous = NULL;
+    parser->current = NULL;
 
     return !parser->had_error;
 }
 
-Ruja_Parser *parser_new() {
-    Ruja_Parser *parser = malloc(sizeof(Ruja_Parser));
+// A slice of the token stream that starts and ends at top-level boundaries
+typedef struct {
+    Ruja_Lexer lexer;   // Hands out the tokens of the piece, then EOF
+    Ruja_Tokens tokens; // Borrows the items of the buffered token stream
+    Ruja_Token follow;  // First token after the piece, where a sequential parse would have seen it end
+    bool last;
+
+    Ruja_Parser* parser;
+    Ruja_Ir* ir;
+    bool ok;
+} Parse_Piece;
+
+typedef struct {
+    Parse_Piece* pieces;
+    size_t count;
+    atomic_size_t next; // Next piece to hand out
+} Parse_Pool;
+
+static size_t default_workers(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t) online : 1;
+}
+
+static void* parse_worker(void* arg) {
+    Parse_Pool* pool = arg;
+
+    while (true) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->count) break;
+
+        Parse_Piece* piece = &pool->pieces[i];
+        piece->ok = parse(piece->parser, &piece->lexer, piece->ir);
+
+        // Tokens the parser never asked for are still owned by the piece
+        for (size_t t = piece->lexer.next; t < piece->tokens.count; t++) {
+            token_free(&piece->lexer.allocator, piece->tokens.items[t]);
+        }
+    }
+
+    return NULL;
+}
+
+size_t parse_split_top_level(Ruja_Tokens* tokens, size_t begin, size_t target, size_t* ends) {
+    size_t count = 0;
+    size_t start = begin;
+    size_t depth = 0;
+
+    for (size_t i = begin; i < tokens->count; i++) {
+        bool boundary = false;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+        switch (tokens->items[i]->kind) {
+            case RUJA_TOK_LBRACE: depth++; break;
+            case RUJA_TOK_RBRACE: {
+                if (depth > 0) depth--;
+                if (depth == 0 && i + 1 < tokens->count) {
+                    Ruja_Token_Kind next = tokens->items[i + 1]->kind;
+                    boundary = next != RUJA_TOK_ELSE && next != RUJA_TOK_ELIF && next != RUJA_TOK_SEMICOLON;
+                }
+            } break;
+            case RUJA_TOK_SEMICOLON: boundary = depth == 0; break;
+            default: break;
+        }
+#pragma GCC diagnostic pop
+
+        if (boundary && i + 1 - start >= target && i + 1 < tokens->count) {
+            ends[count++] = i + 1;
+            start = i + 1;
+        }
+    }
+
+    ends[count++] = tokens->count;
+    return count;
+}
+
+/**
+ * @brief Declares in sb the global variables of a list of top-level statements, in source order.
+ *      A piece infers types against its own table, where the variables of the earlier pieces
+ *      are unknown. Declaring them again once the pieces are merged records the types a
+ *      sequential parse would.
+ */
+static void declare_globals(Ruja_Parser *parser, Ruja_Ast stmts, Ruja_Symbol_Table* sb) {
+    for (Ruja_Ast stmt = stmts; stmt != NULL; stmt = stmt->as.stmts.next) {
+        Ruja_Ast node = stmt->as.stmts.statement;
+        if (node == NULL) continue;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+        switch (node->type) {
+            case AST_NODE_STMT_TYPED_DECL: {
+                declare_variable(parser, node->as.typed_decl.identifier, token_type(node->as.typed_decl.tok_dtype->kind), sb);
+            } break;
+            case AST_NODE_STMT_TYPED_DECL_ASSIGN: {
+                declare_variable(parser, node->as.typed_decl_assign.identifier, token_type(node->as.typed_decl_assign.tok_dtype->kind), sb);
+            } break;
+            case AST_NODE_STMT_INFERRED_DECL_ASSIGN: {
+                Ruja_Ast value = node->as.inferred_decl_assign.expression;
+                declare_variable(parser, node->as.inferred_decl_assign.identifier, infer_type(value, sb), sb);
+            } break;
+            default: break;
+        }
+#pragma GCC diagnostic pop
+    }
+}
+
+bool parse_parallel(Ruja_Parser *parser, Ruja_Lexer *lexer, Ruja_Ir *ir, size_t n_workers) {
+    Ruja_Tokens* tokens = lexer->tokens;
+    if (tokens == NULL) return parse(parser, lexer, ir);
+
+    if (n_workers == 0) n_workers = default_workers();
+    size_t begin = lexer->next;
+    size_t remaining = tokens->count - begin;
+    size_t target = remaining / (n_workers * PARSER_PIECES_PER_WORKER);
+    if (target < PARSER_MIN_PIECE_TOKENS) target = PARSER_MIN_PIECE_TOKENS;
+    if (n_workers <= 1 || remaining < 2 * target) return parse(parser, lexer, ir);
+
+    const Ruja_Allocator* allocator = &parser->allocator;
+    size_t* ends = ruja_alloc(allocator, sizeof(size_t) * (remaining / target + 1));
+    if (ends == NULL) {
+        fprintf(stderr, "Could not allocate memory for parallel parsing\n");
+        return parse(parser, lexer, ir);
+    }
+
+    size_t n_pieces = parse_split_top_level(tokens, begin, target, ends);
+    Parse_Piece* pieces = n_pieces > 1 ? ruja_calloc(allocator, n_pieces, sizeof(Parse_Piece)) : NULL;
+    if (pieces == NULL) {
+        ruja_free(allocator, ends);
+        return parse(parser, lexer, ir);
+    }
+
+    bool ok = true;
+    size_t start = begin;
+    for (size_t i = 0; i < n_pieces; i++) {
+        Parse_Piece* piece = &pieces[i];
+        piece->tokens.count = ends[i] - start;
+        piece->tokens.capacity = piece->tokens.count;
+        piece->tokens.items = tokens->items + start;
+
+        piece->lexer = *lexer;
+        piece->lexer.tokens = &piece->tokens;
+        piece->lexer.next = 0;
+        piece->last = ends[i] == tokens->count;
+        if (!piece->last) {
+            piece->follow = *tokens->items[ends[i]];
+            piece->lexer.line = tokens->items[ends[i] - 1]->line;
+        }
+
+        Ruja_Token* first = tokens->items[start];
+        Ruja_Token* end = tokens->items[ends[i] - 1];
+        piece->parser = parser_new(allocator);
+        piece->ir = ir_new((size_t) (end->start + end->length - first->start), allocator);
+        if (piece->parser == NULL || piece->ir == NULL) {
+            ok = false;
+        } else {
+            piece->parser->defer_errors = true;
+            piece->parser->max_depth = parser->max_depth;
+        }
+
+        start = ends[i];
+    }
+    ruja_free(allocator, ends);
+
+    if (!ok) {
+        for (size_t i = 0; i < n_pieces; i++) {
+            if (pieces[i].parser != NULL) parser_free(pieces[i].parser);
+            ir_free(pieces[i].ir);
+        }
+        ruja_free(allocator, pieces);
+        return parse(parser, lexer, ir);
+    }
+
+    // From now on the pieces own the tokens
+    lexer->next = tokens->count;
+
+    Parse_Pool pool = {.pieces = pieces, .count = n_pieces};
+    atomic_init(&pool.next, 0);
+
+    size_t n_threads = n_workers < n_pieces ? n_workers : n_pieces;
+    pthread_t* threads = ruja_alloc(allocator, sizeof(pthread_t) * n_threads);
+    size_t started = 0;
+    // The calling thread is a worker too
+    for (size_t i = 1; threads != NULL && i < n_threads; i++) {
+        if (pthread_create(&threads[started], NULL, parse_worker, &pool) != 0) break;
+        started++;
+    }
+    parse_worker(&pool);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ruja_free(allocator, threads);
+
+    // Merge in source order. Like the sequential parser only the first error is reported,
+    // everything after it would have been parsed in panic mode.
+    parser->arena = ir->arena;
+    Ruja_Ast* tail = &ir->ast;
+    *tail = NULL;
+    for (size_t i = 0; i < n_pieces; i++) {
+        Parse_Piece* piece = &pieces[i];
+
+        if (!piece->ok && ok) {
+            ok = false;
+            Ruja_Parser* worker = piece->parser;
+            if (worker->deferred_error.msg != NULL) {
+                // A sequential parse would have found the next piece where this one sees EOF
+                Ruja_Token* token = &worker->deferred_error.token;
+                if (token->kind == RUJA_TOK_EOF && !piece->last) token = &piece->follow;
+                report_error(lexer, token, worker->deferred_error.msg);
+            }
+        }
+
+        *tail = piece->ir->ast;
+        declare_globals(parser, *tail, ir->symbol_table);
+        while (*tail != NULL) tail = &(*tail)->as.stmts.next;
+
+        arena_adopt(ir->arena, piece->ir->arena);
+        piece->ir->arena = NULL;
+
+        ir_free(piece->ir);
+        parser_free(piece->parser);
+    }
+    ruja_free(allocator, pieces);
+
+    parser->had_error = parser->had_error || !ok;
+    return !parser->had_error;
+}
+
+Ruja_Parser *parser_new(const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Parser *parser = ruja_alloc(&owner, sizeof(Ruja_Parser));
     if (parser == NULL) {
         fprintf(stderr, "Failed to allocate memory for parser\n");
         return NULL;
     }
 
+    parser->allocator = owner;
     parser->previous = NULL;
     parser->current = NULL;
+    parser->arena = NULL;
     parser->had_error = false;
     parser->panic_mode = false;
-    parser->type_stack = new_type_stack();
+    parser->defer_errors = false;
+    parser->deferred_error.msg = NULL;
+    parser->type_stack = new_type_stack(&owner);
+    parser->frames = new_frame_stack(&owner);
+    parser->max_depth = PARSER_DEFAULT_MAX_DEPTH;
+    if (parser->type_stack == NULL || parser->frames == NULL) {
+        parser_free(parser);
+        return NULL;
+    }
 
     return parser;
 }
 
 void parser_free(Ruja_Parser *parser) {
-    type_stack_free(parser->type_stack);
-    free(parser);
+    Ruja_Allocator allocator = parser->allocator;
+    type_stack_free(&allocator, parser->type_stack);
+    frame_stack_free(&allocator, parser->frames);
+    ruja_free(&allocator, parser);
 }
@@ -0,0 +1,176 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <sys/mman.h>
+
+#include "../includes/slab.h"
+
+// Slots start after the header of their page
+#define SLAB_FIRST_SLOT ((sizeof(Slab_Page) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+
+static size_t size_class(size_t size) {
+    return size == 0 ? 0 : (size - 1) / SLAB_GRANULE;
+}
+
+static Slab_Page* page_of(void* memory) {
+    return (Slab_Page*) ((uintptr_t) memory & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+}
+
+static uint8_t* page_end(Slab_Page* page) {
+    return (uint8_t*) page + SLAB_PAGE_SIZE;
+}
+
+/**
+ * @brief Maps a page aligned on its size: twice as many bytes are mapped and the unaligned
+ *      head and tail are given back.
+ */
+static void* map_page(void) {
+    uint8_t* memory = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    uint8_t* aligned = (uint8_t*) (((uintptr_t) memory + SLAB_PAGE_SIZE - 1) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+    if (aligned > memory) munmap(memory, aligned - memory);
+    munmap(aligned + SLAB_PAGE_SIZE, memory + SLAB_PAGE_SIZE - aligned);
+    return aligned;
+}
+
+static void push_partial(Slab_Class* class, Slab_Page* page) {
+    page->prev_partial = NULL;
+    page->next_partial = class->partial;
+    if (class->partial != NULL) class->partial->prev_partial = page;
+    class->partial = page;
+    page->partial = true;
+}
+
+static void remove_partial(Slab_Class* class, Slab_Page* page) {
+    if (page->prev_partial != NULL) page->prev_partial->next_partial = page->next_partial;
+    else class->partial = page->next_partial;
+    if (page->next_partial != NULL) page->next_partial->prev_partial = page->prev_partial;
+    page->partial = false;
+}
+
+static Slab_Page* new_page(Ruja_Slab* slab, size_t class) {
+    Slab_Page* page = map_page();
+    if (page == NULL) return NULL;
+
+    page->prev = NULL;
+    page->next = slab->pages;
+    if (slab->pages != NULL) slab->pages->prev = page;
+    slab->pages = page;
+
+    page->free = NULL;
+    page->top = (uint8_t*) page + SLAB_FIRST_SLOT;
+    page->slot_size = (class + 1) * SLAB_GRANULE;
+    page->live = 0;
+    push_partial(&slab->classes[class], page);
+
+    slab->classes[class].pages++;
+    slab->stats.pages_mapped++;
+    return page;
+}
+
+static void release_page(Ruja_Slab* slab, size_t class, Slab_Page* page) {
+    if (page->partial) remove_partial(&slab->classes[class], page);
+    if (page->prev != NULL) page->prev->next = page->next;
+    else slab->pages = page->next;
+    if (page->next != NULL) page->next->prev = page->prev;
+
+    munmap(page, SLAB_PAGE_SIZE);
+    slab->classes[class].pages--;
+    slab->stats.pages_released++;
+}
+
+void slab_init(Ruja_Slab* slab, const Ruja_Allocator* allocator) {
+    *slab = (Ruja_Slab) {0};
+    slab->allocator = allocator != NULL ? allocator : &ruja_default_allocator;
+}
+
+void slab_free(Ruja_Slab* slab) {
+    Slab_Page* page = slab->pages;
+    while (page != NULL) {
+        Slab_Page* next = page->next;
+        munmap(page, SLAB_PAGE_SIZE);
+        page = next;
+    }
+    slab_init(slab, slab->allocator);
+}
+
+void* slab_alloc(Ruja_Slab* slab, size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        void* memory = ruja_alloc(slab->allocator, size);
+        if (memory == NULL) return NULL;
+        slab->stats.large_objects++;
+        slab->stats.large_bytes += size;
+        return memory;
+    }
+
+    size_t class = size_class(size);
+    Slab_Class* slabs = &slab->classes[class];
+    Slab_Page* page = slabs->partial;
+    if (page == NULL) {
+        page = new_page(slab, class);
+        if (page == NULL) return NULL;
+    }
+
+    void* slot = NULL;
+    if (page->free != NULL) {
+        slot = page->free;
+        page->free = *(void**) slot;
+    } else {
+        slot = page->top;
+        page->top += page->slot_size;
+    }
+    page->live++;
+    slabs->live++;
+
+    if (page->free == NULL && page->top + page->slot_size > page_end(page)) remove_partial(slabs, page);
+    return slot;
+}
+
+void slab_release(Ruja_Slab* slab, void* memory, size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        ruja_free(slab->allocator, memory);
+        slab->stats.large_objects--;
+        slab->stats.large_bytes -= size;
+        return;
+    }
+
+    size_t class = size_class(size);
+    Slab_Class* slabs = &slab->classes[class];
+    Slab_Page* page = page_of(memory);
+    *(void**) memory = page->free;
+    page->free = memory;
+    page->live--;
+    slabs->live--;
+
+    if (page->live == 0 && (slabs->partial != page || page->next_partial != NULL)) {
+        // Another page of the class has room, this one can go
+        release_page(slab, class, page);
+        return;
+    }
+    if (!page->partial) push_partial(slabs, page);
+}
+
+void slab_print_stats(FILE* stream, const Ruja_Slab* slab) {
+    size_t pages = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        pages += slab->classes[i].pages;
+        used += slab->classes[i].live * (i + 1) * SLAB_GRANULE;
+    }
+
+    fprintf(stream, "Slab: %zu pages of %d KB (%zu mapped, %zu released)\n",
+        pages, SLAB_PAGE_SIZE / 1024, slab->stats.pages_mapped, slab->stats.pages_released);
+    fprintf(stream, "  occupancy: %zu bytes in slots, %.1f%% of the pages\n",
+        used, pages > 0 ? 100.0 * (double) used / (double) (pages * SLAB_PAGE_SIZE) : 0.0);
+    fprintf(stream, "  large:     %zu bytes in %zu objects\n", slab->stats.large_bytes, slab->stats.large_objects);
+
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        const Slab_Class* class = &slab->classes[i];
+        if (class->pages == 0) continue;
+
+        size_t slot_size = (i + 1) * SLAB_GRANULE;
+        size_t slots_per_page = (SLAB_PAGE_SIZE - SLAB_FIRST_SLOT) / slot_size;
+        fprintf(stream, "    %4zu B: %8zu live in %4zu pages, %5.1f%% full\n",
+            slot_size, class->live, class->pages, 100.0 * (double) class->live / (double) (class->pages * slots_per_page));
+    }
+}
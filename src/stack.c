@@ -5,8 +5,9 @@
 #include "../includes/memory.h"
 
 
-Stack *stack_new() {
-    Stack* stack = malloc(sizeof(Stack));
+Stack *stack_new(const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Stack* stack = ruja_alloc(&owner, sizeof(Stack));
     if (stack == NULL) {
         fprintf(stderr, "Could not allocate memory for stack\n");
         return NULL;
@@ -15,18 +16,20 @@ Stack *stack_new() {
     stack->count = 0;
     stack->capacity = 0;
     stack->items = NULL;
+    stack->allocator = owner;
 
     return stack;
 }
 
 void stack_free(Stack *stack) {
-    free(stack->items);
-    free(stack);
+    Ruja_Allocator allocator = stack->allocator;
+    ruja_free(&allocator, stack->items);
+    ruja_free(&allocator, stack);
 }
 
 Word* stack_push(Stack* stack, Word word) {
     if (stack->count >= stack->capacity) {
-        REALLOC_DA(Word, stack);
+        if (!REALLOC_DA_WITH(&stack->allocator, Word, stack)) return NULL;
     }
 
     stack->items[stack->count] = word;
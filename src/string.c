@@ -4,61 +4,174 @@
 
 #include "../includes/string.h"
 
-ObjString* obj_string_new(const char* chars, size_t length) {
-    ObjString* obj = malloc(sizeof(ObjString));
-    if (obj == NULL) {
-        fprintf(stderr, "Could not allocate memory for object\n");
-        return NULL;
-    }
-
-    obj->obj.type = OBJ_STRING;
+ObjString* string_init_into(void* memory, size_t length) {
+    ObjString* obj = memory;
+    object_init(&obj->obj, OBJ_STRING, GC_WHITE);
     obj->length = length;
-    obj->chars = malloc(length + 1);
-    if (obj->chars == NULL) {
-        fprintf(stderr, "Could not allocate memory for object chars\n");
-        free(obj);
-        return NULL;
-    }
-
-    memcpy(obj->chars, chars, length);
+    obj->hash = 0;
+    obj->interned = false;
     obj->chars[length] = '\0';
 
     return obj;
 }
 
-ObjString* obj_string_new_no_alloc(char* chars, size_t length) {
-    ObjString* obj = malloc(sizeof(ObjString));
-    if (obj == NULL) {
-        fprintf(stderr, "Could not allocate memory for object\n");
-        return NULL;
-    }
+ObjString* obj_string_alloc(Ruja_Slab* slab, size_t length) {
+    void* memory = object_alloc(slab, sizeof(ObjString) + length + 1);
+    if (memory == NULL) return NULL;
 
-    obj->obj.type = OBJ_STRING;
-    obj->length = length;
-    obj->chars = chars;
+    return string_init_into(memory, length);
+}
+
+ObjString* obj_string_new(Ruja_Slab* slab, const char* chars, size_t length) {
+    ObjString* obj = obj_string_alloc(slab, length);
+    if (obj == NULL) return NULL;
 
+    memcpy(obj->chars, chars, length);
     return obj;
 }
 
-ObjString* string_add(ObjString* string1, ObjString* string2) {
-    size_t length = string1->length + string2->length;
-    char* chars = malloc(length + 1);
-    if (chars == NULL) {
-        fprintf(stderr, "Could not allocate memory for string chars\n");
-        return NULL;
-    }
+ObjString* string_add(Ruja_Slab* slab, ObjString* string1, ObjString* string2) {
+    ObjString* obj = obj_string_alloc(slab, string1->length + string2->length);
+    if (obj == NULL) return NULL;
 
-    memcpy(chars, string1->chars, string1->length);
-    memcpy(chars + string1->length, string2->chars, string2->length);
-    chars[length] = '\0';
+    memcpy(obj->chars, string1->chars, string1->length);
+    memcpy(obj->chars + string1->length, string2->chars, string2->length);
 
-    return obj_string_new_no_alloc(chars, length);
+    return obj;
+}
+
+ObjString* string_concat_into(void* memory, const char* chars1, size_t length1, const char* chars2, size_t length2) {
+    ObjString* obj = string_init_into(memory, length1 + length2);
+    memcpy(obj->chars, chars1, length1);
+    memcpy(obj->chars + length1, chars2, length2);
+
+    return obj;
 }
 
 bool string_equal(ObjString* string1, ObjString* string2) {
+    if (string1 == string2) return true;
+    // Interned strings are unique by content
+    if (string1->interned && string2->interned) return false;
+
     if (string1->length != string2->length) {
         return false;
     }
+    // Hashes are only compared once both are known, equality does not compute them
+    if (string1->hash != 0 && string2->hash != 0 && string1->hash != string2->hash) {
+        return false;
+    }
 
     return memcmp(string1->chars, string2->chars, string1->length) == 0;
-}
\ No newline at end of file
+}
+
+bool string_words_equal(Word word1, Word word2) {
+    if (word1 == word2) return true;
+    if (IS_SSTR(word1) && IS_SSTR(word2)) return false;
+    if (IS_ROPE(word1)) word1 = MAKE_OBJECT(AS_ROPE(word1)->flat);
+    if (IS_ROPE(word2)) word2 = MAKE_OBJECT(AS_ROPE(word2)->flat);
+    if (IS_STRING(word1) && IS_STRING(word2)) return string_equal(AS_STRING(word1), AS_STRING(word2));
+
+    // A view, or a small string and a heap one, which only happens for heap strings made
+    // outside of the vm
+    char buffer1[SSTR_MAX + 1];
+    char buffer2[SSTR_MAX + 1];
+    size_t length1, length2;
+    const char* chars1 = string_word_chars(word1, buffer1, &length1);
+    const char* chars2 = string_word_chars(word2, buffer2, &length2);
+    return length1 == length2 && memcmp(chars1, chars2, length1) == 0;
+}
+
+uint64_t hash_chars(const char* chars, size_t length) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) chars[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+ObjStringView* obj_string_view_new(Ruja_Slab* slab, ObjString* parent, size_t offset, size_t length) {
+    ObjStringView* view = object_alloc(slab, sizeof(ObjStringView));
+    if (view == NULL) return NULL;
+
+    object_init(&view->obj, OBJ_STRING_VIEW, GC_WHITE);
+    view->length = length;
+    view->offset = offset;
+    view->parent = parent;
+
+    return view;
+}
+
+static size_t rope_depth(Word word) {
+    return IS_ROPE(word) ? AS_ROPE(word)->depth : 0;
+}
+
+ObjRope* obj_rope_new(Ruja_Slab* slab, Word left, Word right) {
+    ObjRope* rope = object_alloc(slab, sizeof(ObjRope));
+    if (rope == NULL) return NULL;
+
+    object_init(&rope->obj, OBJ_ROPE, GC_WHITE);
+    rope->length = string_word_length(left) + string_word_length(right);
+    size_t depth = rope_depth(left) > rope_depth(right) ? rope_depth(left) : rope_depth(right);
+    rope->depth = depth + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+
+    return rope;
+}
+
+/**
+ * @brief Walks the leaves of a rope in order. A leaf is any string value that is not a rope
+ *      still holding its children.
+ */
+#define ROPE_WALK(rope, leaf, body) \
+    do { \
+        Word pending[ROPE_MAX_DEPTH + 2]; \
+        size_t n_pending = 0; \
+        pending[n_pending++] = MAKE_OBJECT(rope); \
+        while (n_pending > 0) { \
+            Word leaf = pending[--n_pending]; \
+            if (IS_ROPE(leaf) && AS_ROPE(leaf)->flat == NULL) { \
+                pending[n_pending++] = AS_ROPE(leaf)->right; \
+                pending[n_pending++] = AS_ROPE(leaf)->left; \
+                continue; \
+            } \
+            body \
+        } \
+    } while (0)
+
+void rope_pieces(ObjRope* rope, Rope_Piece piece, void* ctx) {
+    ROPE_WALK(rope, leaf, {
+        char buffer[SSTR_MAX + 1];
+        size_t length;
+        const char* chars = string_word_chars(leaf, buffer, &length);
+        piece(chars, length, ctx);
+    });
+}
+
+size_t rope_leaves(ObjRope* rope, Word* leaves) {
+    size_t count = 0;
+    ROPE_WALK(rope, leaf, {
+        if (leaves != NULL) leaves[count] = leaf;
+        count++;
+    });
+    return count;
+}
+
+static void copy_piece(const char* chars, size_t length, void* ctx) {
+    char** at = ctx;
+    memcpy(*at, chars, length);
+    *at += length;
+}
+
+void rope_flatten_into(ObjRope* rope, ObjString* flat) {
+    char* at = flat->chars;
+    rope_pieces(rope, copy_piece, &at);
+
+    rope->flat = flat;
+    rope->depth = 0;
+    rope->left = MAKE_NIL();
+    rope->right = MAKE_NIL();
+}
@@ -3,10 +3,15 @@
 #include <string.h>
 
 #include "../includes/symbol_table.h"
+#include "../includes/memory.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-Symbol *symbol_new_var(Type type, char *name, size_t name_length) {
-    Symbol *symbol = malloc(sizeof(Symbol));
+
+Symbol *symbol_new_var(const Ruja_Allocator *allocator, Type type, ObjString *name) {
+    Symbol *symbol = ruja_alloc(allocator, sizeof(Symbol));
     if (symbol == NULL) {
         fprintf(stderr, "Error: Could not allocate memory for symbol var.\n");
         return NULL;
@@ -14,13 +19,15 @@ Symbol *symbol_new_var(Type type, char *name, size_t name_length) {
 
     symbol->type = SYMBOL_VAR;
     symbol->key = name;
-    symbol->key_length = name_length;
+    symbol->depth = 0;
+    symbol->shadowed = NULL;
     symbol->as.var.type = type;
+    symbol->as.var.slot = 0;
 
     return symbol;
 }
 
-void symbol_free(Symbol *symbol) {
+void symbol_free(const Ruja_Allocator *allocator, Symbol *symbol) {
     if (symbol == NULL) {
         return;
     }
@@ -29,7 +36,7 @@ void symbol_free(Symbol *symbol) {
         case SYMBOL_VAR: break; // Nothing to free
     }
 
-    free(symbol);
+    ruja_free(allocator, symbol);
 }
 
 void symbol_print(Symbol *symbol) {
@@ -49,23 +56,184 @@ void symbol_print(Symbol *symbol) {
                 case VAR_TYPE_F64: printf("f64,"); break;
                 case VAR_TYPE_STRING: printf("string,"); break;
             }
-            printf("%.*s)\n", (int) symbol->key_length, symbol->key);
+            printf("%.*s)\n", (int) symbol->key->length, symbol->key->chars);
             break;
         }
     }
 }
 
 
-Ruja_Symbol_Table *symbol_table_new(size_t capacity) {
-    Ruja_Symbol_Table *symbol_table = malloc(sizeof(Ruja_Symbol_Table));
+/**
+ * @brief Returns a bit mask with a bit set for every slot of the group at ctrl whose control
+ *      byte is equal to byte.
+ */
+#if defined(__SSE2__)
+static inline uint32_t group_match(const int8_t *ctrl, int8_t byte) {
+    __m128i group = _mm_load_si128((const __m128i *) ctrl);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+}
+
+// Empty and deleted slots are the only ones with the high bit set
+static inline uint32_t group_match_free(const int8_t *ctrl) {
+    return (uint32_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) ctrl));
+}
+#else
+static inline uint32_t group_match(const int8_t *ctrl, int8_t byte) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < SYMBOL_TABLE_GROUP_WIDTH; i++) {
+        mask |= (uint32_t) (ctrl[i] == byte) << i;
+    }
+    return mask;
+}
+
+static inline uint32_t group_match_free(const int8_t *ctrl) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < SYMBOL_TABLE_GROUP_WIDTH; i++) {
+        mask |= (uint32_t) (ctrl[i] < 0) << i;
+    }
+    return mask;
+}
+#endif
+
+static inline int8_t fingerprint(uint64_t hash) {
+    return (int8_t) (hash & 0x7F);
+}
+
+// First group of the probe sequence. The fingerprint bits are left out
+static inline size_t first_group(uint64_t hash, size_t capacity) {
+    return (size_t) (hash >> 7) & (capacity - 1) & ~(size_t) (SYMBOL_TABLE_GROUP_WIDTH - 1);
+}
+
+static bool symbol_table_alloc(Ruja_Symbol_Table *symbol_table, size_t capacity) {
+    // A single block: the hashes, the symbols and the control bytes. These are loaded a group
+    // at a time and stay aligned to a group, the two arrays before them take 16 bytes a slot
+    uint8_t *block = ruja_alloc(&symbol_table->allocator, (sizeof(uint64_t) + sizeof(Symbol*) + 1) * capacity);
+    if (block == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for symbol table of %zu slots.\n", capacity);
+        return false;
+    }
+    uint64_t *hashes = (uint64_t*) block;
+    Symbol **symbols = (Symbol**) (block + sizeof(uint64_t) * capacity);
+    int8_t *ctrl = (int8_t*) (block + (sizeof(uint64_t) + sizeof(Symbol*)) * capacity);
+    memset(ctrl, SYMBOL_CTRL_EMPTY, capacity);
+
+    symbol_table->count = 0;
+    symbol_table->capacity = capacity;
+    symbol_table->tombstones = 0;
+    symbol_table->ctrl = ctrl;
+    symbol_table->hashes = hashes;
+    symbol_table->symbols = symbols;
+    return true;
+}
+
+/**
+ * @brief Smallest valid capacity that holds count symbols under the maximum load factor of 7/8.
+ */
+static size_t capacity_for(size_t count) {
+    size_t capacity = SYMBOL_TABLE_GROUP_WIDTH;
+    while (capacity - capacity / 8 < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/**
+ * @brief Stores a symbol in the first free slot of its probe sequence. There must be one and
+ *      the key must not be in the table already.
+ */
+static void insert_slot(Ruja_Symbol_Table *symbol_table, uint64_t hash, Symbol *symbol) {
+    size_t mask = symbol_table->capacity - 1;
+    size_t group = first_group(hash, symbol_table->capacity);
+
+    // Triangular probing over the groups visits all of them
+    for (size_t step = SYMBOL_TABLE_GROUP_WIDTH; ; step += SYMBOL_TABLE_GROUP_WIDTH) {
+        uint32_t free_slots = group_match_free(symbol_table->ctrl + group);
+        if (free_slots != 0) {
+            size_t slot = group + (size_t) __builtin_ctz(free_slots);
+            if (symbol_table->ctrl[slot] == SYMBOL_CTRL_DELETED) symbol_table->tombstones--;
+            symbol_table->ctrl[slot] = fingerprint(hash);
+            symbol_table->hashes[slot] = hash;
+            symbol_table->symbols[slot] = symbol;
+            symbol_table->count++;
+            return;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+/**
+ * @brief Returns the slot of key or the capacity of the table if it is not there.
+ */
+static size_t find_slot(Ruja_Symbol_Table *symbol_table, ObjString *key) {
+    uint64_t hash = key->hash;
+    int8_t fp = fingerprint(hash);
+    size_t mask = symbol_table->capacity - 1;
+    size_t group = first_group(hash, symbol_table->capacity);
+
+    for (size_t step = SYMBOL_TABLE_GROUP_WIDTH; ; step += SYMBOL_TABLE_GROUP_WIDTH) {
+        const int8_t *ctrl = symbol_table->ctrl + group;
+
+        uint32_t matches = group_match(ctrl, fp);
+        while (matches != 0) {
+            size_t slot = group + (size_t) __builtin_ctz(matches);
+            if (symbol_table->hashes[slot] == hash && symbol_table->symbols[slot]->key == key) {
+                return slot;
+            }
+            matches &= matches - 1;
+        }
+
+        // An empty slot ends the probe sequence: the key would have been stored there
+        if (group_match(ctrl, SYMBOL_CTRL_EMPTY) != 0) return symbol_table->capacity;
+        group = (group + step) & mask;
+    }
+}
+
+static void remove_slot(Ruja_Symbol_Table *symbol_table, size_t slot) {
+    // A group that still has an empty slot has never been full, so no probe sequence goes
+    // past it and the slot can be empty again. Otherwise it must stay a tombstone.
+    const int8_t *group = symbol_table->ctrl + (slot & ~(size_t) (SYMBOL_TABLE_GROUP_WIDTH - 1));
+    if (group_match(group, SYMBOL_CTRL_EMPTY) != 0) {
+        symbol_table->ctrl[slot] = SYMBOL_CTRL_EMPTY;
+    } else {
+        symbol_table->ctrl[slot] = SYMBOL_CTRL_DELETED;
+        symbol_table->tombstones++;
+    }
+    symbol_table->count--;
+}
+
+/**
+ * @brief Makes room for one more key, growing or just dropping the tombstones.
+ *
+ * @return false If memory ran out, the table is left as it was.
+ */
+static bool reserve_slot(Ruja_Symbol_Table *symbol_table) {
+    size_t capacity = symbol_table->capacity;
+    size_t limit = capacity - capacity / 8;
+    if (symbol_table->count + symbol_table->tombstones + 1 <= limit) return true;
+
+    bool crowded = symbol_table->count + 1 > limit / 2;
+    return symbol_table_resize(symbol_table, crowded ? capacity * 2 : capacity);
+}
+
+Ruja_Symbol_Table *symbol_table_new(size_t capacity, const Ruja_Allocator *allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Symbol_Table *symbol_table = ruja_alloc(&owner, sizeof(Ruja_Symbol_Table));
     if (symbol_table == NULL) {
         fprintf(stderr, "Error: Could not allocate memory for symbol table.\n");
         return NULL;
     }
 
-    symbol_table->count = 0;
-    symbol_table->capacity = capacity;
-    symbol_table->symbols = calloc(capacity, sizeof(Symbol*));
+    symbol_table->allocator = owner;
+    if (!symbol_table_alloc(symbol_table, capacity_for(capacity))) {
+        ruja_free(&owner, symbol_table);
+        return NULL;
+    }
+    symbol_table->undo.count = 0;
+    symbol_table->undo.capacity = 0;
+    symbol_table->undo.items = NULL;
+    symbol_table->scopes.count = 0;
+    symbol_table->scopes.capacity = 0;
+    symbol_table->scopes.items = NULL;
 
     return symbol_table;
 }
@@ -76,14 +244,22 @@ void symbol_table_free(Ruja_Symbol_Table *symbol_table) {
     }
 
     for (size_t i = 0; i < symbol_table->capacity; i++) {
-        if (symbol_table->symbols[i] != NULL) {
-            symbol_free(symbol_table->symbols[i]);
-            symbol_table->symbols[i] = NULL;
+        if (symbol_table->ctrl[i] < 0) continue;
+
+        Symbol *symbol = symbol_table->symbols[i];
+        while (symbol != NULL) {
+            Symbol *shadowed = symbol->shadowed;
+            symbol_free(&symbol_table->allocator, symbol);
+            symbol = shadowed;
         }
     }
 
-    free(symbol_table->symbols);
-    free(symbol_table);
+    // Every symbol of the undo log is in a slot or a shadow chain
+    Ruja_Allocator allocator = symbol_table->allocator;
+    ruja_free(&allocator, symbol_table->undo.items);
+    ruja_free(&allocator, symbol_table->scopes.items);
+    ruja_free(&allocator, symbol_table->hashes);
+    ruja_free(&allocator, symbol_table);
 }
 
 void symbol_table_print(Ruja_Symbol_Table *symbol_table) {
@@ -94,67 +270,87 @@ void symbol_table_print(Ruja_Symbol_Table *symbol_table) {
     printf("Symbol Table: {\n");
     for (size_t i = 0; i < symbol_table->capacity; i++) {
         printf("  [%zu]: ", i);
-        symbol_print(symbol_table->symbols[i]);
+        symbol_print(symbol_table->ctrl[i] >= 0 ? symbol_table->symbols[i] : NULL);
     }
     printf("}\n");
 }
 
-static size_t hash(char *str, size_t len) {
-    size_t hash = 5381;
+bool symbol_table_resize(Ruja_Symbol_Table *symbol_table, size_t new_capacity) {
+    Ruja_Symbol_Table old = *symbol_table;
+    size_t capacity = capacity_for(old.count);
+    while (capacity < new_capacity) {
+        capacity *= 2;
+    }
+    if (!symbol_table_alloc(symbol_table, capacity)) {
+        return false;
+    }
 
-    while (len--)
-         hash = ((hash << 5) + hash) + *str++; /* hash * 33 + c */
+    // The cached hashes spare a trip to every key
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] >= 0) {
+            insert_slot(symbol_table, old.hashes[i], old.symbols[i]);
+        }
+    }
 
-    return hash;
+    ruja_free(&symbol_table->allocator, old.hashes);
+    return true;
 }
 
-void symbol_table_resize(Ruja_Symbol_Table *symbol_table, size_t new_capacity) {
-    Symbol **new_symbols = calloc(new_capacity, sizeof(Symbol*));
-    Symbol **old_symbols = symbol_table->symbols;
-    size_t old_capacity = symbol_table->capacity;
-    symbol_table->symbols = new_symbols;
+Symbol_Status symbol_table_declare(Ruja_Symbol_Table *symbol_table, Symbol *symbol) {
+    Symbol_Status status = SYMBOL_DECLARED;
+    symbol->depth = symbol_table->scopes.count;
+    symbol->shadowed = NULL;
 
-    symbol_table->count = 0;
-    symbol_table->capacity = new_capacity;
-    for (size_t i = 0; i < old_capacity; i++) {
-        if (old_symbols[i] != NULL) {
-            symbol_table_insert(symbol_table, old_symbols[i]);
-        }
+    // Room is made before anything changes, so running out of memory leaves the table as it was
+    // Global symbols live as long as the table, the others are logged for their scope
+    if (symbol->depth > 0 && symbol_table->undo.count >= symbol_table->undo.capacity) {
+        if (!REALLOC_DA_WITH(&symbol_table->allocator, Symbol*, (&symbol_table->undo))) return SYMBOL_ERROR;
     }
 
-    free(old_symbols);
+    size_t slot = find_slot(symbol_table, symbol->key);
+    if (slot < symbol_table->capacity) {
+        // Same key, same slot. The symbol it hides comes back when its scope is left
+        symbol->shadowed = symbol_table->symbols[slot];
+        symbol_table->symbols[slot] = symbol;
+        status = symbol->shadowed->depth == symbol->depth ? SYMBOL_REDECLARED : SYMBOL_SHADOWS;
+    } else {
+        if (!reserve_slot(symbol_table)) return SYMBOL_ERROR;
+        insert_slot(symbol_table, symbol->key->hash, symbol);
+    }
+
+    if (symbol->depth > 0) symbol_table->undo.items[symbol_table->undo.count++] = symbol;
+
+    return status;
 }
 
-void symbol_table_insert(Ruja_Symbol_Table *symbol_table, Symbol *symbol) {
-    if (symbol_table->count >= symbol_table->capacity) {
-        symbol_table_resize(symbol_table, symbol_table->capacity * 2);
-    }
+Symbol_Status symbol_table_insert(Ruja_Symbol_Table *symbol_table, Symbol *symbol) {
+    return symbol_table_declare(symbol_table, symbol);
+}
 
-    size_t hash_value = hash(symbol->key, symbol->key_length) % symbol_table->capacity;
+Symbol *symbol_table_lookup(Ruja_Symbol_Table *symbol_table, ObjString *key) {
+    size_t slot = find_slot(symbol_table, key);
+    return slot < symbol_table->capacity ? symbol_table->symbols[slot] : NULL;
+}
 
-    int i = 1;
-    while (symbol_table->symbols[hash_value] != NULL) {
-        hash_value = (hash_value + i * i) % symbol_table->capacity;
-        i++;
+bool symbol_table_enter_scope(Ruja_Symbol_Table *symbol_table) {
+    if (symbol_table->scopes.count >= symbol_table->scopes.capacity) {
+        if (!REALLOC_DA_WITH(&symbol_table->allocator, size_t, (&symbol_table->scopes))) return false;
     }
-
-    symbol_table->symbols[hash_value] = symbol;
-    symbol_table->count++;
+    symbol_table->scopes.items[symbol_table->scopes.count++] = symbol_table->undo.count;
+    return true;
 }
 
-Symbol *symbol_table_lookup(Ruja_Symbol_Table *symbol_table, char *key, size_t key_length) {
-    size_t hash_value = hash(key, key_length) % symbol_table->capacity;
+void symbol_table_exit_scope(Ruja_Symbol_Table *symbol_table) {
+    if (symbol_table->scopes.count == 0) return;
 
-    int i = 1;
-    while (symbol_table->symbols[hash_value] != NULL) {
-        if (symbol_table->symbols[hash_value]->key_length == key_length &&
-            strncmp(symbol_table->symbols[hash_value]->key, key, key_length) == 0) {
-            return symbol_table->symbols[hash_value];
-        }
+    // Undo in reverse order, so every symbol is the innermost one of its key when it is undone
+    size_t mark = symbol_table->scopes.items[--symbol_table->scopes.count];
+    while (symbol_table->undo.count > mark) {
+        Symbol *symbol = symbol_table->undo.items[--symbol_table->undo.count];
+        size_t slot = find_slot(symbol_table, symbol->key);
 
-        hash_value = (hash_value + i * i) % symbol_table->capacity;
-        i++;
+        if (symbol->shadowed != NULL) symbol_table->symbols[slot] = symbol->shadowed;
+        else remove_slot(symbol_table, slot);
+        symbol_free(&symbol_table->allocator, symbol);
     }
-
-    return NULL;
-}
\ No newline at end of file
+}
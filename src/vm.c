@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <string.h>
 
 #include "../includes/vm.h"
 #include "../includes/objects.h"
@@ -9,50 +10,60 @@
 #include "../includes/memory.h"
 
 
-Ruja_Vm *vm_new() {
-    Bytecode *bytecode = bytecode_new();
-    if (bytecode == NULL) return NULL;
-
-    Stack *stack = stack_new();
-    if (stack == NULL) {
-        bytecode_free(bytecode);
+Ruja_Vm *vm_new(const Ruja_Allocator* allocator) {
+    Ruja_Allocator owner = allocator_or_default(allocator);
+    Ruja_Vm *vm = ruja_alloc(&owner, sizeof(Ruja_Vm));
+    if (vm == NULL) {
+        fprintf(stderr, "Could not allocate memory for vm\n");
         return NULL;
     }
+    // The gc and the slab keep a pointer to it
+    vm->allocator = owner;
 
-    Ruja_Vm *vm = malloc(sizeof(Ruja_Vm));
-    if (vm == NULL) {
-        bytecode_free(bytecode);
-        stack_free(stack);
+    vm->bytecode = bytecode_new(&owner);
+    vm->stack = stack_new(&owner);
+    if (vm->bytecode == NULL || vm->stack == NULL) {
+        if (vm->bytecode != NULL) bytecode_free(vm->bytecode);
+        if (vm->stack != NULL) stack_free(vm->stack);
+        ruja_free(&owner, vm);
         return NULL;
     }
 
-    vm->bytecode = bytecode;
-    vm->stack = stack;
     vm->objects = NULL;
+    gc_init(vm, GC_DEFAULT_CONFIG);
+    vm->globals = NULL;
+    vm->n_globals = 0;
     vm->sp = NULL;
     vm->ip = NULL;
 
     return vm;
 }
 
-static void objects_free(Object* obj) {
-    while (obj != NULL) {
-        Object* next = obj->next;
-        object_free(obj);
-        obj = next;
-    }
-}
-
 void vm_free(Ruja_Vm *vm) {
     bytecode_free(vm->bytecode);
     stack_free(vm->stack);
-    objects_free(vm->objects);
-    free(vm);
+    gc_free(vm);
+    Ruja_Allocator allocator = vm->allocator;
+    ruja_free(&allocator, vm->globals);
+    ruja_free(&allocator, vm);
 }
 
-static void add_to_list(Ruja_Vm *vm, Object* obj) {
-    obj->next = vm->objects;
-    vm->objects = obj;
+bool vm_reserve_globals(Ruja_Vm *vm, size_t count) {
+    if (count <= vm->n_globals) return true;
+
+    Word* globals = count <= SIZE_MAX / sizeof(Word) ? ruja_realloc(&vm->allocator, vm->globals, sizeof(Word) * count) : NULL;
+    if (globals == NULL) {
+        fprintf(stderr, "Could not allocate memory for globals\n");
+        return false;
+    }
+
+    for (size_t i = vm->n_globals; i < count; i++) {
+        globals[i] = MAKE_NIL();
+    }
+    vm->globals = globals;
+    vm->n_globals = count;
+
+    return true;
 }
 
 Object* vm_allocate_object(Ruja_Vm *vm, object_type type, ...) {
@@ -64,25 +75,521 @@ Object* vm_allocate_object(Ruja_Vm *vm, object_type type, ...) {
             const char* chars = va_arg(args, const char*);
             size_t length = va_arg(args, size_t);
 
-            ObjString* obj = obj_string_new(chars, length);
-            if (obj == NULL) return NULL;
-
             va_end(args);
 
-            add_to_list(vm, (Object*) obj);
+            ObjString* obj = obj_string_new(&vm->gc.slab, chars, length);
+            if (obj == NULL) return NULL;
+
+            gc_track(vm, (Object*) obj);
 
             return (Object*) obj;
         } break;
+        case OBJ_ROPE:
+        case OBJ_STRING_VIEW:
         default: {
-            fprintf(stderr, "Unknown object type '%d'\n", type);
+            // Ropes and views are made from other strings, by concat_words and vm_substring
+            fprintf(stderr, "Object type '%d' can not be allocated by vm_allocate_object\n", type);
             return NULL;
         }
     }
 }
 
+/**
+ * @brief Records the children of a new rope, once it was given to the gc. They may be young.
+ */
+static void rope_barrier(Ruja_Vm *vm, ObjRope* rope) {
+    if (IS_OBJECT(rope->left)) gc_write_barrier(&vm->gc, (Object*) rope, AS_OBJECT(rope->left));
+    if (IS_OBJECT(rope->right)) gc_write_barrier(&vm->gc, (Object*) rope, AS_OBJECT(rope->right));
+}
+
+/**
+ * @brief Builds a balanced rope over leaves[begin, end). The nodes are not given to the gc yet,
+ *      they are stored in nodes.
+ *
+ * @return Word The rope, or NIL if memory ran out.
+ */
+static Word build_balanced(Ruja_Slab* slab, Word* leaves, size_t begin, size_t end, ObjRope** nodes, size_t* n_nodes) {
+    if (end - begin == 1) return leaves[begin];
+
+    size_t middle = begin + (end - begin) / 2;
+    Word left = build_balanced(slab, leaves, begin, middle, nodes, n_nodes);
+    if (IS_NIL(left)) return left;
+    Word right = build_balanced(slab, leaves, middle, end, nodes, n_nodes);
+    if (IS_NIL(right)) return right;
+
+    ObjRope* rope = obj_rope_new(slab, left, right);
+    if (rope == NULL) return MAKE_NIL();
+    nodes[(*n_nodes)++] = rope;
+    return MAKE_OBJECT(rope);
+}
+
+// Enough slots for the forest of rebuild_spine to hold a rope of any length
+#define ROPE_FOREST_SLOTS 93
+
+/**
+ * @brief The forest of Boehm's rebalancing: slots[i] is NIL or a rope of at least
+ *      fibonacci[i] and less than fibonacci[i + 1] bytes. The slots hold consecutive parts
+ *      of the string, the higher slots come first.
+ */
+typedef struct {
+    Ruja_Slab* slab;
+    Word slots[ROPE_FOREST_SLOTS];
+    size_t fibonacci[ROPE_FOREST_SLOTS];
+    ObjRope** nodes;
+    size_t n_nodes;
+} Rope_Forest;
+
+/**
+ * @brief Stores into pieces, if not NULL, the subtrees of word that are kept as they are by
+ *      rebuild_spine: the leaves and the ropes of depth d that are at least fibonacci[d]
+ *      bytes long, which are balanced enough. The ropes above them are rebuilt.
+ *
+ * @return size_t The number of pieces.
+ */
+static size_t balanced_pieces(Word word, const size_t* fibonacci, Word* pieces) {
+    if (IS_ROPE(word) && AS_ROPE(word)->flat == NULL && AS_ROPE(word)->length < fibonacci[AS_ROPE(word)->depth]) {
+        size_t count = balanced_pieces(AS_ROPE(word)->left, fibonacci, pieces);
+        return count + balanced_pieces(AS_ROPE(word)->right, fibonacci, pieces == NULL ? NULL : pieces + count);
+    }
+
+    if (pieces != NULL) pieces[0] = word;
+    return 1;
+}
+
+/**
+ * @brief Stores into right the concatenation of left and right, or left if right is NIL.
+ *
+ * @return false If memory ran out.
+ */
+static bool forest_concat(Rope_Forest* forest, Word left, Word* right) {
+    if (IS_NIL(*right)) {
+        *right = left;
+        return true;
+    }
+
+    ObjRope* rope = obj_rope_new(forest->slab, left, *right);
+    if (rope == NULL) return false;
+    forest->nodes[forest->n_nodes++] = rope;
+    *right = MAKE_OBJECT(rope);
+    return true;
+}
+
+/**
+ * @brief Adds the piece that follows everything in the forest, merging it with the slots it
+ *      overlaps until it fits in an empty one.
+ *
+ * @return false If memory ran out.
+ */
+static bool forest_add(Rope_Forest* forest, Word piece) {
+    // The shorter ropes come before the piece, they are joined first
+    Word prefix = MAKE_NIL();
+    size_t slot = 0;
+    for (; slot + 1 < ROPE_FOREST_SLOTS && string_word_length(piece) >= forest->fibonacci[slot + 1]; slot++) {
+        if (IS_NIL(forest->slots[slot])) continue;
+        if (!forest_concat(forest, forest->slots[slot], &prefix)) return false;
+        forest->slots[slot] = MAKE_NIL();
+    }
+    if (!IS_NIL(prefix) && !forest_concat(forest, prefix, &piece)) return false;
+
+    while (true) {
+        for (; slot + 1 < ROPE_FOREST_SLOTS && string_word_length(piece) >= forest->fibonacci[slot + 1]; slot++) {
+            if (IS_NIL(forest->slots[slot])) continue;
+            if (!forest_concat(forest, forest->slots[slot], &piece)) return false;
+            forest->slots[slot] = MAKE_NIL();
+        }
+        if (IS_NIL(forest->slots[slot])) {
+            forest->slots[slot] = piece;
+            return true;
+        }
+        if (!forest_concat(forest, forest->slots[slot], &piece)) return false;
+        forest->slots[slot] = MAKE_NIL();
+    }
+}
+
+/**
+ * @brief Rebuilds the unbalanced top of a rope that is too deep, the appends below its last
+ *      rebalance, with Boehm's forest. The balanced subtrees are kept, so the work is that of
+ *      the spine that changed and not of every leaf. The nodes are not given to the gc yet,
+ *      they are stored in *nodes.
+ *
+ * @return Word The rope, or NIL if memory ran out.
+ */
+static Word rebuild_spine(Ruja_Vm *vm, ObjRope* rope, ObjRope*** nodes, size_t* n_nodes) {
+    Rope_Forest forest = { .slab = &vm->gc.slab, .nodes = NULL, .n_nodes = 0 };
+    forest.fibonacci[0] = 1;
+    forest.fibonacci[1] = 2;
+    for (size_t i = 2; i < ROPE_FOREST_SLOTS; i++) {
+        size_t sum = forest.fibonacci[i - 1] + forest.fibonacci[i - 2];
+        forest.fibonacci[i] = sum < forest.fibonacci[i - 1] ? SIZE_MAX : sum;
+    }
+    for (size_t i = 0; i < ROPE_FOREST_SLOTS; i++) {
+        forest.slots[i] = MAKE_NIL();
+    }
+
+    // The rope itself is always rebuilt, it is the one that got too deep
+    size_t n_left = balanced_pieces(rope->left, forest.fibonacci, NULL);
+    size_t n_pieces = n_left + balanced_pieces(rope->right, forest.fibonacci, NULL);
+    Word* pieces = ruja_alloc(&vm->allocator, sizeof(Word) * n_pieces);
+    // Every concatenation joins two trees into one, so there is one node less than pieces
+    forest.nodes = ruja_alloc(&vm->allocator, sizeof(ObjRope*) * n_pieces);
+    *nodes = forest.nodes;
+
+    Word root = MAKE_NIL();
+    bool ok = pieces != NULL && forest.nodes != NULL;
+    if (ok) {
+        balanced_pieces(rope->left, forest.fibonacci, pieces);
+        balanced_pieces(rope->right, forest.fibonacci, pieces + n_left);
+        for (size_t i = 0; ok && i < n_pieces; i++) {
+            ok = forest_add(&forest, pieces[i]);
+        }
+        for (size_t i = 0; ok && i < ROPE_FOREST_SLOTS; i++) {
+            if (!IS_NIL(forest.slots[i])) ok = forest_concat(&forest, forest.slots[i], &root);
+        }
+    }
+    ruja_free(&vm->allocator, pieces);
+    *n_nodes = forest.n_nodes;
+
+    return ok ? root : MAKE_NIL();
+}
+
+/**
+ * @brief Rebuilds a rope from all of its leaves. The nodes are not given to the gc yet, they
+ *      are stored in *nodes.
+ *
+ * @return Word The rope, or NIL if memory ran out.
+ */
+static Word rebuild_leaves(Ruja_Vm *vm, ObjRope* rope, ObjRope*** nodes, size_t* n_nodes) {
+    size_t n_leaves = rope_leaves(rope, NULL);
+    Word* leaves = ruja_alloc(&vm->allocator, sizeof(Word) * n_leaves);
+    *nodes = ruja_alloc(&vm->allocator, sizeof(ObjRope*) * n_leaves);
+    *n_nodes = 0;
+
+    Word root = MAKE_NIL();
+    if (leaves != NULL && *nodes != NULL) {
+        rope_leaves(rope, leaves);
+        root = build_balanced(&vm->gc.slab, leaves, 0, n_leaves, *nodes, n_nodes);
+    }
+    ruja_free(&vm->allocator, leaves);
+
+    return root;
+}
+
+/**
+ * @brief Frees nodes that were never given to the gc, and the array that holds them.
+ */
+static void free_nodes(Ruja_Vm *vm, ObjRope** nodes, size_t n_nodes) {
+    for (size_t i = 0; nodes != NULL && i < n_nodes; i++) object_free(&vm->gc.slab, (Object*) nodes[i]);
+    ruja_free(&vm->allocator, nodes);
+}
+
+/**
+ * @brief Stores into result a balanced rope with the leaves of a rope that is too deep.
+ *      Only its unbalanced top is rebuilt, unless that is still too deep, then every leaf is.
+ *      The rope itself was never given to the gc and is freed.
+ *
+ * @return false If memory ran out. The error is reported.
+ */
+static bool rebalance(Ruja_Vm *vm, ObjRope* rope, Word* result) {
+    ObjRope** nodes = NULL;
+    size_t n_nodes = 0;
+    Word root = rebuild_spine(vm, rope, &nodes, &n_nodes);
+    if (!IS_NIL(root) && IS_ROPE(root) && AS_ROPE(root)->depth > ROPE_MAX_DEPTH) {
+        free_nodes(vm, nodes, n_nodes);
+        root = rebuild_leaves(vm, rope, &nodes, &n_nodes);
+    }
+    object_free(&vm->gc.slab, (Object*) rope);
+
+    if (IS_NIL(root)) {
+        free_nodes(vm, nodes, n_nodes);
+        fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+
+    // The pieces are only reachable through the new nodes from now on: the root is stored
+    // before the nodes are given to the gc, so that the slice finds them all
+    *result = root;
+    gc_track_all(vm, (Object**) nodes, n_nodes);
+    for (size_t i = 0; i < n_nodes; i++) {
+        rope_barrier(vm, nodes[i]);
+    }
+    ruja_free(&vm->allocator, nodes);
+
+    return true;
+}
+
+/**
+ * @brief Gathers the bytes of a rope, if word holds one that is not flat yet. word must be
+ *      a root.
+ *
+ * @return false If memory ran out. The error is reported.
+ */
+static bool flatten_word(Ruja_Vm *vm, Word* word) {
+    if (!IS_ROPE(*word) || AS_ROPE(*word)->flat != NULL) return true;
+
+    ObjString* flat = obj_string_alloc(&vm->gc.slab, AS_ROPE(*word)->length);
+    if (flat == NULL) {
+        fprintf(stderr, RED"ERROR: "WHITE"Out of memory while flattening a string in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+    gc_track(vm, (Object*) flat);
+
+    ObjRope* rope = AS_ROPE(*word);
+    rope_flatten_into(rope, flat);
+    gc_write_barrier(&vm->gc, (Object*) rope, (Object*) flat);
+    return true;
+}
+
+/**
+ * @brief Concatenates two string values into result. Strings that fit in a word are not
+ *      allocated, long ones are ropes and the others are allocated young if they fit in the
+ *      nursery. A short string appended to a rope is merged into its last leaf when both stay
+ *      shorter than ROPE_MIN_LENGTH, like Boehm's ropes do.
+ *
+ * @return false If memory ran out. The error is reported.
+ */
+static bool concat_words(Ruja_Vm *vm, Word* operand1, Word* operand2, Word* result) {
+    size_t length = string_word_length(*operand1) + string_word_length(*operand2);
+    if (length >= ROPE_MIN_LENGTH && IS_ROPE(*operand1) && AS_ROPE(*operand1)->flat == NULL && !IS_ROPE(*operand2)
+        && !IS_ROPE(AS_ROPE(*operand1)->right)
+        && string_word_length(AS_ROPE(*operand1)->right) + string_word_length(*operand2) < ROPE_MIN_LENGTH) {
+        // Appending a short string to a rope that ends with a short leaf, as a loop of s += "xy"
+        // does: the two are merged into one flat leaf, so the rope does not get a node deeper.
+        // The rope is old and remembers a young right leaf, a minor collection updates it
+        Word leaf;
+        if (!concat_words(vm, &AS_ROPE(*operand1)->right, operand2, &leaf)) return false;
+
+        ObjRope* rope = obj_rope_new(&vm->gc.slab, AS_ROPE(*operand1)->left, leaf);
+        if (rope == NULL) {
+            fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+            return false;
+        }
+        gc_track(vm, (Object*) rope);
+        rope_barrier(vm, rope);
+        *result = MAKE_OBJECT(rope);
+        return true;
+    }
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = obj_rope_new(&vm->gc.slab, *operand1, *operand2);
+        if (rope == NULL) {
+            fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+            return false;
+        }
+        if (rope->depth > ROPE_MAX_DEPTH) return rebalance(vm, rope, result);
+
+        gc_track(vm, (Object*) rope);
+        rope_barrier(vm, rope);
+        *result = MAKE_OBJECT(rope);
+        return true;
+    }
+
+    // Shorter than ROPE_MIN_LENGTH, neither operand is a rope
+    char buffer1[SSTR_MAX + 1];
+    char buffer2[SSTR_MAX + 1];
+    size_t length1, length2;
+    const char* chars1 = string_word_chars(*operand1, buffer1, &length1);
+    const char* chars2 = string_word_chars(*operand2, buffer2, &length2);
+
+    if (length <= SSTR_MAX) {
+        char chars[SSTR_MAX];
+        memcpy(chars, chars1, length1);
+        memcpy(chars + length1, chars2, length2);
+        *result = make_sstr(chars, length);
+        return true;
+    }
+
+    ObjString *string3 = NULL;
+    void* memory = gc_allocate_young(vm, sizeof(ObjString) + length + 1);
+    if (memory != NULL) {
+        // A minor collection may have moved the operands
+        chars1 = string_word_chars(*operand1, buffer1, &length1);
+        chars2 = string_word_chars(*operand2, buffer2, &length2);
+        string3 = string_concat_into(memory, chars1, length1, chars2, length2);
+        gc_track_young(vm, (Object*) string3);
+    } else {
+        string3 = obj_string_alloc(&vm->gc.slab, length);
+        if (string3 == NULL) {
+            fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+            return false;
+        }
+        memcpy(string3->chars, chars1, length1);
+        memcpy(string3->chars + length1, chars2, length2);
+        gc_track(vm, (Object*) string3);
+    }
+    *result = MAKE_OBJECT(string3);
+
+    return true;
+}
+
+/**
+ * @brief Concatenates the n string values of words into result with a single allocation of
+ *      the final size. A result long enough to be a rope is built by concatenating the words
+ *      one after the other instead, a rope node costs no copy.
+ *      The words must be roots, like the operands of concat_words.
+ *
+ * @return false If a word is not a string or memory ran out. The error is reported.
+ */
+static bool concat_n_words(Ruja_Vm *vm, Word* words, size_t n, Word* result) {
+    size_t length = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!IS_ANY_STRING(words[i])) {
+            fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+            return false;
+        }
+        length += string_word_length(words[i]);
+    }
+
+    if (length >= ROPE_MIN_LENGTH) {
+        for (size_t i = 1; i < n; i++) {
+            if (!concat_words(vm, &words[0], &words[i], &words[0])) return false;
+        }
+        *result = words[0];
+        return true;
+    }
+
+    // Shorter than ROPE_MIN_LENGTH, no word is a rope
+    char buffer[SSTR_MAX + 1];
+    size_t part;
+    if (length <= SSTR_MAX) {
+        char chars[SSTR_MAX];
+        size_t offset = 0;
+        for (size_t i = 0; i < n; i++) {
+            const char* part_chars = string_word_chars(words[i], buffer, &part);
+            memcpy(chars + offset, part_chars, part);
+            offset += part;
+        }
+        *result = make_sstr(chars, length);
+        return true;
+    }
+
+    // Only read after the allocation, a minor collection may move the words
+    ObjString* string = NULL;
+    void* memory = gc_allocate_young(vm, sizeof(ObjString) + length + 1);
+    if (memory != NULL) {
+        string = string_init_into(memory, length);
+    } else {
+        string = obj_string_alloc(&vm->gc.slab, length);
+        if (string == NULL) {
+            fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+            return false;
+        }
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char* part_chars = string_word_chars(words[i], buffer, &part);
+        memcpy(string->chars + offset, part_chars, part);
+        offset += part;
+    }
+
+    if (memory != NULL) {
+        gc_track_young(vm, (Object*) string);
+    } else {
+        gc_track(vm, (Object*) string);
+    }
+    *result = MAKE_OBJECT(string);
+
+    return true;
+}
+
+bool vm_substring(Ruja_Vm *vm, Word* string, size_t offset, size_t length, Word* result) {
+    if (!IS_ANY_STRING(*string) || offset > string_word_length(*string) || length > string_word_length(*string) - offset) {
+        fprintf(stderr, RED"ERROR: "WHITE"Invalid substring [%zu, %zu + %zu) in ip '%zu' VM.\n"RESET, offset, offset, length, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+
+    if (!flatten_word(vm, string)) return false;
+    if (length <= SSTR_MAX) {
+        char buffer[SSTR_MAX + 1];
+        size_t total;
+        const char* chars = string_word_chars(*string, buffer, &total);
+        *result = make_sstr(chars + offset, length);
+        return true;
+    }
+
+    // A view of a view or of a rope is a view of the flat string under it
+    ObjString* parent = NULL;
+    if (IS_STRING_VIEW(*string)) {
+        offset += AS_STRING_VIEW(*string)->offset;
+        parent = AS_STRING_VIEW(*string)->parent;
+    } else {
+        parent = IS_ROPE(*string) ? AS_ROPE(*string)->flat : AS_STRING(*string);
+    }
+
+    ObjStringView* view = obj_string_view_new(&vm->gc.slab, parent, offset, length);
+    if (view == NULL) {
+        fprintf(stderr, RED"ERROR: "WHITE"Out of memory while slicing a string in ip '%zu' VM.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+    gc_track(vm, (Object*) view);
+    gc_write_barrier(&vm->gc, (Object*) view, (Object*) parent);
+    *result = MAKE_OBJECT(view);
+
+    return true;
+}
+
+/**
+ * @brief Adds two words of the same type, concatenating strings, into result.
+ *      The operands are given by address and must be roots (stack or globals): the
+ *      allocation of a concatenation can move young strings.
+ *
+ * @return false If the types can not be added or memory ran out. The error is reported.
+ */
+static bool add_words(Ruja_Vm *vm, Word* operand1, Word* operand2, Word* result) {
+    Word word1 = *operand1;
+    Word word2 = *operand2;
+    if (IS_DOUBLE(word1) && IS_DOUBLE(word2)) {
+        *result = MAKE_DOUBLE(AS_DOUBLE(word1) + AS_DOUBLE(word2));
+    } else if (IS_ANY_STRING(word1) && IS_ANY_STRING(word2)) {
+        return concat_words(vm, operand1, operand2, result);
+    } else if (TYPE(word1) != TYPE(word2)) {
+        fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    } else if (IS_INT(word1)) {
+        *result = MAKE_INT((uint32_t) AS_INT(word1) + (uint32_t) AS_INT(word2));
+    } else {
+        fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Adds an i32 to a number in place, the body of OP_INC_* and OP_ADD_*_CONST.
+ */
+static bool update_slot(Ruja_Vm *vm, bool local, size_t slot, int32_t k) {
+    if (slot >= (local ? vm->stack->count : vm->n_globals)) {
+        fprintf(stderr, RED"BUG: "WHITE"Invalid slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+
+    Word* word = local ? &vm->stack->items[slot] : &vm->globals[slot];
+    if (IS_INT(*word)) {
+        *word = MAKE_INT((uint32_t) AS_INT(*word) + (uint32_t) k);
+    } else if (IS_DOUBLE(*word)) {
+        *word = MAKE_DOUBLE(AS_DOUBLE(*word) + k);
+    } else {
+        fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, (size_t) (vm->ip - vm->bytecode->items));
+        return false;
+    }
+
+    return true;
+}
+
 Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
     #define IP_NUMBER() ((size_t) (vm->ip - vm->bytecode->items))
     #define READ_BYTE(x) (*(vm->ip + (x)))
+    // Operands are found from the start of the instruction with the widths of the opcode table.
+    // The widths are constants, every operand is a single load
+    #define OPERAND0(name) read_operand(start + 1, OPERAND_WIDTH(name, 0))
+    #define OPERAND1(name) read_operand(start + 1 + OPERAND_WIDTH(name, 0), OPERAND_WIDTH(name, 1))
+    #define SKIP(name) (vm->ip = start + INSTRUCTION_SIZE(name))
+    // The stack reports it when it can not grow
+    #define PUSH(word) do { \
+            Word* top = stack_push(vm->stack, (word)); \
+            if (top == NULL) return RUJA_VM_ERROR; \
+            vm->sp = top; \
+        } while (0)
 
     #if 1
     disassemble(vm->bytecode, "VM RUN");
@@ -102,6 +609,7 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
 
         #endif
 
+        uint8_t* start = vm->ip;
         Opcode opcode = *vm->ip++;
         switch (opcode) {
             default: {
@@ -112,21 +620,35 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 return RUJA_VM_OK;
             }
             case OP_CONST: {
-                size_t constant_index = (((size_t) READ_BYTE(0)) << 24) |
-                                        (((size_t) READ_BYTE(1)) << 16) |
-                                        (((size_t) READ_BYTE(2)) << 8) |
-                                        (((size_t) READ_BYTE(3)));
-                vm->sp = stack_push(vm->stack, vm->bytecode->constants->items[constant_index]);
-                vm->ip += 4;
+                PUSH(vm->bytecode->constants->items[OPERAND0(CONST)]);
+                SKIP(CONST);
+            } break;
+            case OP_CONST8: {
+                PUSH(vm->bytecode->constants->items[OPERAND0(CONST8)]);
+                SKIP(CONST8);
+            } break;
+            case OP_PUSH_ZERO: {
+                PUSH(MAKE_INT(0));
+            } break;
+            case OP_PUSH_ONE: {
+                PUSH(MAKE_INT(1));
+            } break;
+            case OP_PUSH_I8: {
+                PUSH(MAKE_INT((int8_t) OPERAND0(PUSH_I8)));
+                SKIP(PUSH_I8);
+            } break;
+            case OP_PUSH_I32: {
+                PUSH(MAKE_INT(OPERAND0(PUSH_I32)));
+                SKIP(PUSH_I32);
             } break;
             case OP_NIL: {
-                vm->sp = stack_push(vm->stack, MAKE_NIL());
+                PUSH(MAKE_NIL());
             } break;
             case OP_TRUE: {
-                vm->sp = stack_push(vm->stack, MAKE_BOOL(true));
+                PUSH(MAKE_BOOL(true));
             } break;
             case OP_FALSE: {
-                vm->sp = stack_push(vm->stack, MAKE_BOOL(false));
+                PUSH(MAKE_BOOL(false));
             } break;
             case OP_NEG: {
                 if (vm->stack->count < 1) {
@@ -151,7 +673,7 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 }
 
                 Word word = *vm->sp;
-                if (IS_OBJECT(word)) {
+                if (IS_OBJECT(word) || IS_SSTR(word)) {
                     fprintf(stderr, RED"BUG: "WHITE"Invalid type for negation in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
                     return RUJA_VM_ERROR;
                 }
@@ -164,32 +686,22 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                     return RUJA_VM_ERROR;
                 }
 
-                Word word1 = *(vm->sp-1);
-                Word word2 = *vm->sp--;
-
-                if (IS_DOUBLE(word1) && IS_DOUBLE(word1)) {
-                    *vm->sp = MAKE_DOUBLE(AS_DOUBLE(word1) + AS_DOUBLE(word2));
-                    vm->stack->count--;
-                } else if (TYPE(word1) != TYPE(word2)) {
-                    fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
-                    return RUJA_VM_ERROR;
-                } else if (IS_INT(word1)) {
-                    *vm->sp = MAKE_INT(AS_INT(word1) + AS_INT(word2));
-                    vm->stack->count--;
-                    
-                } else if (IS_STRING(word1)) {
-                    ObjString *string3 = string_add(AS_STRING(word1), AS_STRING(word2));
-                    if (string3 == NULL) {
-                        fprintf(stderr, RED"ERROR: "WHITE"Out of memory while concatenating strings in ip '%zu' VM.\n"RESET, IP_NUMBER());
-                        return RUJA_VM_ERROR;
-                    }
-                    add_to_list(vm, (Object*) string3);
-                    *vm->sp = MAKE_OBJECT(string3);
-                    vm->stack->count--;
-                } else {
-                    fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
+                if (!add_words(vm, vm->sp - 1, vm->sp, vm->sp - 1)) return RUJA_VM_ERROR;
+                vm->sp--;
+                vm->stack->count--;
+            } break;
+            case OP_CONCAT_N: {
+                size_t n = OPERAND0(CONCAT_N);
+                if (n < 2 || vm->stack->count < n) {
+                    fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
                     return RUJA_VM_ERROR;
                 }
+
+                Word* words = vm->sp - (n - 1);
+                if (!concat_n_words(vm, words, n, words)) return RUJA_VM_ERROR;
+                vm->sp -= n - 1;
+                vm->stack->count -= n - 1;
+                SKIP(CONCAT_N);
             } break;
             case OP_SUB : {
                 if (vm->stack->count < 2) {
@@ -200,7 +712,7 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 Word word1 = *(vm->sp-1);
                 Word word2 = *vm->sp--;
 
-                if (IS_DOUBLE(word1) && IS_DOUBLE(word1)) {
+                if (IS_DOUBLE(word1) && IS_DOUBLE(word2)) {
                     *vm->sp = MAKE_DOUBLE(AS_DOUBLE(word1) - AS_DOUBLE(word2));
                     vm->stack->count--;
                 } else if (TYPE(word1) != TYPE(word2)) {
@@ -223,7 +735,7 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 Word word1 = *(vm->sp-1);
                 Word word2 = *vm->sp--;
 
-                if (IS_DOUBLE(word1) && IS_DOUBLE(word1)) {
+                if (IS_DOUBLE(word1) && IS_DOUBLE(word2)) {
                     *vm->sp = MAKE_DOUBLE(AS_DOUBLE(word1) * AS_DOUBLE(word2));
                     vm->stack->count--;
                 } else if (TYPE(word1) != TYPE(word2)) {
@@ -246,44 +758,68 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 Word word1 = *(vm->sp-1);
                 Word word2 = *vm->sp--;
 
-                if (IS_DOUBLE(word1) && IS_DOUBLE(word1)) {
+                if (IS_DOUBLE(word1) && IS_DOUBLE(word2)) {
                     if (AS_DOUBLE(word2) == 0.0) {
                         fprintf(stderr, "Division by zero at ip=%"PRIu64"\n", IP_NUMBER());
                         return RUJA_VM_ERROR;
                     }
-                    *vm->sp = MAKE_DOUBLE(AS_DOUBLE(word1) * AS_DOUBLE(word2));
+                    *vm->sp = MAKE_DOUBLE(AS_DOUBLE(word1) / AS_DOUBLE(word2));
                     vm->stack->count--;
                 } else if (TYPE(word1) != TYPE(word2)) {
-                    fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid types for division in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
                     return RUJA_VM_ERROR;
                 } else if (IS_INT(word1)) {
                     if (AS_INT(word2) == 0) {
                         fprintf(stderr, "Division by zero at ip=%"PRIu64"\n", IP_NUMBER());
                         return RUJA_VM_ERROR;
                     }
-                    *vm->sp = MAKE_INT(AS_INT(word1) * AS_INT(word2));
+                    // INT32_MIN / -1 overflows in C, it is divided in 64 bits and wraps around to INT32_MIN
+                    *vm->sp = MAKE_INT((int32_t) ((int64_t) AS_INT(word1) / AS_INT(word2)));
                     vm->stack->count--;
                 } else {
                     fprintf(stderr, RED"BUG: "WHITE"Invalid types for addition in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
                     return RUJA_VM_ERROR;
                 }
             } break;
+            case OP_MOD : {
+                if (vm->stack->count < 2) {
+                    fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                Word word1 = *(vm->sp-1);
+                Word word2 = *vm->sp--;
+
+                if (!IS_INT(word1) || !IS_INT(word2)) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid types for '%%' in ip '%zu' VM. This is probably a bug in the type checking.\n"RESET, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+                if (AS_INT(word2) == 0) {
+                    fprintf(stderr, "Division by zero at ip=%"PRIu64"\n", IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                // INT32_MIN % -1 overflows in C, the result is 0
+                *vm->sp = MAKE_INT(AS_INT(word2) == -1 ? 0 : AS_INT(word1) % AS_INT(word2));
+                vm->stack->count--;
+            } break;
             case OP_EQ  : {
                 if (vm->stack->count < 2) {
                     fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
                     return RUJA_VM_ERROR;
                 }
+                if (!flatten_word(vm, vm->sp - 1) || !flatten_word(vm, vm->sp)) return RUJA_VM_ERROR;
 
                 Word word1 = *(vm->sp-1);
                 Word word2 = *vm->sp--;
 
-                if (TYPE(word1) != TYPE(word2)) {
+                if (IS_ANY_STRING(word1) && IS_ANY_STRING(word2)) {
+                    *vm->sp = MAKE_BOOL(string_words_equal(word1, word2));
+                } else if (TYPE(word1) != TYPE(word2)) {
                     *vm->sp = MAKE_BOOL(false);
                 } else {
                     if (IS_DOUBLE(word1)) {
                         *vm->sp = MAKE_BOOL(AS_DOUBLE(word1) == AS_DOUBLE(word2));
-                    } else if (IS_STRING(word1)) {
-                        *vm->sp = MAKE_BOOL(string_equal(AS_STRING(word1), AS_STRING(word2)));
                     } else {
                         *vm->sp = MAKE_BOOL(word1 == word2);
                     }
@@ -296,17 +832,18 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                     fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
                     return RUJA_VM_ERROR;
                 }
+                if (!flatten_word(vm, vm->sp - 1) || !flatten_word(vm, vm->sp)) return RUJA_VM_ERROR;
 
                 Word word1 = *(vm->sp-1);
                 Word word2 = *vm->sp--;
 
-                if (TYPE(word1) != TYPE(word2)) {
+                if (IS_ANY_STRING(word1) && IS_ANY_STRING(word2)) {
+                    *vm->sp = MAKE_BOOL(!string_words_equal(word1, word2));
+                } else if (TYPE(word1) != TYPE(word2)) {
                     *vm->sp = MAKE_BOOL(true);
                 } else {
                     if (IS_DOUBLE(word1)) {
                         *vm->sp = MAKE_BOOL(AS_DOUBLE(word1) != AS_DOUBLE(word2));
-                    } else if (IS_STRING(word1)) {
-                        *vm->sp = MAKE_BOOL(!string_equal(AS_STRING(word1), AS_STRING(word2)));
                     } else {
                         *vm->sp = MAKE_BOOL(word1 != word2);
                     }
@@ -449,11 +986,7 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 vm->stack->count--;
             } break;
             case OP_JUMP: {
-                size_t operand = (((size_t) READ_BYTE(0)) << 24) |
-                                (((size_t)  READ_BYTE(1)) << 16) |
-                                (((size_t)  READ_BYTE(2)) << 8) |
-                                (((size_t)  READ_BYTE(3)));
-                vm->ip += operand - 1;
+                vm->ip = start + OPERAND0(JUMP);
             } break;
             case OP_JZ: {
                 if (vm->stack->count < 1) {
@@ -465,18 +998,161 @@ Ruja_Vm_Status vm_run(Ruja_Vm *vm) {
                 vm->stack->count--;
 
                 if (AS_BOOL(word)) {
-                    vm->ip += 4;
+                    SKIP(JZ);
                 } else {
-                    size_t operand = (((size_t) READ_BYTE(0)) << 24) |
-                                    (((size_t)  READ_BYTE(1)) << 16) |
-                                    (((size_t)  READ_BYTE(2)) << 8) |
-                                    (((size_t)  READ_BYTE(3)));
-                    vm->ip += operand - 1;
+                    vm->ip = start + OPERAND0(JZ);
+                }
+            } break;
+            case OP_INC_LOCAL: {
+                if (!update_slot(vm, true, OPERAND0(INC_LOCAL), 1)) return RUJA_VM_ERROR;
+                SKIP(INC_LOCAL);
+            } break;
+            case OP_INC_GLOBAL: {
+                if (!update_slot(vm, false, OPERAND0(INC_GLOBAL), 1)) return RUJA_VM_ERROR;
+                SKIP(INC_GLOBAL);
+            } break;
+            case OP_ADD_LOCAL_CONST: {
+                if (!update_slot(vm, true, OPERAND0(ADD_LOCAL_CONST), (int32_t) OPERAND1(ADD_LOCAL_CONST))) return RUJA_VM_ERROR;
+                SKIP(ADD_LOCAL_CONST);
+            } break;
+            case OP_ADD_GLOBAL_CONST: {
+                if (!update_slot(vm, false, OPERAND0(ADD_GLOBAL_CONST), (int32_t) OPERAND1(ADD_GLOBAL_CONST))) return RUJA_VM_ERROR;
+                SKIP(ADD_GLOBAL_CONST);
+            } break;
+            case OP_ADD_LOCAL:
+            case OP_ADD_GLOBAL: {
+                bool local = opcode == OP_ADD_LOCAL;
+                size_t slot = local ? OPERAND0(ADD_LOCAL) : OPERAND0(ADD_GLOBAL);
+                if (local) SKIP(ADD_LOCAL);
+                else SKIP(ADD_GLOBAL);
+
+                // A local is below the value it is added
+                if (vm->stack->count < 1 || (local ? slot + 1 >= vm->stack->count : slot >= vm->n_globals)) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                // The value stays on the stack until the addition is done, it is a root
+                Word* word = local ? &vm->stack->items[slot] : &vm->globals[slot];
+                if (!add_words(vm, word, vm->sp, word)) return RUJA_VM_ERROR;
+                if (!local) gc_store_global(&vm->gc, slot, *word);
+                vm->sp--;
+                vm->stack->count--;
+            } break;
+            case OP_LOOP: {
+                vm->ip = start - OPERAND0(LOOP);
+            } break;
+            case OP_FOR_PREP: {
+                size_t slot = OPERAND0(FOR_PREP);
+                size_t exit = OPERAND1(FOR_PREP);
+                SKIP(FOR_PREP);
+                if (slot + 3 > vm->stack->count) {
+                    fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                // The counter (the loop variable), the end and the step
+                Word* range = &vm->stack->items[slot];
+                if (!IS_INT(range[0]) || !IS_INT(range[1]) || !IS_INT(range[2])) {
+                    fprintf(stderr, RED"ERROR: "WHITE"The bounds and the step of a range must be integers in ip '%zu' VM.\n"RESET, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                int32_t step = AS_INT(range[2]);
+                if (step == 0) {
+                    fprintf(stderr, RED"ERROR: "WHITE"The step of a range can not be zero in ip '%zu' VM.\n"RESET, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                if (step > 0 ? AS_INT(range[0]) >= AS_INT(range[1]) : AS_INT(range[0]) <= AS_INT(range[1])) {
+                    vm->ip = start + exit;
+                }
+            } break;
+            case OP_FOR_RANGE: {
+                size_t slot = OPERAND0(FOR_RANGE);
+                size_t back = OPERAND1(FOR_RANGE);
+                SKIP(FOR_RANGE);
+                if (slot + 3 > vm->stack->count) {
+                    fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
+                    return RUJA_VM_ERROR;
                 }
+
+                // OP_FOR_PREP checked the end and the step, the counter is stepped in place. The body may
+                // have assigned the loop variable, which must still be an integer.
+                // The sum is done in 64 bits so a range ending close to the limits of i32 does not wrap around
+                Word* range = &vm->stack->items[slot];
+                if (!IS_INT(range[0])) {
+                    fprintf(stderr, RED"ERROR: "WHITE"The loop variable of a range must stay an integer in ip '%zu' VM.\n"RESET, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+                int32_t step = AS_INT(range[2]);
+                int64_t next = (int64_t) AS_INT(range[0]) + step;
+                if (step > 0 ? next < AS_INT(range[1]) : next > AS_INT(range[1])) {
+                    range[0] = MAKE_INT((int32_t) next);
+                    vm->ip = start - back;
+                }
+            } break;
+            case OP_POP: {
+                size_t count = OPERAND0(POP);
+                SKIP(POP);
+                if (vm->stack->count < count) {
+                    fprintf(stderr, "Stack underflow at ip=%"PRIu64"\n", IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                vm->stack->count -= count;
+                vm->sp -= count;
+            } break;
+            case OP_GET_LOCAL: {
+                size_t slot = OPERAND0(GET_LOCAL);
+                SKIP(GET_LOCAL);
+                if (slot >= vm->stack->count) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid local slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                PUSH(vm->stack->items[slot]);
+            } break;
+            case OP_SET_LOCAL: {
+                size_t slot = OPERAND0(SET_LOCAL);
+                SKIP(SET_LOCAL);
+                if (slot + 1 >= vm->stack->count) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid local slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                vm->stack->items[slot] = *vm->sp--;
+                vm->stack->count--;
+            } break;
+            case OP_GET_GLOBAL: {
+                size_t slot = OPERAND0(GET_GLOBAL);
+                SKIP(GET_GLOBAL);
+                if (slot >= vm->n_globals) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid global slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                PUSH(vm->globals[slot]);
+            } break;
+            case OP_SET_GLOBAL: {
+                size_t slot = OPERAND0(SET_GLOBAL);
+                SKIP(SET_GLOBAL);
+                if (slot >= vm->n_globals || vm->stack->count < 1) {
+                    fprintf(stderr, RED"BUG: "WHITE"Invalid global slot '%zu' in ip '%zu' VM. This is probably a bug in the compiler.\n"RESET, slot, IP_NUMBER());
+                    return RUJA_VM_ERROR;
+                }
+
+                vm->globals[slot] = *vm->sp--;
+                vm->stack->count--;
+                gc_store_global(&vm->gc, slot, vm->globals[slot]);
             } break;
         }
     }
 
 #undef IP_NUMBER
 #undef READ_BYTE
+#undef OPERAND0
+#undef OPERAND1
+#undef SKIP
+#undef PUSH
 }
@@ -22,6 +22,11 @@ void print_word(FILE* stream, Word w, int width) {
         case TYPE_CHAR:
             fprintf(stream, "%*c", width, AS_CHAR(w));
             break;
+        case TYPE_SSTR: {
+            char buffer[SSTR_MAX + 1];
+            sstr_unpack(w, buffer);
+            fprintf(stream, "%*s", width, buffer);
+        } break;
         case TYPE_OBJ:
             print_object(stream, AS_OBJECT(w), width);
             break;